@@ -0,0 +1,277 @@
+// A compile server (see `compile_server_pool`) built on libclang. Since it
+// stays alive between tests, it keeps the translation units it's parsed
+// around, and when a later test starts with the same preamble (i.e. the same
+// leading `#include`s) and options, libclang reuses the precompiled preamble
+// rather than parsing those headers again.
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <clang-c/Index.h>
+
+#include "../src/filesystem.hpp"
+#include "../src/server_protocol.hpp"
+
+namespace caliber {
+
+  namespace {
+    // The most translation units to keep around at once. Each one holds its
+    // preamble in memory, so this shouldn't be too large.
+    const std::size_t max_units = 8;
+
+    std::string to_string(CXString str) {
+      std::string result = clang_getCString(str);
+      clang_disposeString(str);
+      return result;
+    }
+
+    void replace_all(std::string &str, std::string_view from,
+                     std::string_view to) {
+      for(auto i = str.find(from); i != std::string::npos;
+          i = str.find(from, i + to.size()))
+        str.replace(i, from.size(), to);
+    }
+
+    bool starts_with(std::string_view str, std::string_view prefix) {
+      return str.substr(0, prefix.size()) == prefix;
+    }
+
+    // Options that ask the compiler to write something other than
+    // diagnostics. libclang can't do that, so leave it to the compiler.
+    bool unsupported_arg(std::string_view arg) {
+      return arg == "-M" || arg == "-MM" || arg == "-MD" || arg == "-MMD" ||
+             arg == "-MF" || arg == "-ftime-report" ||
+             starts_with(arg, "-ftime-trace");
+    }
+
+    struct unit {
+      std::vector<std::string> args;
+      CXTranslationUnit tu;
+    };
+
+    class clang_server {
+    public:
+      clang_server() : index_(clang_createIndex(0, 0)) {}
+      clang_server(const clang_server &) = delete;
+      clang_server & operator =(const clang_server &) = delete;
+
+      ~clang_server() {
+        for(auto &i : units_)
+          clang_disposeTranslationUnit(i.tu);
+        clang_disposeIndex(index_);
+      }
+
+      caliber::server::reply compile(const caliber::server::request &req);
+    private:
+      CXTranslationUnit parse(const std::vector<std::string> &args,
+                              CXUnsavedFile &source);
+
+      CXIndex index_;
+      // The most recently-used units are at the front.
+      std::list<unit> units_;
+    };
+
+    caliber::server::reply
+    clang_server::compile(const caliber::server::request &req) {
+      namespace fs = FILESYSTEM_NS;
+      using caliber::server::verdict;
+
+      caliber::server::reply result;
+      const auto &args = req.args;
+      if(args.size() < 2)
+        return result;
+      for(const auto &i : args) {
+        if(unsupported_arg(i))
+          return result;
+      }
+
+      // The source is always the last argument (see `translate_args`).
+      std::string name, source, ext;
+      if(req.input) {
+        if(args.back() != "-")
+          return result;
+        name = "<stdin>";
+        source = *req.input;
+        ext = args[args.size() - 2] == "c" ? ".c" : ".cpp";
+      } else {
+        name = args.back();
+        std::ifstream in(name, std::ios::binary);
+        if(!in)
+          return result;
+        source.assign(std::istreambuf_iterator<char>(in),
+                      std::istreambuf_iterator<char>());
+        ext = fs::path(name).extension().string();
+      }
+
+      // Compile the source as though it were a file with the same name in the
+      // same directory every time, so that tests with the same options can
+      // share a preamble. This is only invisible to the test if it doesn't
+      // ask for its own name.
+      std::string main = name;
+      if(req.input || (source.find("__FILE__") == std::string::npos &&
+                       source.find("__BASE_FILE__") == std::string::npos)) {
+        auto dir = req.input ? fs::path() : fs::path(name).parent_path();
+        main = (dir / (".caliber-server-main" + ext)).string();
+      }
+
+      auto unit_args = args;
+      unit_args.back() = main;
+      CXUnsavedFile unsaved = {main.c_str(), source.data(),
+                               static_cast<unsigned long>(source.size())};
+      CXTranslationUnit tu = parse(unit_args, unsaved);
+      if(!tu)
+        return result;
+
+      std::size_t errors = 0;
+      auto add_diagnostic = [&](CXDiagnostic diag) {
+        if(clang_getDiagnosticSeverity(diag) >= CXDiagnostic_Error)
+          errors++;
+        result.output += to_string(clang_formatDiagnostic(
+          diag, clang_defaultDiagnosticDisplayOptions()
+        )) + "\n";
+      };
+
+      CXDiagnosticSet diags = clang_getDiagnosticSetFromTU(tu);
+      for(unsigned i = 0, n = clang_getNumDiagnosticsInSet(diags); i != n;
+          i++) {
+        CXDiagnostic diag = clang_getDiagnosticInSet(diags, i);
+        add_diagnostic(diag);
+        CXDiagnosticSet notes = clang_getChildDiagnostics(diag);
+        for(unsigned j = 0, m = clang_getNumDiagnosticsInSet(notes); j != m;
+            j++)
+          add_diagnostic(clang_getDiagnosticInSet(notes, j));
+        clang_disposeDiagnostic(diag);
+      }
+      clang_disposeDiagnosticSet(diags);
+
+      if(errors) {
+        result.output += std::to_string(errors) +
+                         (errors == 1 ? " error" : " errors") + " generated.\n";
+      }
+      if(main != name)
+        replace_all(result.output, main, name);
+      result.status = errors ? verdict::fail : verdict::pass;
+
+      // The cache already knows what was read from stdin, so only report the
+      // source when it's a real file.
+      clang_getInclusions(tu, [](CXFile file, CXSourceLocation *, unsigned,
+                                 CXClientData data) {
+        auto &includes = *static_cast<std::vector<std::string> *>(data);
+        includes.push_back(to_string(clang_getFileName(file)));
+      }, &result.includes);
+      for(auto i = result.includes.begin(); i != result.includes.end(); ++i) {
+        if(*i == main) {
+          if(req.input)
+            result.includes.erase(i);
+          else
+            *i = name;
+          break;
+        }
+      }
+
+      return result;
+    }
+
+    CXTranslationUnit
+    clang_server::parse(const std::vector<std::string> &args,
+                        CXUnsavedFile &source) {
+      for(auto i = units_.begin(); i != units_.end(); ++i) {
+        if(i->args != args)
+          continue;
+
+        units_.splice(units_.begin(), units_, i);
+        auto tu = units_.front().tu;
+        if(clang_reparseTranslationUnit(tu, 1, &source,
+                                        clang_defaultReparseOptions(tu)) ==
+           CXError_Success)
+          return tu;
+
+        // A failed reparse leaves the unit unusable, so start over.
+        clang_disposeTranslationUnit(tu);
+        units_.pop_front();
+        break;
+      }
+
+      std::vector<const char *> argv;
+      for(const auto &i : args)
+        argv.push_back(i.c_str());
+
+      CXTranslationUnit tu;
+      if(clang_parseTranslationUnit2FullArgv(
+           index_, nullptr, argv.data(), static_cast<int>(argv.size()),
+           &source, 1, CXTranslationUnit_PrecompiledPreamble |
+           CXTranslationUnit_CreatePreambleOnFirstParse, &tu
+         ) != CXError_Success)
+        return nullptr;
+
+      units_.push_front({args, tu});
+      if(units_.size() > max_units) {
+        clang_disposeTranslationUnit(units_.back().tu);
+        units_.pop_back();
+      }
+      return tu;
+    }
+
+    bool write_all(int fd, std::string_view data) {
+      while(!data.empty()) {
+        ssize_t size = write(fd, data.data(), data.size());
+        if(size < 0) {
+          if(errno == EINTR)
+            continue;
+          return false;
+        }
+        data.remove_prefix(size);
+      }
+      return true;
+    }
+  }
+
+} // namespace caliber
+
+int main() {
+  namespace server = caliber::server;
+
+  caliber::clang_server s;
+  if(!caliber::write_all(STDOUT_FILENO, server::encode(server::hello{
+    server::protocol_version, caliber::to_string(clang_getClangVersion())
+  })))
+    return 1;
+
+  std::string buffer;
+  char buf[BUFSIZ];
+  while(true) {
+    server::request req;
+    std::size_t size;
+    try {
+      size = server::decode(buffer, req);
+    } catch(const std::exception &e) {
+      std::cerr << "caliber-clang-server: " << e.what() << std::endl;
+      return 1;
+    }
+
+    if(size) {
+      buffer.erase(0, size);
+      if(!caliber::write_all(STDOUT_FILENO, server::encode(s.compile(req))))
+        return 1;
+      continue;
+    }
+
+    ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return got < 0;
+    buffer.append(buf, got);
+  }
+}
@@ -0,0 +1,160 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "files.hpp"
+
+namespace caliber {
+
+  namespace {
+    namespace pt = boost::property_tree;
+
+    const int format_version = 1;
+
+    double median_of(std::vector<double> &samples) {
+      auto n = samples.size();
+      auto mid = samples.begin() + n / 2;
+      std::nth_element(samples.begin(), mid, samples.end());
+      if(n % 2)
+        return *mid;
+      return (*mid + *std::max_element(samples.begin(), mid)) / 2;
+    }
+
+    pt::ptree stats_tree(const sample_stats &stats) {
+      pt::ptree tree;
+      tree.put("median", stats.median);
+      tree.put("mad", stats.mad);
+      return tree;
+    }
+
+    sample_stats read_stats(const pt::ptree &tree) {
+      return {tree.get<double>("median"), tree.get<double>("mad")};
+    }
+
+    std::string change(double base, double now) {
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(1) << std::showpos
+         << (now - base) / base * 100 << "%";
+      return ss.str();
+    }
+  }
+
+  sample_stats summarize(std::vector<double> samples) {
+    if(samples.empty())
+      return {};
+
+    sample_stats result;
+    result.median = median_of(samples);
+    for(auto &i : samples)
+      i = std::abs(i - result.median);
+    result.mad = median_of(samples);
+    return result;
+  }
+
+  void benchmark::load_baseline(const std::string &path) {
+    pt::ptree tree;
+    try {
+      pt::read_json(path, tree);
+      if(tree.get<int>("version") != format_version)
+        throw std::runtime_error("unsupported version");
+
+      // Tests are keys in their own right, so iterate over them rather than
+      // looking them up by path, since they usually contain dots.
+      for(const auto &compiler : tree.get_child("compilers")) {
+        for(const auto &test : compiler.second) {
+          bench_result result;
+          result.runs = test.second.get<std::size_t>("runs");
+          result.wall = read_stats(test.second.get_child("wall"));
+          result.cpu = read_stats(test.second.get_child("cpu"));
+          baseline_[{compiler.first, test.first}] = result;
+        }
+      }
+    } catch(const std::exception &e) {
+      throw std::runtime_error("unable to read baseline \"" + path + "\": " +
+                               e.what());
+    }
+  }
+
+  void benchmark::save(const std::string &path) const {
+    std::map<key_type, bench_result> merged;
+    {
+      std::lock_guard lock(mutex_);
+      merged = results_;
+    }
+    merged.insert(baseline_.begin(), baseline_.end());
+
+    std::map<std::string, pt::ptree> compilers;
+    for(const auto &i : merged) {
+      pt::ptree test;
+      test.put("runs", i.second.runs);
+      test.add_child("wall", stats_tree(i.second.wall));
+      test.add_child("cpu", stats_tree(i.second.cpu));
+      compilers[i.first.first].push_back({i.first.second, std::move(test)});
+    }
+
+    pt::ptree tree;
+    tree.put("version", format_version);
+    auto &compilers_tree = tree.put_child("compilers", pt::ptree());
+    for(auto &i : compilers)
+      compilers_tree.push_back({i.first, std::move(i.second)});
+
+    std::ostringstream ss;
+    pt::write_json(ss, tree);
+    if(!write_file_atomically(path, ss.str()))
+      throw std::runtime_error("unable to write baseline \"" + path + "\"");
+  }
+
+  std::pair<std::string, bool>
+  benchmark::record(const std::string &compiler, const std::string &test,
+                    const bench_result &result) {
+    key_type key = {compiler, test};
+    {
+      std::lock_guard lock(mutex_);
+      results_[key] = result;
+    }
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3)
+       << "wall time " << result.wall.median << " s (+/- " << result.wall.mad
+       << " s), CPU time " << result.cpu.median << " s (+/- "
+       << result.cpu.mad << " s) over " << result.runs << " runs";
+
+    auto base = baseline_.find(key);
+    if(base == baseline_.end())
+      return {ss.str(), false};
+
+    const auto &before = base->second;
+    bool wall_regressed = regressed(before.wall, result.wall);
+    bool cpu_regressed = regressed(before.cpu, result.cpu);
+    ss << "; baseline " << before.wall.median << " s wall";
+    if(before.wall.median > 0)
+      ss << " (" << change(before.wall.median, result.wall.median) << ")";
+    ss << ", " << before.cpu.median << " s CPU";
+    if(before.cpu.median > 0)
+      ss << " (" << change(before.cpu.median, result.cpu.median) << ")";
+    return {ss.str(), wall_regressed || cpu_regressed};
+  }
+
+  bool benchmark::regressed(const sample_stats &base,
+                            const sample_stats &now) const {
+    // If we have nothing to compare against (e.g. we couldn't measure CPU
+    // time), don't call it a regression.
+    if(base.median <= 0 || now.median <= 0)
+      return false;
+
+    // Scale the MAD so that it estimates the standard deviation for normally-
+    // distributed samples, and require a change of about three of those.
+    const double mad_to_sigma = 1.4826;
+    auto noise = 3 * mad_to_sigma * std::hypot(base.mad, now.mad);
+    auto growth = now.median - base.median;
+    return growth > threshold_ * base.median && growth > noise;
+  }
+
+} // namespace caliber
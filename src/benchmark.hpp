@@ -0,0 +1,71 @@
+#ifndef INC_CALIBER_SRC_BENCHMARK_HPP
+#define INC_CALIBER_SRC_BENCHMARK_HPP
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace caliber {
+
+  // The median and median absolute deviation of a set of samples. These are
+  // much less sensitive than the mean and standard deviation to the odd run
+  // that was slowed down by something else happening on the machine.
+  struct sample_stats {
+    double median = 0;
+    double mad = 0;
+  };
+
+  sample_stats summarize(std::vector<double> samples);
+
+  // How long it took to compile a test, in seconds, over several runs.
+  struct bench_result {
+    std::size_t runs = 0;
+    sample_stats wall = {};
+    sample_stats cpu = {};
+  };
+
+  // The compile times of a set of tests, keyed on the compiler command and the
+  // test (its file, plus its case and matrix instance, if any). The results
+  // can be saved as a JSON baseline, and compared against by later runs to
+  // catch tests whose compile times have regressed. This is safe to share
+  // between threads.
+  class benchmark {
+  public:
+    // A test has regressed if its median time grew by more than `threshold`
+    // (as a fraction of the baseline), and by more than can be explained by
+    // the spread of the samples.
+    explicit benchmark(double threshold = 0.1) : threshold_(threshold) {}
+    benchmark(const benchmark &) = delete;
+    benchmark & operator =(const benchmark &) = delete;
+
+    // Load a baseline to compare against, throwing on error.
+    void load_baseline(const std::string &path);
+
+    // Save the results recorded so far, along with any tests in the baseline
+    // that weren't run this time, throwing on error.
+    void save(const std::string &path) const;
+
+    // Record the result for a test, returning a description of its compile
+    // time (relative to the baseline, if there is one) and whether it
+    // regressed.
+    std::pair<std::string, bool>
+    record(const std::string &compiler, const std::string &test,
+           const bench_result &result);
+  private:
+    using key_type = std::pair<std::string, std::string>;
+
+    bool regressed(const sample_stats &base, const sample_stats &now) const;
+
+    double threshold_;
+    std::map<key_type, bench_result> baseline_;
+
+    mutable std::mutex mutex_;
+    std::map<key_type, bench_result> results_;
+  };
+
+} // namespace caliber
+
+#endif
@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #define NOMINMAX
@@ -22,6 +25,7 @@
 #include <mettle/driver/cmd_line.hpp>
 #include <mettle/driver/exit_code.hpp>
 #include <mettle/driver/log/child.hpp>
+#include <mettle/driver/log/pipe.hpp>
 #include <mettle/driver/log/summary.hpp>
 #include <mettle/driver/log/term.hpp>
 #include <mettle/driver/subprocess_test_runner.hpp>
@@ -29,6 +33,8 @@
 #include "cmd_line.hpp"
 #include "run_test_files.hpp"
 #include "compilation_test_runner.hpp"
+#include "discover.hpp"
+#include "filesystem.hpp"
 
 namespace caliber {
 
@@ -37,20 +43,117 @@ namespace caliber {
                          mettle::output_options {
       all_options() {
         auto cxx = getenv("CXX");
-        compiler = cxx ? cxx : "c++";
+        compilers = {cxx ? cxx : "c++"};
       }
 
       std::string suite_name = "compilation tests";
-      std::string compiler;
+      std::vector<std::string> compilers;
+      std::vector<std::string> compiler_flavors;
+      std::size_t jobs = 1;
+      bool failed_first = false;
+      bool fail_fast = false;
+      std::size_t max_failures = 0;
+      std::optional<caliber::shard> shard;
+      std::optional<std::string> results_file;
+      bool merge_results = false;
+      std::optional<std::string> cache_dir;
+      std::size_t batch_size = 0;
+      std::optional<std::string> prelude;
+      std::optional<std::string> compile_server;
+      std::optional<double> max_rss;
+      std::optional<double> max_cpu;
+      std::size_t max_output = 0;
+      std::optional<std::string> full_output_dir;
+      bool show_usage = false;
+      std::optional<std::size_t> bench_runs;
+      std::optional<std::string> bench_baseline;
+      std::optional<std::string> bench_save;
+      double bench_threshold = 10;
+      bool profile = false;
+      std::optional<std::string> profile_summary;
       std::optional<mettle::fd_type> output_fd;
       std::vector<std::string> files;
     };
 
+    // Sends every event to two loggers, e.g. so that a run's results can be
+    // saved as well as shown.
+    class tee_logger : public mettle::log::test_logger {
+    public:
+      tee_logger(mettle::log::test_logger &first,
+                 mettle::log::test_logger &second)
+        : first_(first), second_(second) {}
+
+      void started_run() override {
+        first_.started_run();
+        second_.started_run();
+      }
+
+      void ended_run() override {
+        first_.ended_run();
+        second_.ended_run();
+      }
+
+      void started_suite(const std::vector<mettle::suite_name> &suites)
+        override {
+        first_.started_suite(suites);
+        second_.started_suite(suites);
+      }
+
+      void ended_suite(const std::vector<mettle::suite_name> &suites)
+        override {
+        first_.ended_suite(suites);
+        second_.ended_suite(suites);
+      }
+
+      void started_test(const mettle::test_name &test) override {
+        first_.started_test(test);
+        second_.started_test(test);
+      }
+
+      void passed_test(const mettle::test_name &test,
+                       const mettle::log::test_output &output,
+                       mettle::log::test_duration duration) override {
+        first_.passed_test(test, output, duration);
+        second_.passed_test(test, output, duration);
+      }
+
+      void skipped_test(const mettle::test_name &test,
+                        const std::string &message) override {
+        first_.skipped_test(test, message);
+        second_.skipped_test(test, message);
+      }
+
+      void failed_test(const mettle::test_name &test,
+                       const mettle::test_failure &failure,
+                       const mettle::log::test_output &output,
+                       mettle::log::test_duration duration) override {
+        first_.failed_test(test, failure, output, duration);
+        second_.failed_test(test, failure, output, duration);
+      }
+    private:
+      mettle::log::test_logger &first_, &second_;
+    };
+
     const char program_name[] = "caliber";
     void report_error(const std::string &message) {
       std::cerr << program_name << ": " << message << std::endl;
     }
 
+    // Get the directory to cache things that don't depend on the tests being
+    // run (e.g. the compiler's flavor) when the user didn't pick one.
+    std::optional<std::string> user_cache_dir() {
+#ifndef _WIN32
+      if(auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::string(xdg) + "/caliber";
+      if(auto home = getenv("HOME"); home && *home)
+        return std::string(home) + "/.cache/caliber";
+#else
+      if(auto local = getenv("LOCALAPPDATA"); local && *local)
+        return std::string(local) + "\\caliber";
+#endif
+      return std::nullopt;
+    }
+
     std::vector<std::string> split_command(const std::string &command) {
 #ifndef _WIN32
       return boost::program_options::split_unix(command);
@@ -76,8 +179,68 @@ int main(int argc, const char *argv[]) {
   driver.add_options()
     ("suite-name,S", opts::value(&args.suite_name)->value_name("NAME"),
      "the name of the suite containing these tests")
-    ("compiler", opts::value(&args.compiler)->value_name("CMD"),
-     "the compiler to use for these tests")
+    ("compiler", opts::value(&args.compilers)->value_name("CMD"),
+     "the compiler to use for these tests; if specified multiple times, run "
+     "the tests with each compiler")
+    ("compiler-flavor", opts::value(&args.compiler_flavors)->value_name("NAME"),
+     "the brand or flavor of the compiler (e.g. gcc or msvc), instead of "
+     "detecting it; if specified multiple times, one for each compiler")
+    ("jobs,j", opts::value(&args.jobs)->value_name("N"),
+     "the number of tests to compile in parallel")
+    ("failed-first", opts::value(&args.failed_first)->zero_tokens(),
+     "run the tests that failed last time before any others (requires "
+     "--cache-dir)")
+    ("fail-fast", opts::value(&args.fail_fast)->zero_tokens(),
+     "stop after the first test fails")
+    ("max-failures", opts::value(&args.max_failures)->value_name("N"),
+     "stop after N tests have failed")
+    ("shard", opts::value(&args.shard)->value_name("K/N"),
+     "split the test files into N shards and only run the Kth")
+    ("results-file", opts::value(&args.results_file)->value_name("FILE"),
+     "also save the results to FILE, to be combined with --merge-results")
+    ("merge-results", opts::value(&args.merge_results)->zero_tokens(),
+     "instead of running tests, report the combined results of every "
+     "--results-file given as an input")
+    ("cache-dir", opts::value(&args.cache_dir)->value_name("DIR"),
+     "reuse the results of unchanged tests from the cache in DIR, and start "
+     "the tests that took longest last time first")
+    ("batch", opts::value(&args.batch_size)->value_name("N"),
+     "compile up to N tests that are expected to pass with a single compiler "
+     "invocation")
+    ("prelude", opts::value(&args.prelude)->value_name("HEADER"),
+     "include HEADER before every test, precompiling it once for each set of "
+     "compiler options")
+    ("compile-server", opts::value(&args.compile_server)->value_name("CMD"),
+     "check tests with a pool of long-lived compile servers started with CMD "
+     "(e.g. caliber-clang-server) when they match the compiler's version")
+    ("max-rss", opts::value(&args.max_rss)->value_name("MiB"),
+     "fail tests whose compiler uses more than this much memory")
+    ("max-cpu", opts::value(&args.max_cpu)->value_name("SECONDS"),
+     "fail tests whose compiler uses more than this much CPU time")
+    ("max-output", opts::value(&args.max_output)->value_name("KiB"),
+     "keep at most this much of the start and end of each test's stdout and "
+     "stderr, except for tests expecting an error (default: no limit)")
+    ("full-output-dir",
+     opts::value(&args.full_output_dir)->value_name("DIR"),
+     "write the full output of tests that go over --max-output to DIR")
+    ("show-usage", opts::value(&args.show_usage)->zero_tokens(),
+     "show the CPU time and memory each test's compiler used")
+    ("bench", opts::value(&args.bench_runs)->value_name("N"),
+     "compile each test N times and report the median and spread of its "
+     "compile time")
+    ("bench-baseline", opts::value(&args.bench_baseline)->value_name("FILE"),
+     "fail tests whose compile time regressed relative to the baseline in "
+     "FILE (requires --bench)")
+    ("bench-save", opts::value(&args.bench_save)->value_name("FILE"),
+     "save compile times as a baseline in FILE (requires --bench)")
+    ("bench-threshold",
+     opts::value(&args.bench_threshold)->value_name("PERCENT"),
+     "the smallest increase in compile time to consider a regression")
+    ("profile", opts::value(&args.profile)->zero_tokens(),
+     "profile the compiler and report what each test spends its time on")
+    ("profile-summary", opts::value(&args.profile_summary)->value_name("FILE"),
+     "write the slowest headers and templates across all profiled tests to "
+     "FILE")
   ;
 
   opts::options_description hidden("Hidden options");
@@ -114,16 +277,226 @@ int main(int argc, const char *argv[]) {
     return exit_code::success;
   }
 
+  if(args.jobs == 0) {
+    caliber::report_error("--jobs must be at least 1");
+    return exit_code::bad_args;
+  }
+
+  if((args.max_rss && *args.max_rss <= 0) ||
+     (args.max_cpu && *args.max_cpu <= 0)) {
+    caliber::report_error("--max-rss and --max-cpu must be positive");
+    return exit_code::bad_args;
+  }
+
+  if(args.bench_runs && *args.bench_runs == 0) {
+    caliber::report_error("--bench must be at least 1");
+    return exit_code::bad_args;
+  }
+  if(!args.bench_runs && (args.bench_baseline || args.bench_save)) {
+    caliber::report_error("--bench-baseline and --bench-save require --bench");
+    return exit_code::bad_args;
+  }
+
+  if(args.failed_first && !args.cache_dir) {
+    caliber::report_error("--failed-first requires --cache-dir");
+    return exit_code::bad_args;
+  }
+
+  if(!args.compiler_flavors.empty() && args.compiler_flavors.size() != 1 &&
+     args.compiler_flavors.size() != args.compilers.size()) {
+    caliber::report_error("--compiler-flavor must be specified once or once "
+                          "for each compiler");
+    return exit_code::bad_args;
+  }
+  for(const auto &i : args.compiler_flavors) {
+    if(!caliber::known_flavor(i)) {
+      caliber::report_error("unknown compiler flavor \"" + i + "\"");
+      return exit_code::bad_args;
+    }
+  }
+
   if(args.files.empty()) {
     caliber::report_error("no inputs specified");
     return exit_code::no_inputs;
   }
 
+  if(args.merge_results) {
+    if(args.output_fd || args.results_file) {
+      caliber::report_error("--merge-results can't be used with --output-fd "
+                            "or --results-file");
+      return exit_code::bad_args;
+    }
+
+    try {
+      term::enable(std::cout, color_enabled(args.color));
+      indenting_ostream out(std::cout);
+
+      log::summary logger(
+        out, factory.make(args.output, out, args), args.show_time,
+        args.show_terminal
+      );
+      logger.started_run();
+      for(const auto &i : args.files) {
+        std::ifstream in(i, std::ios::binary);
+        if(!in)
+          throw std::runtime_error("unable to read results file \"" + i + "\"");
+        log::pipe message_pipe(logger);
+        while(in.peek() != std::ifstream::traits_type::eof())
+          message_pipe(in);
+      }
+      logger.ended_run();
+
+      logger.summarize();
+      return logger.good() ? exit_code::success : exit_code::failure;
+    } catch(const std::exception &e) {
+      caliber::report_error(e.what());
+      return exit_code::unknown_error;
+    }
+  }
+
+  // Check the globs before starting, so that one matching nothing is reported
+  // as a usage error instead of partway through the run.
+  if(auto glob = caliber::find_empty_glob(args.files)) {
+    caliber::report_error("no files match \"" + *glob + "\"");
+    return exit_code::no_inputs;
+  }
+
   try {
-    caliber::compilation_test_runner runner(
-      caliber::make_compiler(caliber::split_command(args.compiler)),
-      args.timeout
-    );
+    caliber::detect_options detect;
+    detect.cache_dir = args.cache_dir ? args.cache_dir :
+      caliber::user_cache_dir();
+
+    std::shared_ptr<caliber::compile_server_pool> server;
+    if(args.compile_server) {
+      server = std::make_shared<caliber::compile_server_pool>(
+        caliber::split_command(*args.compile_server)
+      );
+    }
+
+    std::vector<std::unique_ptr<caliber::compilation_test_runner>> runners;
+    std::vector<const caliber::compilation_test_runner *> runner_ptrs;
+    for(std::size_t i = 0; i != args.compilers.size(); i++) {
+      if(!args.compiler_flavors.empty()) {
+        detect.flavor = args.compiler_flavors[
+          args.compiler_flavors.size() == 1 ? 0 : i
+        ];
+      }
+      runners.push_back(std::make_unique<caliber::compilation_test_runner>(
+        caliber::make_compiler(caliber::split_command(args.compilers[i]),
+                               detect),
+        args.timeout, server
+      ));
+      runner_ptrs.push_back(runners.back().get());
+    }
+    if(server && std::none_of(runners.begin(), runners.end(),
+                              [](const auto &i) { return i->has_server(); })) {
+      caliber::report_error("warning: compile server can't stand in for any "
+                            "compiler; running them directly");
+    }
+
+    std::optional<caliber::result_cache> cache;
+    if(args.cache_dir)
+      cache.emplace(*args.cache_dir);
+
+    // Remember the options of every test file we read, so that later runs
+    // (especially ones that only select a few tests) needn't open them all.
+    // The index grows with every file it sees, so only keep one in a cache
+    // directory that was asked for.
+    std::optional<caliber::test_index> index;
+    if(args.cache_dir)
+      index.emplace((FILESYSTEM_NS::path(*args.cache_dir) / "index").string());
+
+    // Remember how each test went, so that later runs can start the slowest
+    // (or the failing) ones first. Like the index, this grows with every test
+    // it sees, so only keep one in a cache directory that was asked for.
+    std::optional<caliber::run_history> history;
+    if(args.cache_dir) {
+      history.emplace((FILESYSTEM_NS::path(*args.cache_dir) /
+                       "history").string());
+    }
+
+    std::optional<caliber::precompiled_prelude> prelude;
+    if(args.prelude)
+      prelude.emplace(*args.prelude, cache ? &*cache : nullptr);
+
+    caliber::run_options run_opts;
+    run_opts.jobs = args.jobs;
+    run_opts.shard = args.shard;
+    run_opts.cache = cache ? &*cache : nullptr;
+    run_opts.index = index ? &*index : nullptr;
+    run_opts.history = history ? &*history : nullptr;
+    run_opts.failed_first = args.failed_first;
+    if(args.cache_dir) {
+      run_opts.case_dir = (FILESYSTEM_NS::path(*args.cache_dir) /
+                           "cases").string();
+    }
+    run_opts.max_failures = args.max_failures ? args.max_failures :
+                            args.fail_fast ? 1 : 0;
+    run_opts.batch_size = args.batch_size;
+    run_opts.prelude = prelude ? &*prelude : nullptr;
+    if(args.max_rss)
+      run_opts.max_rss = static_cast<std::uint64_t>(*args.max_rss * 1048576);
+    if(args.max_cpu) {
+      using namespace std::chrono;
+      run_opts.max_cpu = duration_cast<milliseconds>(
+        duration<double>(*args.max_cpu)
+      );
+    }
+    run_opts.show_usage = args.show_usage;
+    if(args.max_output)
+      run_opts.output_limit = args.max_output * 1024;
+    if(args.full_output_dir) {
+      FILESYSTEM_NS::create_directories(*args.full_output_dir);
+      run_opts.full_output_dir = args.full_output_dir;
+    }
+
+    std::optional<caliber::benchmark> bench;
+    if(args.bench_runs) {
+      bench.emplace(args.bench_threshold / 100);
+      if(args.bench_baseline)
+        bench->load_baseline(*args.bench_baseline);
+      run_opts.bench = &*bench;
+      run_opts.bench_runs = *args.bench_runs;
+    }
+
+    std::optional<caliber::profile_summary> profile;
+    if(args.profile_summary)
+      profile.emplace();
+    run_opts.profile_all = args.profile;
+    run_opts.profile = profile ? &*profile : nullptr;
+
+    auto save_results = [&]() {
+      if(index)
+        index->save();
+      if(history)
+        history->save();
+      if(bench && args.bench_save)
+        bench->save(*args.bench_save);
+      if(profile)
+        profile->write(*args.profile_summary);
+    };
+
+    // Run the tests, saving their results as well if we were asked to.
+    std::ofstream results;
+    if(args.results_file) {
+      results.open(*args.results_file, std::ios::binary);
+      if(!results) {
+        throw std::runtime_error("unable to write results file \"" +
+                                 *args.results_file + "\"");
+      }
+    }
+    auto run = [&](log::test_logger &logger) {
+      if(results.is_open()) {
+        log::child results_logger(results);
+        caliber::tee_logger tee(logger, results_logger);
+        caliber::run_test_files({args.suite_name, ""}, args.files, tee,
+                                runner_ptrs, args.filters, run_opts);
+      } else {
+        caliber::run_test_files({args.suite_name, ""}, args.files, logger,
+                                runner_ptrs, args.filters, run_opts);
+      }
+      save_results();
+    };
 
     if(args.output_fd) {
       if(auto output_opt = has_option(output, vm)) {
@@ -139,8 +512,7 @@ int main(int argc, const char *argv[]) {
         *args.output_fd, io::never_close_handle
       );
       log::child logger(fds);
-      caliber::run_test_files({args.suite_name, ""}, args.files, logger, runner,
-                              args.filters);
+      run(logger);
       return exit_code::success;
     }
 
@@ -151,8 +523,7 @@ int main(int argc, const char *argv[]) {
       out, factory.make(args.output, out, args), args.show_time,
       args.show_terminal
     );
-    caliber::run_test_files({args.suite_name, ""}, args.files, logger, runner,
-                            args.filters);
+    run(logger);
 
     logger.summarize();
     return logger.good() ? exit_code::success : exit_code::failure;
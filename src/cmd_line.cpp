@@ -1,25 +1,111 @@
 #include "cmd_line.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <set>
 
+#include "filesystem.hpp"
+#include "hash.hpp"
+
 namespace caliber {
 
   namespace {
-    inline std::string readline(std::istream &is, char delim = '\n') {
-      std::string line;
-      std::getline(is, line, delim);
-      return line;
+    // Read the start of a file in chunks of this size (doubling each time),
+    // so that scanning a test's options doesn't read the rest of the file.
+    const std::size_t header_chunk = 4096;
+
+    const char case_marker[] = "caliber-case";
+
+    enum class scan_status {
+      found,
+      missing,
+      need_more
+    };
+
+    struct comment_span {
+      std::string_view body;
+      std::string_view separators;
+    };
+
+    // Find the `name` comment at the very start of `text`. If the comment
+    // might continue past the end of `text` (and we're not at the end of the
+    // file), ask for more.
+    scan_status find_comment(std::string_view text, std::string_view name,
+                             bool eof, comment_span &span) {
+      if(text.size() < 2)
+        return eof ? scan_status::missing : scan_status::need_more;
+      if(text[0] != '/' || (text[1] != '/' && text[1] != '*'))
+        return scan_status::missing;
+
+      bool line = text[1] == '/';
+      std::string_view ws = line ? " \t" : " \t\n\r";
+      auto end = text.find(line ? "\n" : "*/", 2);
+      if(end == std::string_view::npos) {
+        if(!eof)
+          return scan_status::need_more;
+        // An unterminated line comment just runs to the end of the file, but
+        // an unterminated block comment isn't a comment at all.
+        if(!line)
+          return scan_status::missing;
+        end = text.size();
+      }
+
+      auto comment = text.substr(2, end - 2);
+      auto start = comment.find_first_not_of(ws);
+      if(start == std::string_view::npos ||
+         comment.compare(start, name.size(), name) != 0)
+        return scan_status::missing;
+      comment.remove_prefix(start + name.size());
+      if(!comment.empty() && ws.find(comment.front()) == std::string_view::npos)
+        return scan_status::missing;
+
+      // Line comments might end with a CR, which isn't part of the options.
+      span = {comment, line ? " \t\r" : ws};
+      return scan_status::found;
     }
 
-    inline bool matches_name(std::istream &is, const std::string &name,
-                             const char *ws = " \t") {
-      while(strchr(ws, is.peek()))
-        is.get();
-      for(auto c : name) {
-        if(is.get() != c)
-          return false;
+    // Split `text` into arguments the way a Unix shell would (roughly), like
+    // `boost::program_options::split_unix`, but without copying the text
+    // first.
+    std::vector<std::string>
+    split_comment(std::string_view text, std::string_view separators) {
+      std::vector<std::string> result;
+      std::string current;
+      bool in_token = false;
+      char quote = 0;
+      for(std::size_t i = 0; i != text.size(); i++) {
+        char c = text[i];
+        if(c == '\\' && i + 1 != text.size()) {
+          current += text[++i];
+          in_token = true;
+        } else if(quote) {
+          if(c == quote)
+            quote = 0;
+          else
+            current += c;
+        } else if(c == '"' || c == '\'') {
+          quote = c;
+          in_token = true;
+        } else if(separators.find(c) != std::string_view::npos) {
+          if(in_token)
+            result.push_back(std::move(current));
+          current.clear();
+          in_token = false;
+        } else {
+          // Copy the rest of this run of plain characters all at once.
+          auto run_end = text.find_first_of(separators, i);
+          auto special = text.find_first_of("\\\"'", i);
+          auto stop = std::min(run_end, special);
+          if(stop == std::string_view::npos)
+            stop = text.size();
+          current.append(text.substr(i, stop - i));
+          i = stop - 1;
+          in_token = true;
+        }
       }
-      return strchr(ws, is.get());
+      if(in_token)
+        result.push_back(std::move(current));
+      return result;
     }
 
     // Some types whose only job is to be a placeholder for args that get
@@ -35,28 +121,66 @@ namespace caliber {
                   int) {}
   }
 
+  std::vector<std::string>
+  extract_comment(std::string_view text, const std::string &name) {
+    comment_span span;
+    if(find_comment(text, name, true, span) != scan_status::found)
+      return {};
+    return split_comment(span.body, span.separators);
+  }
+
   std::vector<std::string>
   extract_comment(std::istream &is, const std::string &name) {
-    if(is.get() == '/') {
-      char c = is.get();
-      if(c == '/') {
-        if(matches_name(is, name))
-          return boost::program_options::split_unix(readline(is));
-      } else if(c == '*') {
-        if(matches_name(is, name, " \t\n\r")) {
-          std::string comment;
-          while(true) {
-            comment += readline(is, '*');
-            if(is.peek() == '/')
-              return boost::program_options::split_unix(comment, " \t\n\r");
-            else
-              comment += '*';
-          }
-        }
+    std::string buf;
+    for(std::size_t chunk = header_chunk;; chunk *= 2) {
+      auto size = buf.size();
+      buf.resize(size + chunk);
+      is.read(buf.data() + size, chunk);
+      buf.resize(size + is.gcount());
+      bool eof = !is;
+
+      comment_span span;
+      switch(find_comment(buf, name, eof, span)) {
+      case scan_status::found:
+        return split_comment(span.body, span.separators);
+      case scan_status::missing:
+        return {};
+      case scan_status::need_more:
+        break;
       }
     }
+  }
+
+  test_cases split_test_cases(std::string_view text) {
+    test_cases result;
+    std::size_t body_start = 0;
+    auto finish_case = [&](std::size_t end) {
+      auto chunk = text.substr(body_start, end - body_start);
+      if(result.cases.empty())
+        result.preamble = chunk;
+      else
+        result.cases.back().body = chunk;
+    };
 
-    return {};
+    std::size_t line = 1;
+    for(std::size_t pos = 0; pos != text.size(); line++) {
+      auto end = text.find('\n', pos);
+      auto next = end == std::string_view::npos ? text.size() : end + 1;
+      auto current = text.substr(pos, next - pos);
+
+      comment_span span;
+      if(current.starts_with("//") &&
+         find_comment(current, case_marker, true, span) ==
+         scan_status::found) {
+        finish_case(pos);
+        result.cases.push_back({split_comment(span.body, span.separators),
+                                line, {}});
+        body_start = next;
+      }
+      pos = next;
+    }
+    finish_case(text.size());
+    return result;
   }
 
   boost::program_options::options_description
@@ -66,6 +190,16 @@ namespace caliber {
     desc.add_options()
       ("fail,F", value(&opts.expect_fail)->zero_tokens(),
        "expect the test to fail")
+      ("expect-error", value(&opts.expect_error)->value_name("REGEX"),
+       "expect the test to fail with an error matching REGEX")
+      ("expect-error-line", value(&opts.expect_error_line)
+       ->value_name("LINE"),
+       "expect the test to fail with an error on LINE of the test file")
+      ("profile", value(&opts.profile)->zero_tokens(),
+       "profile the compiler and report what the test spends its time on")
+      ("cases", value(&opts.cases)->zero_tokens(),
+       "split the file into several tests, each starting with a "
+       "`// caliber-case` comment")
       ("name,n", value(&opts.name)->value_name("NAME"), "the test's name")
       ("attr,a", value(&opts.attrs)->value_name("ATTR"),
        "the test's attributes")
@@ -73,6 +207,9 @@ namespace caliber {
        "the compiler to use for this test")
       (",X", value(&opts.raw_args)->value_name("FLAVOR=OPTION"),
        "forward untranslated argument directly to the compiler being used")
+      ("matrix", value(&opts.matrix)->value_name("KEY=VALUE,..."),
+       "run the test once for each VALUE of the compiler option KEY (one of "
+       "std, D, U, or I); multiple matrices run every combination")
     ;
     return desc;
   }
@@ -91,6 +228,29 @@ namespace caliber {
     return desc;
   }
 
+  std::vector<matrix_instance>
+  expand_matrix(const std::vector<matrix_axis> &matrix) {
+    std::vector<matrix_instance> result = {{}};
+    for(const auto &axis : matrix) {
+      auto string_key = axis.key == "std" ? axis.key : "-" + axis.key;
+      std::vector<matrix_instance> next;
+      next.reserve(result.size() * axis.values.size());
+      for(const auto &i : result) {
+        for(const auto &value : axis.values) {
+          auto instance = i;
+          if(!instance.label.empty())
+            instance.label += ", ";
+          instance.label += axis.key + "=" + value;
+          instance.args.emplace_back(string_key,
+                                     std::vector<std::string>{value});
+          next.push_back(std::move(instance));
+        }
+      }
+      result = std::move(next);
+    }
+    return result;
+  }
+
   namespace {
     struct attr_less {
       using is_transparent = void;
@@ -151,4 +311,63 @@ namespace caliber {
     }
   }
 
+  void validate(boost::any &v, const std::vector<std::string> &values,
+                matrix_axis *, int) {
+    using namespace boost::program_options;
+    validators::check_first_occurrence(v);
+    const std::string &val = validators::get_single_string(values);
+
+    std::size_t i = val.find('=');
+    if(i == std::string::npos)
+      boost::throw_exception(invalid_option_value(val));
+
+    matrix_axis axis;
+    axis.key = val.substr(0, i);
+    if(axis.key.size() == 2 && axis.key[0] == '-')
+      axis.key.erase(0, 1);
+    if(axis.key != "std" && axis.key != "D" && axis.key != "U" &&
+       axis.key != "I")
+      boost::throw_exception(invalid_option_value(val));
+
+    for(std::size_t start = i + 1;;) {
+      auto end = val.find(',', start);
+      if(end == start || start == val.size())
+        boost::throw_exception(invalid_option_value(val));
+      axis.values.push_back(val.substr(start, end - start));
+      if(end == std::string::npos)
+        break;
+      start = end + 1;
+    }
+    v = std::move(axis);
+  }
+
+  bool shard::contains(const std::string &file) const {
+    auto path = FILESYSTEM_NS::path(file).lexically_normal().generic_string();
+    return hasher().update(path).digest() % count == index;
+  }
+
+  void validate(boost::any &v, const std::vector<std::string> &values,
+                shard *, int) {
+    using namespace boost::program_options;
+    validators::check_first_occurrence(v);
+    const std::string &val = validators::get_single_string(values);
+
+    auto parse = [&val](std::size_t first, std::size_t last) {
+      std::size_t result;
+      auto [end, err] = std::from_chars(val.data() + first, val.data() + last,
+                                        result);
+      if(err != std::errc() || end != val.data() + last)
+        boost::throw_exception(invalid_option_value(val));
+      return result;
+    };
+
+    std::size_t i = val.find('/');
+    if(i == std::string::npos)
+      boost::throw_exception(invalid_option_value(val));
+    auto k = parse(0, i), n = parse(i + 1, val.size());
+    if(k == 0 || k > n)
+      boost::throw_exception(invalid_option_value(val));
+    v = shard{k - 1, n};
+  }
+
 } // namespace caliber
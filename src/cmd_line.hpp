@@ -3,6 +3,7 @@
 
 #include <istream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <boost/program_options.hpp>
@@ -12,6 +13,12 @@
 
 namespace caliber {
 
+  // Get the arguments in the `name` comment (e.g. `// caliber ...` or
+  // `/* caliber ... */`) at the very start of a file, splitting them like a
+  // Unix shell would. When reading from a stream, only as much of the file as
+  // the comment needs is read.
+  std::vector<std::string>
+  extract_comment(std::string_view text, const std::string &name);
   std::vector<std::string>
   extract_comment(std::istream &is, const std::string &name);
 
@@ -37,12 +44,67 @@ namespace caliber {
     return parse_comment(s, name, opts);
   }
 
+  // One test case in a file that holds several, starting at a
+  // `// caliber-case ...` line that holds the case's options.
+  struct test_case {
+    std::vector<std::string> args;
+    // The line number of the case's `caliber-case` comment.
+    std::size_t line;
+    // Everything after the `caliber-case` comment, up to the next one.
+    std::string_view body;
+  };
+
+  struct test_cases {
+    // Everything before the first case, which is shared by all of them.
+    std::string_view preamble;
+    std::vector<test_case> cases;
+  };
+
+  // Split the contents of a multi-case test file into its cases.
+  test_cases split_test_cases(std::string_view text);
+
+  // One axis of a parameterized test, e.g. `std=c++17,c++20`: the test is
+  // run once for each value of the compiler option `key` (one of `std`, `D`,
+  // `U`, or `I`).
+  struct matrix_axis {
+    std::string key;
+    std::vector<std::string> values;
+  };
+
+  // A single instance of a parameterized test.
+  struct matrix_instance {
+    // A description of this instance's values, e.g. `std=c++17, D=FOO`.
+    std::string label;
+    // The compiler options to add for this instance.
+    compiler_options args;
+  };
+
+  // Expand the axes of a parameterized test into the cross product of their
+  // values. With no axes, this is a single instance with no extra options.
+  std::vector<matrix_instance>
+  expand_matrix(const std::vector<matrix_axis> &matrix);
+
+  // One of `count` parts of a test suite, from `--shard K/N` (where K counts
+  // from 1, but `index` counts from 0). Test files are assigned to parts by a
+  // hash of their paths, so every shard agrees on where each file goes, as
+  // long as they're all given the same inputs from the same directory.
+  struct shard {
+    std::size_t index = 0, count = 1;
+
+    bool contains(const std::string &file) const;
+  };
+
   struct per_file_options {
     bool expect_fail = false;
+    bool profile = false;
+    bool cases = false;
     std::string name;
     std::vector<std::string> attrs;
     std::vector<std::string> compilers;
     raw_options raw_args;
+    std::vector<matrix_axis> matrix;
+    std::string expect_error;
+    std::size_t expect_error_line = 0;
   };
 
   boost::program_options::options_description
@@ -55,6 +117,9 @@ namespace caliber {
 
   void validate(boost::any &, const std::vector<std::string> &, raw_option *,
                 int);
+  void validate(boost::any &, const std::vector<std::string> &, matrix_axis *,
+                int);
+  void validate(boost::any &, const std::vector<std::string> &, shard *, int);
 
 } // namespace caliber
 
@@ -0,0 +1,49 @@
+#include "compilation_test_runner.hpp"
+
+#include <sstream>
+
+#include "output_capture.hpp"
+
+namespace caliber {
+
+  std::optional<compilation_result> compilation_test_runner::serve(
+    const std::vector<std::string> &args, bool expect_fail,
+    mettle::log::test_output &output, std::optional<std::string_view> input,
+    const capture_options &capture
+  ) const {
+    if(!server_)
+      return std::nullopt;
+    auto reply = server_->compile(args, input, timeout_);
+    if(!reply)
+      return std::nullopt;
+
+    compilation_result result;
+    if(reply->timed_out) {
+      std::ostringstream ss;
+      ss << "Timed out after " << timeout_->count() << " ms";
+      result = {{{ .message = ss.str() }}};
+      return result;
+    }
+
+    // Servers report diagnostics where the compiler would have: on stderr.
+    output_capture stderr_capture(
+      output.stderr_log, capture.stderr_limit,
+      capture.spill ? std::optional(*capture.spill + ".stderr") : std::nullopt
+    );
+    stderr_capture.append(reply->output);
+    stderr_capture.finish();
+
+    result.completed = true;
+    if(reply->success == expect_fail) {
+      std::ostringstream ss;
+      for(const auto &i : args)
+        ss << i << " ";
+      ss << (reply->success ? "\nCompilation successful" :
+             "\nCompilation failed");
+      result.result = mettle::test_failure{ .message = ss.str() };
+    }
+    result.dependencies = std::move(reply->includes);
+    return result;
+  }
+
+} // namespace caliber
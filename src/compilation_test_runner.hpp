@@ -2,34 +2,116 @@
 #define INC_CALIBER_SRC_COMPILATION_TEST_RUNNER_HPP
 
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <mettle/driver/log/core.hpp>
 #include <mettle/suite/compiled_suite.hpp>
 
+#include "compile_server.hpp"
 #include "compiler.hpp"
 
 namespace caliber {
 
+  // The resources used by a compiler, including any child processes it
+  // waited for.
+  struct resource_usage {
+    std::chrono::microseconds user_time = {}, system_time = {};
+    // The peak resident set size (or on Windows, committed memory), in bytes.
+    std::uint64_t max_rss = 0;
+    std::uint64_t minor_faults = 0, major_faults = 0;
+  };
+
+  struct compilation_result {
+    mettle::test_result result;
+    // True if the compiler ran to completion, meaning that the result depends
+    // only on the test's inputs (and not on e.g. a timeout or a system error).
+    bool completed = false;
+    std::optional<resource_usage> usage = std::nullopt;
+    // True if the compiler was killed by `cancel_all`.
+    bool cancelled = false;
+    // The files the compiler read, if it told us directly (only compile
+    // servers do).
+    std::optional<std::vector<std::string>> dependencies = std::nullopt;
+  };
+
+  // How much of a compiler's output to keep. See `output_capture`.
+  struct capture_options {
+    // If set, keep at most this many bytes of each stream, split between its
+    // start and end.
+    std::optional<std::size_t> stdout_limit = std::nullopt;
+    std::optional<std::size_t> stderr_limit = std::nullopt;
+    // If set, write all of any stream that goes over its limit to
+    // `<spill>.stdout` or `<spill>.stderr`.
+    std::optional<std::string> spill = std::nullopt;
+  };
+
   class compilation_test_runner {
   public:
     using timeout_t = std::optional<std::chrono::milliseconds>;
+    // Called as a compiler's output arrives. If it returns true, the output
+    // shows that the compilation will fail, so the compiler can be stopped
+    // early.
+    using output_watcher =
+      std::function<bool(const mettle::log::test_output &)>;
 
-    compilation_test_runner(std::unique_ptr<const caliber::compiler> compiler,
-                  timeout_t timeout = {})
-      : compiler_(std::move(compiler)), timeout_(timeout) {}
+    // The runner may be called from multiple threads at once; any
+    // platform-specific state needed to manage the concurrently-running
+    // compilers lives in `running_`, which is shared by every runner in the
+    // process. If `server` can stand in for `compiler`, `serve` uses it.
+    compilation_test_runner(
+      std::unique_ptr<const caliber::compiler> compiler, timeout_t timeout = {},
+      std::shared_ptr<compile_server_pool> server = nullptr
+    );
+    ~compilation_test_runner();
 
-    mettle::test_result
-    operator ()(const std::string &file, const compiler_options &args,
-                const raw_options &raw_args, bool expect_fail,
-                mettle::log::test_output &output) const;
+    // Run the compiler with `args` (as produced by `compiler().translate_args`)
+    // and check whether the result matches `expect_fail`. If `input` is set,
+    // it's written to the compiler's stdin. Not every platform can watch the
+    // output as it arrives, so `watcher` might never be called.
+    compilation_result
+    operator ()(const std::vector<std::string> &args, bool expect_fail,
+                mettle::log::test_output &output,
+                std::optional<std::string_view> input = std::nullopt,
+                const output_watcher &watcher = nullptr,
+                const capture_options &capture = {}) const;
+
+    // Like calling the runner, but check the test with a compile server
+    // instead of running the compiler. Servers don't report the resources
+    // they used, and can't write dependency files or profiles, so `args`
+    // shouldn't ask for those. Returns nothing if there's no server or it
+    // couldn't handle the test; then, call the runner as usual.
+    std::optional<compilation_result>
+    serve(const std::vector<std::string> &args, bool expect_fail,
+          mettle::log::test_output &output,
+          std::optional<std::string_view> input = std::nullopt,
+          const capture_options &capture = {}) const;
+
+    // Kill every compiler that's running (for any runner in the process),
+    // e.g. because the run is being cut short. On Windows, running compilers
+    // are left to finish.
+    void cancel_all() const;
+
+    bool has_server() const {
+      return server_ != nullptr;
+    }
 
     const caliber::compiler & compiler() const {
       return *compiler_;
     }
   private:
+    struct running_tests;
+
     std::unique_ptr<const caliber::compiler> compiler_;
     timeout_t timeout_;
+    std::shared_ptr<compile_server_pool> server_;
+    std::shared_ptr<running_tests> running_;
   };
 
 } // namespace caliber
@@ -0,0 +1,85 @@
+#ifndef INC_CALIBER_SRC_COMPILE_SERVER_HPP
+#define INC_CALIBER_SRC_COMPILE_SERVER_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compiler.hpp"
+#include "server_protocol.hpp"
+
+namespace caliber {
+
+  // What a compile server said about a test.
+  struct compile_reply {
+    bool timed_out = false;
+    bool success = false;
+    // The compiler's diagnostics, as it would have written them to stderr.
+    std::string output;
+    // Every file the compiler read, including the source itself.
+    std::vector<std::string> includes;
+  };
+
+  // A pool of long-lived compile servers (i.e. `caliber-clang-server`) that
+  // check tests without starting a new compiler for each one, and which keep
+  // what they've parsed around to reuse for later tests. Each server checks
+  // one test at a time, and servers are only started when all the others are
+  // busy, so there are never more of them than tests being compiled at once.
+  class compile_server_pool {
+  public:
+    using timeout_t = std::optional<std::chrono::milliseconds>;
+
+    explicit compile_server_pool(std::vector<std::string> command);
+    compile_server_pool(const compile_server_pool &) = delete;
+    compile_server_pool & operator =(const compile_server_pool &) = delete;
+    ~compile_server_pool();
+
+    // The version of the compiler the servers are built on, or an empty
+    // string if they can't be started.
+    const std::string & version();
+
+    // Servers only stand in for the very same version of clang they're built
+    // on, so that they reach the same verdicts as the compiler would.
+    bool supports(const compiler &c) {
+      return c.brand == "clang" && !version().empty() &&
+             c.identity == version();
+    }
+
+    // Check `args` (as produced by `translate_args`) with one of the servers,
+    // feeding it `input` as the source if set. Returns nothing if the server
+    // couldn't handle it (e.g. because it crashed, or because `args` asks for
+    // something it can't do), in which case the caller should run the
+    // compiler instead.
+    std::optional<compile_reply>
+    compile(const std::vector<std::string> &args,
+            std::optional<std::string_view> input, timeout_t timeout);
+  private:
+    // A single running server. This is platform-specific.
+    struct worker;
+
+    // Start a new server, returning null if it fails to start or doesn't
+    // speak our protocol.
+    std::unique_ptr<worker> start(std::string &version);
+    // Send `req` to `w` and wait for its reply. Returns nothing if the server
+    // broke or timed out (setting `timed_out` in the latter case), after
+    // which it shouldn't be used again.
+    std::optional<server::reply>
+    exchange(worker &w, const server::request &req, timeout_t timeout,
+             bool &timed_out);
+
+    std::unique_ptr<worker> acquire();
+    void release(std::unique_ptr<worker> w);
+
+    std::vector<std::string> command_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<worker>> idle_;
+    std::optional<std::string> version_;
+  };
+
+} // namespace caliber
+
+#endif
@@ -1,6 +1,8 @@
 #include "compiler.hpp"
 
 #include <cassert>
+#include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 
 #ifndef _WIN32
@@ -11,25 +13,226 @@ namespace platform = caliber::posix;
 namespace platform = caliber::windows;
 #endif
 
-#ifdef CALIBER_BOOST_FILESYSTEM
-#  include <boost/filesystem.hpp>
-#  define FILESYSTEM_NS boost::filesystem
-#else
-#  include <filesystem>
-#  define FILESYSTEM_NS std::filesystem
-#endif
+#include "files.hpp"
+#include "filesystem.hpp"
+#include "hash.hpp"
 
 namespace caliber {
 
   namespace {
 
+    // Parse Makefile-style dependency rules, as written by `-M` or `-MD`,
+    // returning the prerequisites of each rule in order.
+    std::vector<std::vector<std::string>>
+    parse_depfile_rules(const std::string &depfile) {
+      std::vector<std::vector<std::string>> result;
+      std::string current;
+      bool in_target = true;
+
+      auto finish = [&]() {
+        if(!current.empty())
+          result.back().push_back(std::move(current));
+        current.clear();
+      };
+
+      for(std::size_t i = 0; i != depfile.size(); i++) {
+        char c = depfile[i];
+        char next = i + 1 != depfile.size() ? depfile[i + 1] : '\0';
+        if(in_target) {
+          // The target ends at the first colon followed by whitespace (so
+          // that we don't trip over Windows drive letters).
+          if(c == ':' && (next == ' ' || next == '\t' || next == '\n' ||
+                          next == '\r' || next == '\0')) {
+            in_target = false;
+            result.emplace_back();
+          } else if(c == '\\' && next) {
+            i++;
+          }
+        } else if(c == '\\' && (next == '\n' || next == '\r')) {
+          // A line continuation.
+          finish();
+          i += next == '\r' && i + 2 != depfile.size() &&
+               depfile[i + 2] == '\n' ? 2 : 1;
+        } else if(c == '\n') {
+          // Otherwise, the end of the line is the end of the rule.
+          finish();
+          in_target = true;
+        } else if(c == '\\' && (next == ' ' || next == '#' || next == '\\')) {
+          current += next;
+          i++;
+        } else if(c == '$' && next == '$') {
+          current += '$';
+          i++;
+        } else if(c == ' ' || c == '\t' || c == '\r') {
+          finish();
+        } else {
+          current += c;
+        }
+      }
+      if(!in_target)
+        finish();
+      return result;
+    }
+
+    // Parse a dependency file written by `-MD -MF`, returning all the
+    // prerequisites of its (single) target.
+    std::vector<std::string> parse_depfile(const std::string &depfile) {
+      auto rules = parse_depfile_rules(depfile);
+      if(rules.empty())
+        return {};
+      return std::move(rules.front());
+    }
+
+    // Get the major version of clang from its identity (e.g. "clang version
+    // 16.0.0"), or nothing if it doesn't say. Apple's clang is numbered
+    // differently, so it's translated to the upstream version it's based on.
+    std::optional<int> clang_major_version(const std::string &identity) {
+      static const std::string prefix = "clang version ";
+      auto start = identity.find(prefix);
+      if(start == std::string::npos)
+        return std::nullopt;
+      start += prefix.size();
+      auto end = identity.find_first_not_of("0123456789", start);
+      if(end == start)
+        return std::nullopt;
+
+      int version = std::stoi(identity.substr(start, end - start));
+      if(identity.compare(0, 6, "Apple ") == 0)
+        version++;
+      return version;
+    }
+
     struct cc_compiler : compiler {
-      cc_compiler(std::vector<std::string> command, std::string brand)
-        : compiler(std::move(command), std::move(brand), "cc") {}
+      cc_compiler(std::vector<std::string> command, std::string brand,
+                  std::string identity)
+        : compiler(std::move(command), std::move(brand), "cc",
+                   std::move(identity)) {}
+
+      using compiler::translate_args;
+
+      virtual bool reads_stdin() const override {
+        return true;
+      }
+
+      virtual bool can_profile() const override {
+        if(brand == "gcc")
+          return true;
+        if(brand != "clang")
+          return false;
+        // Before clang 16, `-ftime-trace` only writes the trace next to the
+        // object file, and `-fsyntax-only` doesn't produce one. If we can't
+        // tell the version, assume it's new enough.
+        auto version = clang_major_version(identity);
+        return !version || *version >= 16;
+      }
 
       virtual std::vector<std::string>
-      translate_args(const std::string &src, const compiler_options &args,
-                     const raw_options &raw_args) const override {
+      translate_args(const std::vector<std::string> &srcs,
+                     const compiler_options &args, const raw_options &raw_args,
+                     const translate_options &options = {}) const override {
+        assert(!srcs.empty() && "no source files");
+        assert((srcs.size() == 1 || !options.depfile) &&
+               "can't track dependencies of multiple files");
+        assert((srcs.size() == 1 || !options.from_stdin) &&
+               "can't read multiple files from stdin");
+        assert((!options.profile || can_profile()) &&
+               "compiler can't profile itself");
+        auto result = translate_common(srcs.front(), args, raw_args, options);
+
+        // GCC and clang both look for `<header>.gch` (or `.pch` for clang)
+        // next to an `-include`d header and use it if it's valid.
+        if(options.prelude)
+          result.insert(result.end(), {"-include", options.prelude->header});
+
+        result.push_back("-fsyntax-only");
+        if(options.fatal_errors)
+          result.push_back("-Wfatal-errors");
+        if(options.from_stdin) {
+          // There's no file name to guess the language from, so say what it
+          // is.
+          auto ext = FILESYSTEM_NS::path(srcs.front()).extension();
+          result.insert(result.end(), {"-x", ext == ".c" ? "c" : "c++", "-"});
+        } else {
+          result.insert(result.end(), srcs.begin(), srcs.end());
+        }
+        return result;
+      }
+
+      virtual std::optional<std::vector<std::string>>
+      translate_deps_args(const std::vector<std::string> &srcs,
+                          const compiler_options &args,
+                          const raw_options &raw_args,
+                          const translate_options &options = {}
+      ) const override {
+        assert(!srcs.empty() && "no source files");
+        assert(!options.depfile && !options.from_stdin && !options.profile &&
+               "can't list dependencies with these options");
+        auto result = translate_common(srcs.front(), args, raw_args, options);
+        if(options.prelude)
+          result.insert(result.end(), {"-include", options.prelude->header});
+
+        // `-M` only runs the preprocessor, writing a rule for each source (in
+        // order) to stdout.
+        result.push_back("-M");
+        result.insert(result.end(), srcs.begin(), srcs.end());
+        return result;
+      }
+
+      virtual std::optional<std::vector<std::vector<std::string>>>
+      read_deps_list(const std::vector<std::string> &srcs,
+                     const std::string &stdout_log) const override {
+        auto rules = parse_depfile_rules(stdout_log);
+        if(rules.size() != srcs.size())
+          return std::nullopt;
+        return rules;
+      }
+
+      virtual std::string
+      pch_path(const std::string &header) const override {
+        return header + (brand == "clang" ? ".pch" : ".gch");
+      }
+
+      virtual std::vector<std::string>
+      translate_pch_args(const std::string &src, const precompiled_header &pch,
+                         const compiler_options &args,
+                         const raw_options &raw_args,
+                         const translate_options &options = {}
+      ) const override {
+        auto result = translate_common(src, args, raw_args, options);
+        result.insert(result.end(), {"-x", "c++-header", pch.header, "-o",
+                                     pch.pch});
+        return result;
+      }
+
+      virtual std::optional<std::vector<std::string>>
+      read_dependencies(const translate_options &options,
+                        std::string &) const override {
+        if(!options.depfile)
+          return std::nullopt;
+        auto depfile = read_file(*options.depfile);
+        if(!depfile)
+          return std::nullopt;
+        return parse_depfile(*depfile);
+      }
+
+      virtual std::optional<compile_profile>
+      read_profile(const translate_options &options, std::string &,
+                   std::string &stderr_log) const override {
+        if(!options.profile)
+          return std::nullopt;
+        if(brand == "clang") {
+          auto trace = read_file(*options.profile);
+          return trace ? parse_time_trace(*trace) : std::nullopt;
+        } else if(brand == "gcc") {
+          return extract_time_report(stderr_log);
+        }
+        return std::nullopt;
+      }
+    private:
+      std::vector<std::string>
+      translate_common(const std::string &src, const compiler_options &args,
+                       const raw_options &raw_args,
+                       const translate_options &options) const {
         auto base_path = FILESYSTEM_NS::path(src).parent_path();
         std::vector<std::string> result = command;
         for(const auto &arg : args) {
@@ -49,18 +252,123 @@ namespace caliber {
             result.push_back(arg.value);
         }
 
-        result.insert(result.end(), {"-fsyntax-only", src});
+        if(options.depfile)
+          result.insert(result.end(), {"-MD", "-MF", *options.depfile});
+        if(options.profile) {
+          if(brand == "clang")
+            result.push_back("-ftime-trace=" + *options.profile);
+          else if(brand == "gcc")
+            result.push_back("-ftime-report");
+        }
         return result;
       }
     };
 
     struct msvc_compiler : compiler {
-      msvc_compiler(std::vector<std::string> command, std::string brand)
-        : compiler(std::move(command), std::move(brand), "msvc") {}
+      msvc_compiler(std::vector<std::string> command, std::string brand,
+                    std::string identity)
+        : compiler(std::move(command), std::move(brand), "msvc",
+                   std::move(identity)) {}
+
+      using compiler::translate_args;
+
+      virtual bool can_profile() const override {
+        return brand == "msvc" || brand == "clang-cl";
+      }
 
       virtual std::vector<std::string>
-      translate_args(const std::string &src, const compiler_options &args,
-                     const raw_options &raw_args) const override {
+      translate_args(const std::vector<std::string> &srcs,
+                     const compiler_options &args, const raw_options &raw_args,
+                     const translate_options &options = {}) const override {
+        assert(!srcs.empty() && "no source files");
+        assert((!options.profile || can_profile()) &&
+               "compiler can't profile itself");
+        assert((srcs.size() == 1 || !options.depfile) &&
+               "can't track dependencies of multiple files");
+        assert(!options.from_stdin && "MSVC can't read sources from stdin");
+        auto result = translate_common(srcs.front(), args, raw_args, options);
+
+        if(options.prelude) {
+          const auto &header = options.prelude->header;
+          result.insert(result.end(), {"/Yu" + header, "/FI" + header,
+                                       "/Fp" + options.prelude->pch});
+        }
+
+        result.push_back("/Zs");
+        if(options.fatal_errors && brand == "clang-cl")
+          result.push_back("/clang:-Wfatal-errors");
+        result.insert(result.end(), srcs.begin(), srcs.end());
+        return result;
+      }
+
+      virtual std::string
+      pch_path(const std::string &header) const override {
+        return header + ".pch";
+      }
+
+      virtual std::vector<std::string>
+      translate_pch_args(const std::string &src, const precompiled_header &pch,
+                         const compiler_options &args,
+                         const raw_options &raw_args,
+                         const translate_options &options = {}
+      ) const override {
+        // MSVC can only build a PCH as a side effect of compiling a source
+        // file, so put the object file next to the PCH and compile the stub
+        // source that includes our header.
+        auto result = translate_common(src, args, raw_args, options);
+        result.insert(result.end(), {
+          "/Yc" + pch.header, "/Fp" + pch.pch, "/Fo" + pch.pch + ".obj", "/c",
+          pch.source
+        });
+        return result;
+      }
+
+      virtual std::optional<std::vector<std::string>>
+      read_dependencies(const translate_options &options,
+                        std::string &stdout_log) const override {
+        if(!options.depfile)
+          return std::nullopt;
+
+        // Pull out all the lines from /showIncludes, leaving the rest of the
+        // output alone.
+        static const std::string prefix = "Note: including file:";
+        std::vector<std::string> deps;
+        std::string remaining;
+        std::istringstream is(stdout_log);
+        for(std::string line; std::getline(is, line);) {
+          if(line.compare(0, prefix.size(), prefix) == 0) {
+            auto start = line.find_first_not_of(" ", prefix.size());
+            auto end = line.find_last_not_of("\r");
+            if(start != std::string::npos && end >= start)
+              deps.push_back(line.substr(start, end - start + 1));
+          } else {
+            remaining += line;
+            if(!is.eof())
+              remaining += '\n';
+          }
+        }
+        stdout_log = std::move(remaining);
+        return deps;
+      }
+
+      virtual std::optional<compile_profile>
+      read_profile(const translate_options &options, std::string &stdout_log,
+                   std::string &) const override {
+        if(!options.profile)
+          return std::nullopt;
+        if(brand == "clang-cl") {
+          auto trace = read_file(*options.profile);
+          return trace ? parse_time_trace(*trace) : std::nullopt;
+        } else if(brand == "msvc") {
+          return extract_report_time(stdout_log);
+        }
+        return std::nullopt;
+      }
+    private:
+      std::vector<std::string>
+      translate_common(const std::string &src, const compiler_options &args,
+                       const raw_options &raw_args,
+                       const translate_options &options) const {
         auto base_path = FILESYSTEM_NS::path(src).parent_path();
         std::vector<std::string> result = command;
         for(const auto &arg : args) {
@@ -81,7 +389,14 @@ namespace caliber {
             result.push_back(arg.value);
         }
 
-        result.insert(result.end(), {"/Zs", src});
+        if(options.depfile)
+          result.push_back("/showIncludes");
+        if(options.profile) {
+          if(brand == "clang-cl")
+            result.push_back("/clang:-ftime-trace=" + *options.profile);
+          else if(brand == "msvc")
+            result.push_back("/d1reportTime");
+        }
         return result;
       }
     };
@@ -97,31 +412,191 @@ namespace caliber {
       return platform::slurp(argv.get());
     }
 
-    std::pair<std::string, std::string>
-    detect_flavor(const std::vector<std::string> &command) {
+    struct detected_flavor {
+      std::string brand, flavor, identity;
+    };
+
+    // Get the first non-empty line of the compiler's output. This generally
+    // holds the compiler's name and version, which lets us tell different
+    // builds of the same brand of compiler apart.
+    std::string first_line(const std::string &output) {
+      std::size_t start = output.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos)
+        return "";
+      std::size_t end = output.find_first_of("\r\n", start);
+      return output.substr(start, end == std::string::npos ? end : end - start);
+    }
+
+    detected_flavor detect_flavor(const std::vector<std::string> &command) {
       try {
         auto output = call_detect(command, "-?");
-        if(output.find("Microsoft (R)") != std::string::npos)
-          return {"msvc", "msvc"};
-        else if(output.find("clang LLVM compiler") != std::string::npos)
-          return {"clang-cl", "msvc"}; // XXX: Maybe brand this as "clang"?
-        else
-          return {"unknown", "msvc"};
+        auto identity = first_line(output);
+        if(output.find("Microsoft (R)") != std::string::npos) {
+          return {"msvc", "msvc", identity};
+        } else if(output.find("clang LLVM compiler") != std::string::npos) {
+          // XXX: Maybe brand this as "clang"?
+          return {"clang-cl", "msvc", identity};
+        } else {
+          return {"unknown", "msvc", identity};
+        }
       } catch (const std::runtime_error &) {
         try {
           auto output = call_detect(command, "--version");
+          auto identity = first_line(output);
           if(output.find("Free Software Foundation") != std::string::npos)
-            return {"gcc", "cc"};
+            return {"gcc", "cc", identity};
           else if(output.find("clang") != std::string::npos)
-            return {"clang", "cc"};
+            return {"clang", "cc", identity};
           else
-            return {"unknown", "cc"};
+            return {"unknown", "cc", identity};
         } catch (const std::runtime_error &) {
           throw std::runtime_error("unable to determine compiler flavor");
         }
       }
     }
 
+    // Find the file that running `name` would execute, searching the PATH if
+    // `name` doesn't have any directory components.
+    std::optional<std::string> find_program(const std::string &name) {
+      namespace fs = FILESYSTEM_NS;
+#ifndef _WIN32
+      const char path_sep = ':';
+      const std::vector<std::string> exts = {""};
+#else
+      const char path_sep = ';';
+      const std::vector<std::string> exts = {"", ".exe", ".bat", ".cmd"};
+#endif
+
+      auto try_path = [&](const fs::path &base) -> std::optional<std::string> {
+        for(const auto &ext : exts) {
+          auto path = base;
+          path += ext;
+          try {
+            if(fs::is_regular_file(path))
+              return fs::absolute(path).string();
+          } catch(const fs::filesystem_error &) {}
+        }
+        return std::nullopt;
+      };
+
+      fs::path program(name);
+      if(program.has_parent_path())
+        return try_path(program);
+
+      const char *env_path = std::getenv("PATH");
+      if(!env_path)
+        return std::nullopt;
+      std::string paths = env_path;
+      for(std::size_t start = 0; start <= paths.size();) {
+        auto end = paths.find(path_sep, start);
+        if(end == std::string::npos)
+          end = paths.size();
+        auto dir = paths.substr(start, end - start);
+        if(auto found = try_path(fs::path(dir.empty() ? "." : dir) / program))
+          return found;
+        start = end + 1;
+      }
+      return std::nullopt;
+    }
+
+    // Describe the programs that `command` runs, so that we can tell when
+    // they've been replaced (e.g. by upgrading the compiler). Commands like
+    // `ccache g++` run a wrapper around the real compiler, so describe every
+    // word of the command that names a program, not just the first.
+    std::optional<std::string>
+    describe_program(const std::vector<std::string> &command) {
+      if(command.empty())
+        return std::nullopt;
+
+      std::string result;
+      for(std::size_t i = 0; i != command.size(); i++) {
+        if(i != 0 && command[i].compare(0, 1, "-") == 0)
+          continue;
+        auto program = find_program(command[i]);
+        if(!program) {
+          if(i == 0)
+            return std::nullopt;
+          continue;
+        }
+        auto stamp = stamp_file(*program);
+        if(!stamp)
+          return std::nullopt;
+        if(!result.empty())
+          result += " ";
+        result += *program + " (" + std::to_string(stamp->mtime) + ", " +
+                  std::to_string(stamp->size) + ")";
+      }
+      return result;
+    }
+
+    const char flavor_cache_header[] = "caliber-compiler 1";
+
+    std::optional<std::string>
+    flavor_cache_path(const std::vector<std::string> &command,
+                      const std::string &cache_dir) {
+      auto program = describe_program(command);
+      if(!program)
+        return std::nullopt;
+
+      hasher h;
+      h.field(flavor_cache_header).field(*program);
+      h.field(std::to_string(command.size()));
+      for(const auto &i : command)
+        h.field(i);
+      return (FILESYSTEM_NS::path(cache_dir) / "compilers" /
+              h.hex_digest()).string();
+    }
+
+    // Like `detect_flavor`, but reuse the result of an earlier run from the
+    // cache if the compiler hasn't changed since then.
+    detected_flavor
+    cached_detect_flavor(const std::vector<std::string> &command,
+                         const std::string &cache_dir) {
+      auto path = flavor_cache_path(command, cache_dir);
+      if(!path)
+        return detect_flavor(command);
+
+      if(auto data = read_file(*path)) {
+        std::istringstream is(*data);
+        std::string header;
+        detected_flavor result;
+        if(std::getline(is, header) && header == flavor_cache_header &&
+           std::getline(is, result.brand) && std::getline(is, result.flavor) &&
+           std::getline(is, result.identity))
+          return result;
+      }
+
+      auto result = detect_flavor(command);
+      // Failing to write to the cache isn't fatal; we'll just detect the
+      // flavor again next time.
+      write_file_atomically(*path, std::string(flavor_cache_header) + "\n" +
+                            result.brand + "\n" + result.flavor + "\n" +
+                            result.identity + "\n");
+      return result;
+    }
+
+    detected_flavor
+    named_flavor(const std::vector<std::string> &command,
+                 const std::string &name) {
+      if(!known_flavor(name))
+        throw std::invalid_argument("unknown compiler flavor \"" + name + "\"");
+
+      // We don't know the compiler's version, so identify it by the program
+      // it runs instead.
+      auto identity = describe_program(command).value_or("");
+      if(name == "gcc" || name == "clang")
+        return {name, "cc", identity};
+      else if(name == "msvc" || name == "clang-cl")
+        return {name, "msvc", identity};
+      else
+        return {"unknown", "cc", identity};
+    }
+
+  }
+
+  bool known_flavor(const std::string &name) {
+    return name == "gcc" || name == "clang" || name == "msvc" ||
+           name == "clang-cl" || name == "cc";
   }
 
 // MSVC doesn't understand [[noreturn]], so just ignore the warning here.
@@ -131,12 +606,20 @@ namespace caliber {
 #endif
 
   std::unique_ptr<const compiler>
-  make_compiler(const std::vector<std::string> &command) {
-    auto [brand, flavor] = detect_flavor(command);
-    if(flavor == "cc")
-      return std::make_unique<cc_compiler>(command, std::move(brand));
-    else if(flavor == "msvc")
-      return std::make_unique<msvc_compiler>(command, std::move(brand));
+  make_compiler(const std::vector<std::string> &command,
+                const detect_options &options) {
+    auto [brand, flavor, identity] = (
+      options.flavor ? named_flavor(command, *options.flavor) :
+      options.cache_dir ? cached_detect_flavor(command, *options.cache_dir) :
+      detect_flavor(command)
+    );
+    if(flavor == "cc") {
+      return std::make_unique<cc_compiler>(command, std::move(brand),
+                                           std::move(identity));
+    } else if(flavor == "msvc") {
+      return std::make_unique<msvc_compiler>(command, std::move(brand),
+                                             std::move(identity));
+    }
 
     assert(false && "unknown compiler flavor");
   }
@@ -3,11 +3,14 @@
 
 #include <algorithm>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include <boost/program_options/option.hpp>
 
+#include "profile.hpp"
+
 namespace caliber {
 
   struct raw_option {
@@ -18,11 +21,44 @@ namespace caliber {
   using compiler_options = std::vector<boost::program_options::option>;
   using raw_options = std::vector<raw_option>;
 
+  // A header to be precompiled, along with where its compiled form lives.
+  struct precompiled_header {
+    // The header to include.
+    std::string header;
+    // A source file that includes nothing but `header`, for compilers that
+    // need one to build the precompiled header.
+    std::string source;
+    // The precompiled header itself.
+    std::string pch;
+  };
+
+  // Settings for a compilation that come from caliber itself, rather than
+  // from the test's options.
+  struct translate_options {
+    // If set, ask the compiler to report every file included by the source.
+    // cc-style compilers write these to this file; MSVC-style compilers write
+    // them to stdout instead.
+    std::optional<std::string> depfile = std::nullopt;
+    // If set, include this (already-built) precompiled header before the
+    // sources.
+    std::optional<precompiled_header> prelude = std::nullopt;
+    // If set, ask the compiler to profile itself. Compilers that write a
+    // trace file (i.e. clang) write it here; others report to their output.
+    std::optional<std::string> profile = std::nullopt;
+    // If true, the compiler reads the (single) source from stdin. The source's
+    // path is still used to resolve relative paths and to pick the language.
+    // Only compilers where `reads_stdin()` is true support this.
+    bool from_stdin = false;
+    // If true, ask the compiler to stop at the first error. Compilers with no
+    // way to do this (i.e. MSVC) ignore it.
+    bool fatal_errors = false;
+  };
+
   struct compiler {
     compiler(std::vector<std::string> command, std::string brand,
-             std::string flavor)
+             std::string flavor, std::string identity = "")
       : command(std::move(command)), brand(std::move(brand)),
-        flavor(std::move(flavor)) {}
+        flavor(std::move(flavor)), identity(std::move(identity)) {}
 
     virtual ~compiler() {}
 
@@ -30,18 +66,104 @@ namespace caliber {
       return query == flavor || (brand != "unknown" && query == brand);
     }
 
-    // Eventually, this should be virtual so we can implement different flavors
-    // of compiler (i.e. msvc vs cc).
+    // Whether this compiler can read its source from stdin.
+    virtual bool reads_stdin() const {
+      return false;
+    }
+
+    // Whether this compiler can profile itself (see
+    // `translate_options::profile`).
+    virtual bool can_profile() const = 0;
+
+    // Translate a test's options into a command line that compiles `srcs`.
+    // Relative paths in the options are resolved relative to the first source
+    // file. The sources always come last on the command line. Dependencies can
+    // only be requested when compiling a single source file.
     virtual std::vector<std::string>
+    translate_args(const std::vector<std::string> &srcs,
+                   const compiler_options &args, const raw_options &raw_args,
+                   const translate_options &options = {}) const = 0;
+
+    std::vector<std::string>
     translate_args(const std::string &src, const compiler_options &args,
-                   const raw_options &raw_args) const = 0;
+                   const raw_options &raw_args,
+                   const translate_options &options = {}) const {
+      return translate_args(std::vector<std::string>{src}, args, raw_args,
+                            options);
+    }
+
+    // Translate a test's options into a command line that writes the files
+    // each of `srcs` includes to stdout without checking them, for
+    // `read_deps_list`. Returns nothing if the compiler can't do that.
+    virtual std::optional<std::vector<std::string>>
+    translate_deps_args(const std::vector<std::string> &,
+                        const compiler_options &, const raw_options &,
+                        const translate_options & = {}) const {
+      return std::nullopt;
+    }
+
+    // Get the files included by each of `srcs` (in order) from the output of
+    // a command from `translate_deps_args`, or nothing if they couldn't be
+    // determined.
+    virtual std::optional<std::vector<std::vector<std::string>>>
+    read_deps_list(const std::vector<std::string> &,
+                   const std::string &) const {
+      return std::nullopt;
+    }
+
+    // Get the path where the compiler expects to find the precompiled form of
+    // `header` when including it.
+    virtual std::string pch_path(const std::string &header) const = 0;
+
+    // Translate a test's options into a command line that builds `pch.pch`
+    // from `pch.header`. Relative paths in the options are resolved relative
+    // to `src`, just like in `translate_args`. The result can be used with any
+    // test whose options are the same.
+    virtual std::vector<std::string>
+    translate_pch_args(const std::string &src, const precompiled_header &pch,
+                       const compiler_options &args,
+                       const raw_options &raw_args,
+                       const translate_options &options = {}) const = 0;
+
+    // Get the files included by a compilation run with `options.depfile` set,
+    // or nothing if they couldn't be determined. If the compiler wrote them
+    // to stdout, they're removed from `stdout_log`.
+    virtual std::optional<std::vector<std::string>>
+    read_dependencies(const translate_options &options,
+                      std::string &stdout_log) const = 0;
+
+    // Get the profile of a compilation run with `options.profile` set, or
+    // nothing if the compiler doesn't support profiling. If the compiler wrote
+    // its profile to stdout or stderr, it's removed from the log.
+    virtual std::optional<compile_profile>
+    read_profile(const translate_options &options, std::string &stdout_log,
+                 std::string &stderr_log) const = 0;
 
     std::vector<std::string> command;
     std::string brand, flavor;
+    // A description of the specific compiler build (usually its version
+    // string), used to invalidate cached results when the compiler changes.
+    std::string identity;
   };
 
+  // Options controlling how `make_compiler` determines a compiler's flavor.
+  struct detect_options {
+    // If set, use this brand or flavor (e.g. "gcc" or "msvc") rather than
+    // running the compiler to find out.
+    std::optional<std::string> flavor = std::nullopt;
+    // If set, remember the detected flavor in this directory, keyed on the
+    // command and the program it runs, so that later runs can skip detection.
+    std::optional<std::string> cache_dir = std::nullopt;
+  };
+
+  // Return true if `name` can be given as `detect_options::flavor`.
+  bool known_flavor(const std::string &name);
+
+  // Make a compiler for `command`. Throws `std::invalid_argument` if
+  // `options.flavor` isn't a known flavor.
   std::unique_ptr<const compiler>
-  make_compiler(const std::vector<std::string> &command);
+  make_compiler(const std::vector<std::string> &command,
+                const detect_options &options = {});
 
 } // namespace caliber
 
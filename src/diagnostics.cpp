@@ -0,0 +1,163 @@
+#include "diagnostics.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+#include "filesystem.hpp"
+
+namespace caliber {
+
+  namespace {
+    bool is_number(std::string_view s) {
+      return !s.empty() && std::all_of(s.begin(), s.end(), [](char c) {
+        return std::isdigit(static_cast<unsigned char>(c));
+      });
+    }
+
+    std::size_t to_number(std::string_view s) {
+      std::size_t result = 0;
+      for(char c : s)
+        result = result * 10 + static_cast<std::size_t>(c - '0');
+      return result;
+    }
+
+    // Check that `s` is empty or an error code like ` C2065`.
+    bool is_error_code(std::string_view s) {
+      return s.empty() || (s[0] == ' ' && std::all_of(
+        s.begin() + 1, s.end(), [](char c) {
+          return std::isalnum(static_cast<unsigned char>(c));
+        }
+      ));
+    }
+
+    // Split a location like `file:line:col`, `file:line`, `file(line)`, or
+    // `file(line,col)`. Anything else is just a file name.
+    diagnostic parse_location(std::string_view loc) {
+      if(!loc.empty() && loc.back() == ')') {
+        auto open = loc.rfind('(');
+        if(open != std::string_view::npos) {
+          auto inside = loc.substr(open + 1, loc.size() - open - 2);
+          auto line = inside.substr(0, inside.find(','));
+          if(is_number(line))
+            return {loc.substr(0, open), to_number(line), {}};
+        }
+        return {loc, 0, {}};
+      }
+
+      // Peel numbers off the end; if there are two, the last one is the
+      // column.
+      std::string_view numbers[2];
+      int count = 0;
+      for(; count != 2; count++) {
+        auto colon = loc.rfind(':');
+        if(colon == std::string_view::npos ||
+           !is_number(loc.substr(colon + 1)))
+          break;
+        numbers[count] = loc.substr(colon + 1);
+        loc = loc.substr(0, colon);
+      }
+      return {loc, count ? to_number(numbers[count - 1]) : 0, {}};
+    }
+  }
+
+  std::optional<diagnostic> parse_error(std::string_view line) {
+    if(!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+
+    // Most lines aren't errors, so rule them out quickly.
+    if(line.find("error") == std::string_view::npos)
+      return std::nullopt;
+
+    // Find where the location ends and the error begins. Errors with no
+    // location (e.g. for bad command-line options) start at the beginning of
+    // the line.
+    std::size_t loc_end = std::string_view::npos, kind_end = 0;
+    for(std::string_view kind : {"error", "fatal error"}) {
+      if(line.starts_with(kind) && line.size() > kind.size() &&
+         (line[kind.size()] == ':' || line[kind.size()] == ' ')) {
+        loc_end = 0;
+        kind_end = kind.size();
+        break;
+      }
+      auto i = line.find(": " + std::string(kind));
+      if(i < loc_end) {
+        loc_end = i;
+        kind_end = i + 2 + kind.size();
+      }
+    }
+    if(loc_end == std::string_view::npos)
+      return std::nullopt;
+
+    // The message comes after the kind of diagnostic, and possibly an error
+    // code (e.g. `error C2065: message`).
+    auto colon = line.find(": ", kind_end);
+    if(colon == std::string_view::npos ||
+       !is_error_code(line.substr(kind_end, colon - kind_end)))
+      return std::nullopt;
+
+    auto result = parse_location(line.substr(0, loc_end));
+    result.message = line.substr(colon + 2);
+    return result;
+  }
+
+  std::string describe(const expected_error &expected) {
+    std::string result = "an error";
+    if(expected.message)
+      result += " matching /" + expected.pattern + "/";
+    if(expected.line) {
+      result += " on line " + std::to_string(expected.line) + " of " +
+                expected.file;
+    }
+    return result;
+  }
+
+  bool diagnostic_matcher::scan(const std::string &stdout_log,
+                                const std::string &stderr_log,
+                                bool finished) {
+    // MSVC reports errors on stdout; everyone else uses stderr.
+    if(!matched_) {
+      matched_ = scan_log(stderr_log, stderr_offset_, finished) ||
+                 scan_log(stdout_log, stdout_offset_, finished);
+    }
+    return matched_;
+  }
+
+  bool diagnostic_matcher::scan_log(const std::string &log,
+                                    std::size_t &offset, bool finished) {
+    while(offset != log.size()) {
+      auto end = log.find('\n', offset);
+      if(end == std::string::npos) {
+        if(!finished)
+          return false;
+        end = log.size();
+      }
+
+      std::string_view line(log.data() + offset, end - offset);
+      offset = std::min(end + 1, log.size());
+      if(match(line))
+        return true;
+    }
+    return false;
+  }
+
+  bool diagnostic_matcher::match(std::string_view line) const {
+    auto error = parse_error(line);
+    if(!error)
+      return false;
+
+    if(expected_.line) {
+      // Compilers don't always spell the file's path the way we did, so just
+      // check that the names match.
+      namespace fs = FILESYSTEM_NS;
+      if(error->line != expected_.line ||
+         fs::path(std::string(error->file)).filename() !=
+         fs::path(expected_.file).filename())
+        return false;
+    }
+
+    return !expected_.message || std::regex_search(
+      error->message.begin(), error->message.end(), *expected_.message
+    );
+  }
+
+} // namespace caliber
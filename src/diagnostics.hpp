@@ -0,0 +1,67 @@
+#ifndef INC_CALIBER_SRC_DIAGNOSTICS_HPP
+#define INC_CALIBER_SRC_DIAGNOSTICS_HPP
+
+#include <cstddef>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+
+namespace caliber {
+
+  // An error reported by a compiler.
+  struct diagnostic {
+    std::string_view file;
+    // The line the error is on, or 0 if it doesn't have one.
+    std::size_t line;
+    std::string_view message;
+  };
+
+  // Parse a single line of a compiler's output as an error, like
+  // `file:line:col: error: message` (for cc-style compilers) or
+  // `file(line,col): error C1234: message` (for MSVC). Returns nothing if the
+  // line isn't an error.
+  std::optional<diagnostic> parse_error(std::string_view line);
+
+  // An error that a test expects the compiler to report.
+  struct expected_error {
+    // If set, the error's message must match this (anywhere in the message).
+    std::optional<std::regex> message;
+    std::string pattern;
+    // If nonzero, the error must be on this line of `file`.
+    std::size_t line = 0;
+    std::string file;
+  };
+
+  // Describe an expected error for a failure message.
+  std::string describe(const expected_error &expected);
+
+  // Looks for an expected error in a compiler's output as it arrives. Only
+  // complete lines are examined, and each line is only examined once, so this
+  // can be called repeatedly as the output grows.
+  class diagnostic_matcher {
+  public:
+    explicit diagnostic_matcher(const expected_error &expected)
+      : expected_(expected) {}
+
+    // Scan any new lines in the logs, returning true once the expected error
+    // has been found. If `finished` is true, the logs are complete, so scan
+    // any trailing partial lines too.
+    bool scan(const std::string &stdout_log, const std::string &stderr_log,
+              bool finished = false);
+
+    bool matched() const {
+      return matched_;
+    }
+  private:
+    bool scan_log(const std::string &log, std::size_t &offset, bool finished);
+    bool match(std::string_view line) const;
+
+    const expected_error &expected_;
+    std::size_t stdout_offset_ = 0, stderr_offset_ = 0;
+    bool matched_ = false;
+  };
+
+} // namespace caliber
+
+#endif
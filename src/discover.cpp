@@ -0,0 +1,338 @@
+#include "discover.hpp"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <optional>
+
+#include "filesystem.hpp"
+#include "job_pool.hpp"
+
+namespace caliber {
+
+  namespace {
+    namespace fs = FILESYSTEM_NS;
+
+    using components = std::vector<std::string_view>;
+
+    components split_path(std::string_view path) {
+      components result;
+      while(!path.empty()) {
+        auto sep = path.find('/');
+        auto part = path.substr(0, sep);
+        if(!part.empty() && part != ".")
+          result.push_back(part);
+        if(sep == std::string_view::npos)
+          break;
+        path.remove_prefix(sep + 1);
+      }
+      return result;
+    }
+
+    bool is_glob(std::string_view s) {
+      return s.find_first_of("*?[") != std::string_view::npos;
+    }
+
+    bool is_source(const fs::path &path) {
+      static const std::string exts[] = {".c", ".cc", ".cpp", ".cxx", ".c++"};
+      auto ext = path.extension().string();
+      return std::find(std::begin(exts), std::end(exts), ext) !=
+             std::end(exts);
+    }
+
+    // If the pattern element at `p` matches `c`, return the position of the
+    // next element.
+    std::optional<std::size_t>
+    match_char(std::string_view pattern, std::size_t p, char c) {
+      if(p == pattern.size())
+        return std::nullopt;
+      if(pattern[p] == '?')
+        return p + 1;
+
+      if(pattern[p] == '[') {
+        auto i = p + 1;
+        bool negate = i < pattern.size() &&
+                      (pattern[i] == '!' || pattern[i] == '^');
+        if(negate)
+          i++;
+        // A `]` right at the start of the set is just a character.
+        auto end = pattern.find(']', i + 1);
+        if(end != std::string_view::npos) {
+          bool found = false;
+          for(; i < end; i++) {
+            if(i + 2 < end && pattern[i + 1] == '-') {
+              found = found || (pattern[i] <= c && c <= pattern[i + 2]);
+              i += 2;
+            } else {
+              found = found || pattern[i] == c;
+            }
+          }
+          if(found != negate)
+            return end + 1;
+          return std::nullopt;
+        }
+        // An unterminated set is just a `[`.
+      }
+
+      if(pattern[p] == c)
+        return p + 1;
+      return std::nullopt;
+    }
+
+    bool match_component(std::string_view pattern, std::string_view name) {
+      // Like a shell, only match hidden files when asked for explicitly.
+      if(!name.empty() && name[0] == '.' &&
+         (pattern.empty() || pattern[0] != '.'))
+        return false;
+
+      std::size_t p = 0, n = 0;
+      std::optional<std::size_t> star_p;
+      std::size_t star_n = 0;
+      while(n != name.size()) {
+        if(p != pattern.size() && pattern[p] == '*') {
+          star_p = p++;
+          star_n = n;
+        } else if(auto next = match_char(pattern, p, name[n])) {
+          p = *next;
+          n++;
+        } else if(star_p) {
+          // Let the last `*` we saw eat one more character and try again.
+          p = *star_p + 1;
+          n = ++star_n;
+        } else {
+          return false;
+        }
+      }
+      while(p != pattern.size() && pattern[p] == '*')
+        p++;
+      return p == pattern.size();
+    }
+
+    // Match `path` against `pattern`, starting at `pi` and `si`. If `prefix`
+    // is true, check whether something inside the directory `path` could
+    // match instead.
+    bool match_components(const components &pattern, std::size_t pi,
+                          const components &path, std::size_t si,
+                          bool prefix) {
+      if(si == path.size()) {
+        if(prefix)
+          return pi != pattern.size();
+        return std::all_of(pattern.begin() + pi, pattern.end(),
+                           [](auto i) { return i == "**"; });
+      }
+      if(pi == pattern.size())
+        return false;
+      if(pattern[pi] == "**") {
+        return match_components(pattern, pi + 1, path, si, prefix) || (
+          path[si][0] != '.' &&
+          match_components(pattern, pi, path, si + 1, prefix)
+        );
+      }
+      return match_component(pattern[pi], path[si]) &&
+             match_components(pattern, pi + 1, path, si + 1, prefix);
+    }
+
+    // Split the glob `pattern` into the deepest directory without any
+    // wildcards, where we start walking, and the components after that.
+    std::pair<fs::path, components> split_glob(std::string_view pattern) {
+      auto parts = split_path(pattern);
+      auto first_glob = std::find_if(parts.begin(), parts.end(), is_glob);
+      fs::path base;
+      if(!pattern.empty() && pattern[0] == '/')
+        base = "/";
+      for(auto i = parts.begin(); i != first_glob; ++i)
+        base /= std::string(*i);
+      return {base, components(first_glob, parts.end())};
+    }
+
+    // Check whether anything in `dir`, which is at `relative` from where the
+    // glob starts, matches `pattern`. This stops at the first match.
+    bool any_matches(const fs::path &dir, const std::string &relative,
+                     const components &pattern) {
+      std::vector<std::pair<fs::path, bool>> entries;
+      try {
+        for(const auto &entry : fs::directory_iterator(
+              dir.empty() ? fs::path(".") : dir
+            )) {
+          if(fs::is_directory(entry.symlink_status()))
+            entries.emplace_back(entry.path(), true);
+          else if(fs::is_regular_file(entry.status()))
+            entries.emplace_back(entry.path(), false);
+        }
+      } catch(const fs::filesystem_error &) {}
+
+      for(const auto &[path, is_dir] : entries) {
+        auto name = path.filename().string();
+        auto sub = relative.empty() ? name : relative + "/" + name;
+        if(!match_components(pattern, 0, split_path(sub), 0, is_dir))
+          continue;
+        if(!is_dir || any_matches(path, sub, pattern))
+          return true;
+      }
+      return false;
+    }
+
+    // A directory being walked. It's listed on a worker thread, and then its
+    // files are produced on the calling thread.
+    struct dir_node {
+      dir_node(fs::path path, std::string relative)
+        : path(std::move(path)), relative(std::move(relative)),
+          ready(listed.get_future().share()) {}
+
+      fs::path path;
+      // The path relative to the root of the walk, separated by `/`.
+      std::string relative;
+
+      std::promise<void> listed = {};
+      std::shared_future<void> ready;
+      std::vector<std::string> files = {};
+      std::vector<std::shared_ptr<dir_node>> subdirs = {};
+    };
+
+    using node_ptr = std::shared_ptr<dir_node>;
+    using path_filter = std::function<bool(const std::string &)>;
+
+    class walker {
+    public:
+      explicit walker(std::size_t jobs) : pool_(jobs) {}
+
+      // Walk the directory `root`, producing every file whose relative path
+      // passes `accept`, and searching only subdirectories that pass
+      // `descend`.
+      void walk(const fs::path &root, const path_filter &accept,
+                const path_filter &descend,
+                const std::function<void(const std::string &)> &f) {
+        auto node = std::make_shared<dir_node>(root, "");
+        list(node, accept, descend);
+        try {
+          visit(node, f);
+        } catch(...) {
+          // The listing jobs still refer to our filters, so let them finish
+          // before we go.
+          settle(node);
+          throw;
+        }
+      }
+    private:
+      void list(const node_ptr &node, const path_filter &accept,
+                const path_filter &descend) {
+        pool_.submit([this, node, &accept, &descend]() {
+          try {
+            std::vector<std::pair<std::string, bool>> entries;
+            try {
+              auto dir = node->path.empty() ? fs::path(".") : node->path;
+              for(const auto &entry : fs::directory_iterator(dir)) {
+                // Don't follow symlinks to directories, since they could
+                // make a cycle.
+                if(fs::is_directory(entry.symlink_status()))
+                  entries.emplace_back(entry.path().filename().string(), true);
+                else if(fs::is_regular_file(entry.status()))
+                  entries.emplace_back(entry.path().filename().string(),
+                                       false);
+              }
+            } catch(const fs::filesystem_error &) {}
+            std::sort(entries.begin(), entries.end());
+
+            for(const auto &[name, is_dir] : entries) {
+              auto relative = node->relative.empty() ? name :
+                              node->relative + "/" + name;
+              if(is_dir && descend(relative)) {
+                node->subdirs.push_back(std::make_shared<dir_node>(
+                  node->path / name, std::move(relative)
+                ));
+                list(node->subdirs.back(), accept, descend);
+              } else if(!is_dir && accept(relative)) {
+                node->files.push_back((node->path / name).string());
+              }
+            }
+            node->listed.set_value();
+          } catch(...) {
+            // Pass the error on to the thread that's waiting for us.
+            node->listed.set_exception(std::current_exception());
+          }
+        });
+      }
+
+      void visit(const node_ptr &node,
+                 const std::function<void(const std::string &)> &f) {
+        node->ready.get();
+        for(const auto &i : node->files)
+          f(i);
+        for(const auto &i : node->subdirs)
+          visit(i, f);
+      }
+
+      // Wait until `node` and everything under it has been listed (or failed
+      // to be).
+      void settle(const node_ptr &node) {
+        node->ready.wait();
+        for(const auto &i : node->subdirs)
+          settle(i);
+      }
+
+      job_pool pool_;
+    };
+
+    std::string generic(std::string path) {
+#ifdef _WIN32
+      std::replace(path.begin(), path.end(), '\\', '/');
+#endif
+      return path;
+    }
+  }
+
+  bool glob_match(std::string_view pattern, std::string_view path) {
+    return match_components(split_path(pattern), 0, split_path(path), 0,
+                            false);
+  }
+
+  std::optional<std::string>
+  find_empty_glob(const std::vector<std::string> &inputs) {
+    for(const auto &input : inputs) {
+      if(!is_glob(input))
+        continue;
+      auto pattern = generic(input);
+      auto glob = split_glob(pattern);
+      if(!any_matches(glob.first, "", glob.second))
+        return input;
+    }
+    return std::nullopt;
+  }
+
+  void find_test_files(const std::vector<std::string> &inputs,
+                       std::size_t jobs,
+                       const std::function<void(const std::string &)> &f) {
+    std::optional<walker> w;
+    for(const auto &input : inputs) {
+      if(is_glob(input)) {
+        // Start walking from the deepest directory without any wildcards.
+        auto pattern = generic(input);
+        auto glob = split_glob(pattern);
+        const auto &rest_parts = glob.second;
+
+        if(!w)
+          w.emplace(jobs);
+        w->walk(glob.first, [&](const std::string &relative) {
+          return match_components(rest_parts, 0, split_path(relative), 0,
+                                  false);
+        }, [&](const std::string &relative) {
+          return match_components(rest_parts, 0, split_path(relative), 0,
+                                  true);
+        }, f);
+      } else if(fs::is_directory(input)) {
+        if(!w)
+          w.emplace(jobs);
+        w->walk(input, [](const std::string &relative) {
+          return is_source(relative);
+        }, [](const std::string &relative) {
+          // Skip hidden directories, like `.git`.
+          auto name = relative.substr(relative.rfind('/') + 1);
+          return name.empty() || name[0] != '.';
+        }, f);
+      } else {
+        f(input);
+      }
+    }
+  }
+
+} // namespace caliber
@@ -0,0 +1,37 @@
+#ifndef INC_CALIBER_SRC_DISCOVER_HPP
+#define INC_CALIBER_SRC_DISCOVER_HPP
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace caliber {
+
+  // Match `path` against the glob `pattern`. Both are split into components
+  // on `/`; within a component, `*` matches any run of characters, `?` any
+  // single character, and `[...]` any character in the set. A component of
+  // `**` matches any number of components. As in a shell, wildcards never
+  // match a component starting with `.`.
+  bool glob_match(std::string_view pattern, std::string_view path);
+
+  // Return the first glob pattern in `inputs` that doesn't match any files,
+  // if there is one, so that it can be reported before we start running
+  // tests.
+  std::optional<std::string>
+  find_empty_glob(const std::vector<std::string> &inputs);
+
+  // Expand `inputs` into test files, calling `f` with each one as soon as
+  // it's found. Inputs can be files (which are passed through as-is),
+  // directories (which are searched recursively for C and C++ sources), or
+  // glob patterns. Directories are listed in parallel on `jobs` threads, but
+  // files are always produced in the same order: inputs in the order given,
+  // and each directory's files in sorted order before its subdirectories'.
+  void find_test_files(const std::vector<std::string> &inputs,
+                       std::size_t jobs,
+                       const std::function<void(const std::string &)> &f);
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,177 @@
+#include "files.hpp"
+
+#include <cerrno>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/file.h>
+#  include <unistd.h>
+#else
+#  include <windows.h>
+#endif
+
+#include "filesystem.hpp"
+#include "hash.hpp"
+
+namespace caliber {
+
+  std::string random_suffix() {
+    static thread_local std::mt19937_64 engine{std::random_device{}()};
+    hasher h;
+    h.field(std::to_string(engine()));
+    return h.hex_digest();
+  }
+
+  std::optional<file_stamp> stamp_file(const std::string &path) {
+    namespace fs = FILESYSTEM_NS;
+    try {
+      auto mtime = fs::last_write_time(path);
+      auto size = fs::file_size(path);
+#ifdef CALIBER_BOOST_FILESYSTEM
+      return file_stamp{static_cast<std::int64_t>(mtime), size};
+#else
+      return file_stamp{mtime.time_since_epoch().count(), size};
+#endif
+    } catch(const fs::filesystem_error &) {
+      return std::nullopt;
+    }
+  }
+
+  void write_field(std::ostream &os, std::string_view value) {
+    os << value.size() << "\n";
+    os.write(value.data(), value.size());
+    os << "\n";
+  }
+
+  bool read_field(std::istream &is, std::string &value) {
+    std::size_t size;
+    if(!(is >> size) || is.get() != '\n')
+      return false;
+    value.resize(size);
+    if(!is.read(value.data(), size) || is.get() != '\n')
+      return false;
+    return true;
+  }
+
+  std::optional<std::string> read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+      return std::nullopt;
+
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    if(in.bad())
+      return std::nullopt;
+    return ss.str();
+  }
+
+  void remove_file(const std::string &path) {
+    namespace fs = FILESYSTEM_NS;
+    try {
+      fs::remove(path);
+    } catch(const fs::filesystem_error &) {}
+  }
+
+  bool write_file_atomically(const std::string &path,
+                             std::string_view contents) {
+    namespace fs = FILESYSTEM_NS;
+
+    // Pick a random name for the temporary file so that concurrent writers
+    // don't step on each other.
+    fs::path final_path(path);
+    fs::path tmp_path = final_path;
+    tmp_path += "." + random_suffix() + ".tmp";
+
+    try {
+      if(final_path.has_parent_path())
+        fs::create_directories(final_path.parent_path());
+
+      {
+        std::ofstream out(tmp_path.string(), std::ios::binary);
+        out.write(contents.data(), contents.size());
+        out.close();
+        if(!out) {
+          remove_file(tmp_path.string());
+          return false;
+        }
+      }
+
+      fs::rename(tmp_path, final_path);
+      return true;
+    } catch(const fs::filesystem_error &) {
+      remove_file(tmp_path.string());
+      return false;
+    }
+  }
+
+#ifndef _WIN32
+  file_lock::file_lock(const std::string &path) {
+    namespace fs = FILESYSTEM_NS;
+    try {
+      fs::path p(path);
+      if(p.has_parent_path())
+        fs::create_directories(p.parent_path());
+    } catch(const fs::filesystem_error &) {}
+
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(fd_ == -1)
+      return;
+    while(flock(fd_, LOCK_EX) == -1) {
+      if(errno != EINTR) {
+        close(fd_);
+        fd_ = -1;
+        return;
+      }
+    }
+  }
+
+  file_lock::~file_lock() {
+    // Closing the file releases the lock.
+    if(fd_ != -1)
+      close(fd_);
+  }
+#else
+  file_lock::file_lock(const std::string &path) {
+    namespace fs = FILESYSTEM_NS;
+    fs::path p(path);
+    try {
+      if(p.has_parent_path())
+        fs::create_directories(p.parent_path());
+    } catch(const fs::filesystem_error &) {}
+
+    HANDLE handle = CreateFileW(
+      p.c_str(), GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr
+    );
+    if(handle == INVALID_HANDLE_VALUE) {
+      handle_ = nullptr;
+      return;
+    }
+
+    OVERLAPPED overlapped = {};
+    if(!LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+      CloseHandle(handle);
+      handle_ = nullptr;
+      return;
+    }
+    handle_ = handle;
+  }
+
+  file_lock::~file_lock() {
+    // Closing the file releases the lock.
+    if(handle_)
+      CloseHandle(handle_);
+  }
+#endif
+
+  bool rewrite_file_locked(const std::string &path,
+                           const std::function<std::string()> &contents) {
+    file_lock lock(path + ".lock");
+    return write_file_atomically(path, contents());
+  }
+
+} // namespace caliber
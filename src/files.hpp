@@ -0,0 +1,97 @@
+#ifndef INC_CALIBER_SRC_FILES_HPP
+#define INC_CALIBER_SRC_FILES_HPP
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace caliber {
+
+  // A cheap fingerprint of a file's contents, used to decide whether we need
+  // to look at the file more closely.
+  struct file_stamp {
+    std::int64_t mtime;
+    std::uintmax_t size;
+
+    bool operator ==(const file_stamp &rhs) const {
+      return mtime == rhs.mtime && size == rhs.size;
+    }
+    bool operator !=(const file_stamp &rhs) const {
+      return !(*this == rhs);
+    }
+  };
+
+  // Get the stamp for a file, or return nothing if the file doesn't exist.
+  std::optional<file_stamp> stamp_file(const std::string &path);
+
+  // Generate a random string suitable for making unique file names.
+  std::string random_suffix();
+
+  // Write a length-prefixed field to one of our cache files, so that it can
+  // hold anything (including newlines).
+  void write_field(std::ostream &os, std::string_view value);
+  // Read a field written by `write_field`, returning false if it's invalid.
+  bool read_field(std::istream &is, std::string &value);
+
+  // Read the entire contents of a file, or return nothing if it couldn't be
+  // read.
+  std::optional<std::string> read_file(const std::string &path);
+
+  // Remove a file if it exists, ignoring any errors.
+  void remove_file(const std::string &path);
+
+  // Write `contents` to a temporary file and then rename it to `path`, so that
+  // readers (possibly in other processes) never see a partially-written file.
+  // Any missing parent directories are created. Returns false on failure.
+  bool write_file_atomically(const std::string &path,
+                             std::string_view contents);
+
+  // Hold an advisory lock on `path` (creating it if need be) until this is
+  // destroyed, so that processes sharing one of our cache files can take turns
+  // updating it. If the lock can't be taken, we carry on without it.
+  class file_lock {
+  public:
+    explicit file_lock(const std::string &path);
+    file_lock(const file_lock &) = delete;
+    file_lock & operator =(const file_lock &) = delete;
+    ~file_lock();
+  private:
+#ifndef _WIN32
+    int fd_;
+#else
+    void *handle_;
+#endif
+  };
+
+  // Rewrite one of our cache files, which other processes might be saving
+  // too. While holding a `file_lock` on `path`, call `contents` to make the
+  // file's new contents (e.g. by merging ours into what's there now), and
+  // then write them with `write_file_atomically`. Returns false on failure.
+  bool rewrite_file_locked(const std::string &path,
+                           const std::function<std::string()> &contents);
+
+  // Save the map `entries` to the cache file at `path`. Other processes may
+  // have saved the file since we loaded it, so first read it with `load` and
+  // keep its entries, except for the ones we've updated since (those whose
+  // `updated` member is set); then format the result with `write`.
+  template<typename Map, typename Load, typename Write>
+  bool save_merged(const std::string &path, const Map &entries, Load &&load,
+                   Write &&write) {
+    return rewrite_file_locked(path, [&]() {
+      Map merged;
+      load(path, merged);
+      for(const auto &i : entries) {
+        if(i.second.updated || !merged.count(i.first))
+          merged.insert_or_assign(i.first, i.second);
+      }
+      return write(merged);
+    });
+  }
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef INC_CALIBER_SRC_FILESYSTEM_HPP
+#define INC_CALIBER_SRC_FILESYSTEM_HPP
+
+#ifdef CALIBER_BOOST_FILESYSTEM
+#  include <boost/filesystem.hpp>
+#  define FILESYSTEM_NS boost::filesystem
+#else
+#  include <filesystem>
+#  define FILESYSTEM_NS std::filesystem
+#endif
+
+#endif
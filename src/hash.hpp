@@ -0,0 +1,48 @@
+#ifndef INC_CALIBER_SRC_HASH_HPP
+#define INC_CALIBER_SRC_HASH_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace caliber {
+
+  // An incremental 64-bit FNV-1a hash. This isn't cryptographically secure,
+  // but it's more than enough to tell apart the inputs of a test suite.
+  class hasher {
+  public:
+    hasher & update(std::string_view data) {
+      for(unsigned char c : data) {
+        state_ ^= c;
+        state_ *= prime;
+      }
+      return *this;
+    }
+
+    // Add a length-prefixed field to the hash so that adjacent fields can't
+    // run together (e.g. {"ab", "c"} and {"a", "bc"} hash differently).
+    hasher & field(std::string_view data) {
+      auto size = std::to_string(data.size());
+      return update(size).update(":").update(data);
+    }
+
+    std::uint64_t digest() const {
+      return state_;
+    }
+
+    std::string hex_digest() const {
+      static const char digits[] = "0123456789abcdef";
+      std::string result(16, '0');
+      auto value = state_;
+      for(std::size_t i = result.size(); i-- != 0; value >>= 4)
+        result[i] = digits[value & 0xf];
+      return result;
+    }
+  private:
+    static constexpr std::uint64_t prime = 0x100000001b3ULL;
+    std::uint64_t state_ = 0xcbf29ce484222325ULL;
+  };
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,61 @@
+#include "job_pool.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace caliber {
+
+  job_pool::job_pool(std::size_t size, bool held) : held_(held) {
+    assert(size > 0);
+    threads_.reserve(size);
+    for(std::size_t i = 0; i != size; i++)
+      threads_.emplace_back(&job_pool::work, this);
+  }
+
+  job_pool::~job_pool() {
+    {
+      std::lock_guard lock(mutex_);
+      held_ = false;
+      done_ = true;
+    }
+    cv_.notify_all();
+    for(auto &t : threads_)
+      t.join();
+  }
+
+  void job_pool::release() {
+    {
+      std::lock_guard lock(mutex_);
+      held_ = false;
+    }
+    cv_.notify_all();
+  }
+
+  void job_pool::push(std::function<void()> job, priority_type priority) {
+    {
+      std::lock_guard lock(mutex_);
+      jobs_.push_back({priority, submitted_++, std::move(job)});
+      std::push_heap(jobs_.begin(), jobs_.end());
+    }
+    cv_.notify_one();
+  }
+
+  void job_pool::work() {
+    while(true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() {
+          return done_ || (!held_ && !jobs_.empty());
+        });
+        if(jobs_.empty())
+          return;
+        std::pop_heap(jobs_.begin(), jobs_.end());
+        job = std::move(jobs_.back().run);
+        jobs_.pop_back();
+      }
+      job();
+    }
+  }
+
+} // namespace caliber
@@ -0,0 +1,77 @@
+#ifndef INC_CALIBER_SRC_JOB_POOL_HPP
+#define INC_CALIBER_SRC_JOB_POOL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace caliber {
+
+  // A fixed-size pool of worker threads. Jobs with a higher priority are
+  // started first, and jobs with the same priority are started in the order
+  // they were submitted; the results are retrieved via the futures returned
+  // from `submit`.
+  class job_pool {
+  public:
+    using priority_type = std::uint64_t;
+
+    // If `held` is true, no jobs start until `release` is called, so that
+    // all the jobs submitted before then start in order of priority.
+    explicit job_pool(std::size_t size, bool held = false);
+    ~job_pool();
+
+    job_pool(const job_pool &) = delete;
+    job_pool & operator =(const job_pool &) = delete;
+
+    template<typename F>
+    std::future<std::invoke_result_t<F>>
+    submit(F &&f, priority_type priority = 0) {
+      using result_type = std::invoke_result_t<F>;
+      auto task = std::make_shared<std::packaged_task<result_type()>>(
+        std::forward<F>(f)
+      );
+      auto result = task->get_future();
+      push([task]() { (*task)(); }, priority);
+      return result;
+    }
+
+    void release();
+
+    std::size_t size() const {
+      return threads_.size();
+    }
+  private:
+    struct queued_job {
+      priority_type priority;
+      std::uint64_t order;
+      std::function<void()> run;
+
+      // Orders the heap so that the next job to start is on top.
+      bool operator <(const queued_job &rhs) const {
+        if(priority != rhs.priority)
+          return priority < rhs.priority;
+        return order > rhs.order;
+      }
+    };
+
+    void push(std::function<void()> job, priority_type priority);
+    void work();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // A max-heap of the jobs waiting to start.
+    std::vector<queued_job> jobs_;
+    std::uint64_t submitted_ = 0;
+    bool held_, done_ = false;
+    std::vector<std::thread> threads_;
+  };
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,93 @@
+#include "output_capture.hpp"
+
+#include <algorithm>
+
+namespace caliber {
+
+  output_capture::output_capture(std::string &dest,
+                                 std::optional<std::size_t> limit,
+                                 std::optional<std::string> spill)
+    : dest_(dest), limit_(limit), spill_path_(std::move(spill)) {
+    if(limit_) {
+      head_limit_ = *limit_ / 2;
+      tail_limit_ = *limit_ - head_limit_;
+    }
+  }
+
+  void output_capture::append(std::string_view data) {
+    if(spilling_)
+      spill_.write(data.data(), data.size());
+    if(!limit_) {
+      dest_ += data;
+      return;
+    }
+
+    if(head_size_ < head_limit_) {
+      auto size = std::min(data.size(), head_limit_ - head_size_);
+      dest_ += data.substr(0, size);
+      head_size_ += size;
+      data.remove_prefix(size);
+    }
+    if(data.empty())
+      return;
+
+    // If this is the first time we've had too much output, start writing all
+    // of it to the spill file.
+    if(!spilling_ && spill_path_ && tail_.size() + data.size() > tail_limit_) {
+      start_spill();
+      spill_.write(data.data(), data.size());
+    }
+
+    tail_ += data;
+    if(tail_.size() > 2 * tail_limit_)
+      drop_tail(tail_.size() - tail_limit_);
+  }
+
+  void output_capture::finish() {
+    if(tail_.size() > tail_limit_)
+      drop_tail(tail_.size() - tail_limit_);
+
+    if(dropped_) {
+      // Don't show partial lines on either side of what we dropped, so long
+      // as that leaves something to show.
+      auto head_end = dest_.rfind('\n');
+      if(head_size_ && dest_.back() != '\n' && head_end != std::string::npos &&
+         head_end >= dest_.size() - head_size_) {
+        dropped_ += dest_.size() - head_end - 1;
+        dest_.resize(head_end + 1);
+      }
+      auto tail_start = tail_.find('\n');
+      if(!tail_at_line_start_ && tail_start != std::string::npos &&
+         tail_start + 1 != tail_.size())
+        drop_tail(tail_start + 1);
+
+      if(!dest_.empty() && dest_.back() != '\n')
+        dest_ += "\n";
+      dest_ += "caliber: dropped " + std::to_string(dropped_) +
+               " bytes of output";
+      if(spilling_) {
+        spill_.close();
+        dest_ += spill_ ? "; see " : "; unable to write it to ";
+        dest_ += *spill_path_;
+      }
+      dest_ += "\n";
+    }
+
+    dest_ += tail_;
+    tail_ = std::string();
+  }
+
+  void output_capture::drop_tail(std::size_t size) {
+    tail_at_line_start_ = tail_[size - 1] == '\n';
+    tail_.erase(0, size);
+    dropped_ += size;
+  }
+
+  void output_capture::start_spill() {
+    spilling_ = true;
+    spill_.open(*spill_path_, std::ios::binary);
+    spill_.write(dest_.data() + dest_.size() - head_size_, head_size_);
+    spill_.write(tail_.data(), tail_.size());
+  }
+
+} // namespace caliber
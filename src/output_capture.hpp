@@ -0,0 +1,56 @@
+#ifndef INC_CALIBER_SRC_OUTPUT_CAPTURE_HPP
+#define INC_CALIBER_SRC_OUTPUT_CAPTURE_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace caliber {
+
+  // Collects a stream of output into a string. If the stream gets longer than
+  // `limit`, only its start and end are kept (half the limit each), so memory
+  // use stays flat no matter how much a compiler says. Once that happens, the
+  // entire stream is written to `spill`, if set, instead.
+  //
+  // The start of the stream is appended to `dest` as it arrives, so it can be
+  // watched while the stream is still open; the end is added by `finish`.
+  class output_capture {
+  public:
+    explicit output_capture(std::string &dest,
+                            std::optional<std::size_t> limit = std::nullopt,
+                            std::optional<std::string> spill = std::nullopt);
+    output_capture(const output_capture &) = delete;
+    output_capture & operator =(const output_capture &) = delete;
+
+    void append(std::string_view data);
+
+    // Add the end of the stream to `dest`, along with a note saying how much
+    // was dropped from the middle (and where to find it), if anything.
+    void finish();
+
+    // The number of bytes dropped from the middle of the stream so far.
+    std::size_t dropped() const {
+      return dropped_;
+    }
+  private:
+    void drop_tail(std::size_t size);
+    void start_spill();
+
+    std::string &dest_;
+    std::optional<std::size_t> limit_;
+    std::size_t head_limit_ = 0, tail_limit_ = 0, head_size_ = 0;
+    // Everything after the head. This is allowed to grow to twice the tail's
+    // size before the oldest half is thrown away.
+    std::string tail_;
+    bool tail_at_line_start_ = true;
+    std::size_t dropped_ = 0;
+    std::optional<std::string> spill_path_;
+    std::ofstream spill_;
+    bool spilling_ = false;
+  };
+
+} // namespace caliber
+
+#endif
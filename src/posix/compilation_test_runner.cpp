@@ -1,42 +1,31 @@
 #include "../compilation_test_runner.hpp"
 
 #include <fcntl.h>
-#include <poll.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <system_error>
 
 #include <mettle/driver/exit_code.hpp>
 #include <mettle/driver/posix/scoped_pipe.hpp>
-#include <mettle/driver/posix/scoped_signal.hpp>
-#include <mettle/driver/posix/subprocess.hpp>
 #include <mettle/output.hpp>
 
+#include "../output_capture.hpp"
+#include "event_loop.hpp"
+#include "subprocess.hpp"
+
 // XXX: Use std::source_location instead when we're able.
-#define PARENT_FAILED() parent_failed(__FILE__, __LINE__)
+#define PARENT_FAILED() parent_failed(__FILE__, __LINE__, test_pgid)
 
 namespace caliber {
 
   namespace {
-    pid_t test_pgid = 0;
-    struct sigaction old_sigint, old_sigquit;
-
-    void sig_handler(int signum) {
-      assert(test_pgid != 0);
-      killpg(test_pgid, signum);
-
-      // Restore the previous signal action and re-raise the signal.
-      struct sigaction *old_act = signum == SIGINT ? &old_sigint : &old_sigquit;
-      sigaction(signum, old_act, nullptr);
-      raise(signum);
-    }
-
-    void sig_chld(int) {}
-
     inline std::string err_string(int errnum) {
       char buf[256];
 #ifdef _GNU_SOURCE
@@ -48,152 +37,190 @@ namespace caliber {
 #endif
     }
 
-    mettle::test_result
-    parent_failed(const char *file, std::uint_least32_t line) {
-      if(test_pgid)
-        killpg(test_pgid, SIGKILL);
-      test_pgid = 0;
+    compilation_result
+    parent_failed(const char *file, std::uint_least32_t line, pid_t pgid) {
+      int errnum = errno;
+      if(pgid)
+        killpg(pgid, SIGKILL);
 
-      return {{ .message = "Fatal error: " + err_string(errno),
-                .file_name = file, .line = line }};
+      return {{{ .message = "Fatal error: " + err_string(errnum),
+                 .file_name = file, .line = line }}};
     }
 
-    [[noreturn]] inline void child_failed() {
-      _exit(mettle::exit_code::fatal);
+    resource_usage make_usage(const struct rusage &ru) {
+      using namespace std::chrono;
+      auto to_us = [](const timeval &tv) {
+        return seconds(tv.tv_sec) + microseconds(tv.tv_usec);
+      };
+
+      resource_usage result;
+      result.user_time = to_us(ru.ru_utime);
+      result.system_time = to_us(ru.ru_stime);
+#ifdef __APPLE__
+      // macOS reports this in bytes; everyone else uses kilobytes.
+      result.max_rss = static_cast<std::uint64_t>(ru.ru_maxrss);
+#else
+      result.max_rss = static_cast<std::uint64_t>(ru.ru_maxrss) * 1024;
+#endif
+      result.minor_faults = static_cast<std::uint64_t>(ru.ru_minflt);
+      result.major_faults = static_cast<std::uint64_t>(ru.ru_majflt);
+      return result;
     }
 
-    std::unique_ptr<char *[]>
+    std::unique_ptr<const char *[]>
     make_argv(const std::vector<std::string> &argv) {
-      auto real_argv = std::make_unique<char *[]>(argv.size() + 1);
+      auto real_argv = std::make_unique<const char *[]>(argv.size() + 1);
       for(size_t i = 0; i != argv.size(); i++)
-        real_argv[i] = const_cast<char*>(argv[i].c_str());
+        real_argv[i] = argv[i].c_str();
       return real_argv;
     }
   }
 
-  mettle::test_result compilation_test_runner::operator ()(
-    const std::string &file, const compiler_options &args,
-    const raw_options &raw_args, bool expect_fail,
-    mettle::log::test_output &output
-  ) const {
-    using namespace mettle::posix;
-    assert(test_pgid == 0);
-
-    scoped_pipe stdout_pipe, stderr_pipe, pgid_pipe;
-    if(stdout_pipe.open() < 0 ||
-       stderr_pipe.open() < 0 ||
-       pgid_pipe.open(O_CLOEXEC) < 0)
-      return PARENT_FAILED();
-
-    auto final_args = compiler_->translate_args(file, args, raw_args);
-    fflush(nullptr);
-
-    scoped_sigprocmask mask;
-    if(mask.push(SIG_BLOCK, SIGCHLD) < 0 ||
-       mask.push(SIG_BLOCK, {SIGINT, SIGQUIT}) < 0)
-      return PARENT_FAILED();
-
-    pid_t pid;
-    if((pid = fork()) < 0)
-      return PARENT_FAILED();
-
-    if(pid == 0) {
-      if(mask.clear() < 0)
-        child_failed();
-
-      if(stdout_pipe.close_read() < 0 ||
-         stderr_pipe.close_read() < 0 ||
-         pgid_pipe.close_read() < 0)
-        child_failed();
+  // The event loop that watches all of the running tests. Since it blocks
+  // signals process-wide, every runner in the process shares the same one.
+  struct compilation_test_runner::running_tests {
+    static std::shared_ptr<running_tests> get() {
+      static std::mutex instance_mutex;
+      static std::weak_ptr<running_tests> instance;
+
+      std::lock_guard lock(instance_mutex);
+      auto result = instance.lock();
+      if(!result)
+        instance = result = std::make_shared<running_tests>();
+      return result;
+    }
 
-      if(stdout_pipe.move_write(STDOUT_FILENO) < 0 ||
-         stderr_pipe.move_write(STDERR_FILENO) < 0)
-        child_failed();
+    posix::event_loop loop;
+  };
 
-      // Make a new process group so we can kill the test and all its children
-      // as a group.
-      if(setpgid(0, 0) < 0)
-        child_failed();
+  compilation_test_runner::compilation_test_runner(
+    std::unique_ptr<const caliber::compiler> compiler, timeout_t timeout,
+    std::shared_ptr<compile_server_pool> server
+  ) : compiler_(std::move(compiler)), timeout_(timeout),
+      server_(server && server->supports(*compiler_) ? std::move(server)
+                                                     : nullptr),
+      running_(running_tests::get()) {}
 
-      if(send_pgid(pgid_pipe.write_fd, getpgid(0)) < 0)
-        child_failed();
+  compilation_test_runner::~compilation_test_runner() = default;
 
-      if(timeout_)
-        make_timeout_monitor(*timeout_);
+  void compilation_test_runner::cancel_all() const {
+    running_->loop.cancel_all();
+  }
 
-      execvp(compiler_->command[0].c_str(), make_argv(final_args).get());
-      child_failed();
-    } else {
-      scoped_sigaction sigint, sigquit, sigchld;
+  compilation_result compilation_test_runner::operator ()(
+    const std::vector<std::string> &args, bool expect_fail,
+    mettle::log::test_output &output, std::optional<std::string_view> input,
+    const output_watcher &watcher, const capture_options &capture
+  ) const {
+    using namespace mettle::posix;
+    pid_t test_pgid = 0;
 
-      if(stdout_pipe.close_write() < 0 ||
-         stderr_pipe.close_write() < 0 ||
-         pgid_pipe.close_write() < 0)
-        return PARENT_FAILED();
+    // Make sure our pipes are closed on exec so that compilers being run in
+    // other threads don't hold onto them.
+    scoped_pipe stdin_pipe, stdout_pipe, stderr_pipe;
+    if((input && stdin_pipe.open(O_CLOEXEC) < 0) ||
+       stdout_pipe.open(O_CLOEXEC) < 0 ||
+       stderr_pipe.open(O_CLOEXEC) < 0)
+      return PARENT_FAILED();
 
-      if(recv_pgid(pgid_pipe.read_fd, &test_pgid) < 0)
-        return PARENT_FAILED();
+    auto argv = make_argv(args);
 
-      if(sigaction(SIGINT, nullptr, &old_sigint) < 0 ||
-         sigaction(SIGQUIT, nullptr, &old_sigquit) < 0)
-        return PARENT_FAILED();
+    using namespace std::chrono;
+    std::optional<steady_clock::time_point> deadline;
+    if(timeout_)
+      deadline = steady_clock::now() + *timeout_;
 
-      if(sigint.open(SIGINT, sig_handler) < 0 ||
-         sigquit.open(SIGQUIT, sig_handler) < 0 ||
-         sigchld.open(SIGCHLD, sig_chld) < 0)
-        return PARENT_FAILED();
+    // Run the compiler in a new process group so we can kill the test and all
+    // its children as a group. The group's ID is the same as the compiler's
+    // PID, so we don't need to ask the child what it is.
+    posix::spawn_options options;
+    options.stdin_fd = stdin_pipe.read_fd;
+    options.stdout_fd = stdout_pipe.write_fd;
+    options.stderr_fd = stderr_pipe.write_fd;
+    options.new_process_group = true;
+    options.sigmask = &running_->loop.old_mask();
 
-      if(mask.pop() < 0)
-        return PARENT_FAILED();
+    pid_t pid;
+    if((pid = posix::spawn(argv.get(), options)) < 0)
+      return PARENT_FAILED();
+    test_pgid = pid;
 
-      std::vector<readfd> dests = {
-        {stdout_pipe.read_fd, &output.stdout_log},
-        {stderr_pipe.read_fd, &output.stderr_log}
-      };
+    if((input && stdin_pipe.close_read() < 0) ||
+       stdout_pipe.close_write() < 0 ||
+       stderr_pipe.close_write() < 0)
+      return PARENT_FAILED();
 
-      // Read from the piped stdout, stderr, and log. If we're interrupted
-      // (probably by SIGCHLD), do one last non-blocking read to get any data we
-      // might have missed.
-      sigset_t empty;
-      sigemptyset(&empty);
-      if(read_into(dests, nullptr, &empty) < 0) {
-        if(errno != EINTR)
-          return PARENT_FAILED();
-        timespec timeout = {0, 0};
-        if(read_into(dests, &timeout, nullptr) < 0)
-          return PARENT_FAILED();
+    // Let the event loop collect the compiler's output and wait for it to
+    // finish. If it passes the deadline, the loop kills the whole process
+    // group.
+    posix::child_exit exit;
+    auto spill_path = [&capture](const char *ext) {
+      return capture.spill ? std::optional(*capture.spill + ext)
+                           : std::nullopt;
+    };
+    output_capture stdout_capture(output.stdout_log, capture.stdout_limit,
+                                  spill_path(".stdout"));
+    output_capture stderr_capture(output.stderr_log, capture.stderr_limit,
+                                  spill_path(".stderr"));
+    try {
+      std::function<bool()> stop_early;
+      if(watcher)
+        stop_early = [&watcher, &output]() { return watcher(output); };
+      auto finished = running_->loop.watch(
+        pid, stdout_pipe.read_fd, stderr_pipe.read_fd, stdout_capture,
+        stderr_capture, deadline, std::move(stop_early)
+      );
+      // The loop is already draining the compiler's output, so it's safe to
+      // block while writing its input. If the compiler stops reading (e.g.
+      // because it gave up early), that's fine; otherwise, the loop is still
+      // using `output`, so wait for it to finish before bailing out.
+      int input_errno = 0;
+      if(input && ((posix::write_all(stdin_pipe.write_fd, *input) < 0 &&
+                    errno != EPIPE) || stdin_pipe.close_write() < 0)) {
+        input_errno = errno;
+        killpg(pid, SIGKILL);
       }
-
-      int status;
-      if(waitpid(pid, &status, 0) < 0)
+      exit = finished.get();
+      if(input_errno) {
+        errno = input_errno;
         return PARENT_FAILED();
+      }
+    } catch(const std::system_error &e) {
+      errno = e.code().value();
+      return PARENT_FAILED();
+    }
 
-      // Make sure everything in the test's process group is dead. Don't worry
-      // about reaping.
-      killpg(test_pgid, SIGKILL);
-      test_pgid = 0;
-
-      if(WIFEXITED(status)) {
-        int exit_status = WEXITSTATUS(status);
-        if(exit_status == mettle::exit_code::timeout) {
-          std::ostringstream ss;
-          ss << "Timed out after " << timeout_->count() << " ms";
-          return {{ .message = ss.str() }};
-        } else {
-          bool success = exit_status == mettle::exit_code::success;
-          if(success != expect_fail)
-            return std::nullopt;
-
-          std::ostringstream ss;
-          for(const auto &i : final_args)
-            ss << i << " ";
-          ss << (success ? "\nCompilation successful" : "\nCompilation failed");
-          return {{ .message = ss.str() }};
-        }
-      } else { // WIFSIGNALED
-        return {{ .message = strsignal(WTERMSIG(status)) }};
+    stdout_capture.finish();
+    stderr_capture.finish();
+
+    compilation_result result;
+    int status = exit.status;
+    if(exit.timed_out) {
+      std::ostringstream ss;
+      ss << "Timed out after " << timeout_->count() << " ms";
+      result = {{{ .message = ss.str() }}};
+    } else if(exit.cancelled) {
+      result = {{{ .message = "Cancelled" }}};
+      result.cancelled = true;
+    } else if(exit.stopped || WIFEXITED(status)) {
+      // If we stopped the compiler early, it's because it was going to fail
+      // anyway.
+      bool success = !exit.stopped &&
+                     WEXITSTATUS(status) == mettle::exit_code::success;
+      result.completed = true;
+      if(success == expect_fail) {
+        std::ostringstream ss;
+        for(const auto &i : args)
+          ss << i << " ";
+        ss << (success ? "\nCompilation successful" : "\nCompilation failed");
+        result.result = mettle::test_failure{ .message = ss.str() };
       }
+    } else { // WIFSIGNALED
+      result = {{{ .message = strsignal(WTERMSIG(status)) }}};
     }
+
+    result.usage = make_usage(exit.usage);
+    return result;
   }
 
 } // namespace caliber
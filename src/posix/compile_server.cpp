@@ -0,0 +1,223 @@
+#include "../compile_server.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+
+#include <mettle/driver/posix/scoped_pipe.hpp>
+
+#include "subprocess.hpp"
+
+namespace caliber {
+
+  struct compile_server_pool::worker {
+    worker() = default;
+    worker(const worker &) = delete;
+    worker & operator =(const worker &) = delete;
+
+    ~worker() {
+      // The server might be in the middle of a request, so don't bother
+      // asking it nicely to stop.
+      if(pid > 0) {
+        kill(pid, SIGKILL);
+        while(waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+      }
+    }
+
+    pid_t pid = -1;
+    mettle::posix::scoped_pipe to_server, from_server;
+    // Anything we've read from the server that isn't part of a message yet.
+    std::string buffer;
+  };
+
+  namespace {
+    using clock = std::chrono::steady_clock;
+
+    // Read from `fd` until `buffer` holds a whole message, and decode it.
+    // Returns nothing if the stream ends or breaks first, or if `deadline`
+    // passes (setting `timed_out`). Throws if the message is malformed.
+    // Decoding doesn't copy anything until the whole message is there, so
+    // trying again after each chunk is cheap even for a big reply.
+    template<typename Message>
+    std::optional<Message>
+    read_message(int fd, std::string &buffer,
+                 std::optional<clock::time_point> deadline, bool &timed_out) {
+      Message message;
+      while(true) {
+        if(auto size = server::decode(buffer, message)) {
+          buffer.erase(0, size);
+          return message;
+        }
+
+        int wait = -1;
+        if(deadline) {
+          using namespace std::chrono;
+          auto left = duration_cast<milliseconds>(*deadline - clock::now());
+          if(left.count() < 0) {
+            timed_out = true;
+            return std::nullopt;
+          }
+          // Round up so that we don't spin on a sub-millisecond remainder.
+          wait = static_cast<int>(left.count()) + 1;
+        }
+
+        pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, wait);
+        if(ready < 0 && errno != EINTR)
+          return std::nullopt;
+        if(ready <= 0)
+          continue;
+
+        char buf[BUFSIZ];
+        ssize_t size = read(fd, buf, sizeof(buf));
+        if(size < 0 && errno != EINTR)
+          return std::nullopt;
+        if(size == 0)
+          return std::nullopt;
+        if(size > 0)
+          buffer.append(buf, size);
+      }
+    }
+  }
+
+  compile_server_pool::compile_server_pool(std::vector<std::string> command)
+    : command_(std::move(command)) {}
+
+  compile_server_pool::~compile_server_pool() = default;
+
+  const std::string & compile_server_pool::version() {
+    std::lock_guard lock(mutex_);
+    if(!version_) {
+      // Start the first server now; we'll need it soon anyway.
+      std::string version;
+      auto w = start(version);
+      version_ = std::move(version);
+      if(w)
+        idle_.push_back(std::move(w));
+    }
+    return *version_;
+  }
+
+  std::optional<compile_reply>
+  compile_server_pool::compile(const std::vector<std::string> &args,
+                               std::optional<std::string_view> input,
+                               timeout_t timeout) {
+    auto w = acquire();
+    if(!w)
+      return std::nullopt;
+
+    server::request req = {args, std::nullopt};
+    if(input)
+      req.input.emplace(*input);
+
+    // If anything goes wrong, `w` is thrown away (and killed) when we return.
+    bool timed_out = false;
+    auto reply = exchange(*w, req, timeout, timed_out);
+    if(timed_out) {
+      compile_reply result;
+      result.timed_out = true;
+      return result;
+    }
+    if(!reply)
+      return std::nullopt;
+
+    release(std::move(w));
+    if(reply->status == server::verdict::unsupported)
+      return std::nullopt;
+    return compile_reply{false, reply->status == server::verdict::pass,
+                         std::move(reply->output), std::move(reply->includes)};
+  }
+
+  std::unique_ptr<compile_server_pool::worker>
+  compile_server_pool::start(std::string &version) {
+    if(command_.empty())
+      return nullptr;
+
+    auto w = std::make_unique<worker>();
+    if(w->to_server.open(O_CLOEXEC) < 0 || w->from_server.open(O_CLOEXEC) < 0)
+      return nullptr;
+
+    std::vector<const char *> argv;
+    for(const auto &i : command_)
+      argv.push_back(i.c_str());
+    argv.push_back(nullptr);
+
+    posix::spawn_options options;
+    options.stdin_fd = w->to_server.read_fd;
+    options.stdout_fd = w->from_server.write_fd;
+    // Servers are killed directly, so they don't need their own process
+    // group, but they should still get SIGINT and friends.
+    options.sigmask = posix::child_sigmask();
+    if((w->pid = posix::spawn(argv.data(), options)) < 0)
+      return nullptr;
+    if(w->to_server.close_read() < 0 || w->from_server.close_write() < 0)
+      return nullptr;
+
+    // Don't wait forever for something that doesn't speak our protocol.
+    bool timed_out = false;
+    std::optional<server::hello> hello;
+    try {
+      hello = read_message<server::hello>(
+        w->from_server.read_fd, w->buffer,
+        clock::now() + std::chrono::seconds(10), timed_out
+      );
+    } catch(const std::runtime_error &) {}
+    if(!hello || hello->protocol != server::protocol_version)
+      return nullptr;
+
+    version = std::move(hello->version);
+    return w;
+  }
+
+  std::optional<server::reply>
+  compile_server_pool::exchange(worker &w, const server::request &req,
+                                timeout_t timeout, bool &timed_out) {
+    std::optional<clock::time_point> deadline;
+    if(timeout)
+      deadline = clock::now() + *timeout;
+
+    // The server reads all of a request before it replies, so it's safe to
+    // block while we send it.
+    if(posix::write_all(w.to_server.write_fd, server::encode(req)) < 0)
+      return std::nullopt;
+
+    try {
+      return read_message<server::reply>(w.from_server.read_fd, w.buffer,
+                                         deadline, timed_out);
+    } catch(const std::runtime_error &) {
+      return std::nullopt;
+    }
+  }
+
+  std::unique_ptr<compile_server_pool::worker> compile_server_pool::acquire() {
+    {
+      std::lock_guard lock(mutex_);
+      if(!idle_.empty()) {
+        auto w = std::move(idle_.back());
+        idle_.pop_back();
+        return w;
+      }
+    }
+
+    // Every server is busy, so start another one. If it's somehow not the
+    // same version as the others (e.g. it was upgraded while we were
+    // running), we can't trust it.
+    std::string version;
+    auto w = start(version);
+    if(w && version != this->version())
+      return nullptr;
+    return w;
+  }
+
+  void compile_server_pool::release(std::unique_ptr<worker> w) {
+    std::lock_guard lock(mutex_);
+    idle_.push_back(std::move(w));
+  }
+
+} // namespace caliber
@@ -0,0 +1,398 @@
+#include "event_loop.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#  include <sys/epoll.h>
+#  include <sys/signalfd.h>
+#  include <sys/syscall.h>
+#else
+#  include <poll.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <iterator>
+#include <system_error>
+#include <vector>
+
+#include "subprocess.hpp"
+
+namespace caliber::posix {
+
+  namespace {
+    [[noreturn]] inline void throw_errno(int errnum = errno) {
+      throw std::system_error(errnum, std::system_category());
+    }
+
+    int open_pidfd(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+      return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+      (void)pid;
+      errno = ENOSYS;
+      return -1;
+#endif
+    }
+
+    int set_flags(int fd, int fd_flags, int fl_flags) {
+      int old_fd = fcntl(fd, F_GETFD);
+      int old_fl = fcntl(fd, F_GETFL);
+      if(old_fd < 0 || old_fl < 0 ||
+         fcntl(fd, F_SETFD, old_fd | fd_flags) < 0 ||
+         fcntl(fd, F_SETFL, old_fl | fl_flags) < 0)
+        return -1;
+      return 0;
+    }
+  }
+
+  event_loop::event_loop() {
+    // See if we can use pidfds by trying to open one for ourselves. If not,
+    // we'll fall back to watching for SIGCHLD.
+    int self = open_pidfd(getpid());
+    if(self >= 0) {
+      use_pidfd_ = true;
+      close(self);
+    }
+
+    sigemptyset(&signals_);
+    sigaddset(&signals_, SIGINT);
+    sigaddset(&signals_, SIGQUIT);
+    if(!use_pidfd_)
+      sigaddset(&signals_, SIGCHLD);
+
+    // Other threads write to this pipe to wake the loop up, e.g. when there's
+    // a new child to watch.
+    if(pipe(wake_pipe_) < 0 ||
+       set_flags(wake_pipe_[0], FD_CLOEXEC, O_NONBLOCK) < 0 ||
+       set_flags(wake_pipe_[1], FD_CLOEXEC, O_NONBLOCK) < 0)
+      throw_errno();
+
+    if(int err = pthread_sigmask(SIG_BLOCK, &signals_, &old_mask_))
+      throw_errno(err);
+
+#ifdef __linux__
+    if((epoll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      throw_errno();
+    if((signal_fd_ = signalfd(-1, &signals_, SFD_CLOEXEC | SFD_NONBLOCK)) < 0)
+      throw_errno();
+    add_fd(wake_pipe_[0]);
+    add_fd(signal_fd_);
+#else
+    // Without signalfd, wait for signals on a separate thread and forward
+    // them to the loop through the wake pipe.
+    signal_thread_ = std::thread([this]() {
+      while(true) {
+        int signum;
+        if(sigwait(&signals_, &signum) != 0)
+          continue;
+        {
+          std::lock_guard lock(mutex_);
+          if(done_)
+            return;
+        }
+        unsigned char byte = static_cast<unsigned char>(signum);
+        if(write(wake_pipe_[1], &byte, 1) < 0) {
+          // The pipe is full, so the loop will wake up soon anyway.
+        }
+      }
+    });
+#endif
+
+    thread_ = std::thread(&event_loop::run, this);
+    set_child_sigmask(&old_mask_);
+  }
+
+  event_loop::~event_loop() {
+    {
+      std::lock_guard lock(mutex_);
+      done_ = true;
+    }
+    wake();
+    thread_.join();
+
+#ifdef __linux__
+    close(signal_fd_);
+    close(epoll_fd_);
+#else
+    pthread_kill(signal_thread_.native_handle(), SIGQUIT);
+    signal_thread_.join();
+#endif
+
+    close(wake_pipe_[0]);
+    close(wake_pipe_[1]);
+    set_child_sigmask(nullptr);
+    pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+  }
+
+  std::future<child_exit>
+  event_loop::watch(pid_t pid, int stdout_fd, int stderr_fd,
+                    output_capture &stdout_log, output_capture &stderr_log,
+                    std::optional<clock::time_point> deadline,
+                    std::function<bool()> stop_early) {
+    // The pipes' file descriptors could be reused by the time a stale event
+    // for them comes in, so make sure reading them never blocks.
+    if(set_flags(stdout_fd, 0, O_NONBLOCK) < 0 ||
+       set_flags(stderr_fd, 0, O_NONBLOCK) < 0)
+      throw_errno();
+
+    int pidfd = -1;
+    if(use_pidfd_) {
+      if((pidfd = open_pidfd(pid)) < 0 ||
+         set_flags(pidfd, FD_CLOEXEC, 0) < 0)
+        throw_errno();
+    }
+
+    std::lock_guard lock(mutex_);
+    auto &c = children_.try_emplace(pid, child{
+      pid, pidfd, 2, deadline, std::move(stop_early)
+    }).first->second;
+    auto result = c.promise.get_future();
+
+    fds_[stdout_fd] = {pid, &stdout_log};
+    fds_[stderr_fd] = {pid, &stderr_log};
+    add_fd(stdout_fd);
+    add_fd(stderr_fd);
+    if(pidfd >= 0) {
+      fds_[pidfd] = {pid, nullptr};
+      add_fd(pidfd);
+    }
+
+    wake();
+    return result;
+  }
+
+  void event_loop::cancel_all() {
+    std::lock_guard lock(mutex_);
+    for(auto &i : children_) {
+      auto &c = i.second;
+      if(c.exited || c.result.timed_out || c.result.stopped)
+        continue;
+      killpg(c.pid, SIGKILL);
+      c.result.cancelled = true;
+      c.deadline.reset();
+    }
+  }
+
+  void event_loop::run() {
+    while(true) {
+      int timeout;
+      {
+        std::lock_guard lock(mutex_);
+        if(done_)
+          return;
+        timeout = wait_timeout();
+      }
+
+      std::vector<int> ready;
+#ifdef __linux__
+      epoll_event events[64];
+      int count = epoll_wait(epoll_fd_, events, 64, timeout);
+      for(int i = 0; i < count; i++)
+        ready.push_back(events[i].data.fd);
+#else
+      std::vector<pollfd> pollfds = {{wake_pipe_[0], POLLIN, 0}};
+      {
+        std::lock_guard lock(mutex_);
+        for(const auto &i : fds_)
+          pollfds.push_back({i.first, POLLIN, 0});
+      }
+      if(poll(pollfds.data(), pollfds.size(), timeout) > 0) {
+        for(const auto &i : pollfds) {
+          if(i.revents)
+            ready.push_back(i.fd);
+        }
+      }
+#endif
+
+      std::lock_guard lock(mutex_);
+      for(int fd : ready) {
+        if(fd == wake_pipe_[0]) {
+          unsigned char buf[64];
+          ssize_t size;
+          while((size = read(fd, buf, sizeof(buf))) > 0) {
+            for(ssize_t i = 0; i != size; i++) {
+              if(buf[i])
+                handle_signal(buf[i]);
+            }
+          }
+          // A child may have exited before we started watching it, in which
+          // case we already missed its SIGCHLD.
+          if(!use_pidfd_)
+            reap_all();
+#ifdef __linux__
+        } else if(fd == signal_fd_) {
+          signalfd_siginfo info;
+          while(read(fd, &info, sizeof(info)) == sizeof(info))
+            handle_signal(info.ssi_signo);
+#endif
+        } else {
+          auto i = fds_.find(fd);
+          if(i == fds_.end())
+            continue;
+          if(i->second.dest)
+            read_pipe(fd);
+          else
+            reap(children_.at(i->second.pid));
+        }
+      }
+
+      expire_deadlines();
+      finish_children();
+    }
+  }
+
+  int event_loop::wait_timeout() const {
+    std::optional<clock::time_point> next;
+    for(const auto &i : children_) {
+      const auto &deadline = i.second.deadline;
+      if(deadline && (!next || *deadline < *next))
+        next = deadline;
+    }
+    if(!next)
+      return -1;
+
+    using namespace std::chrono;
+    auto left = duration_cast<milliseconds>(*next - clock::now()).count();
+    // Round up so that we don't spin on a sub-millisecond remainder.
+    return left < 0 ? 0 : static_cast<int>(left) + 1;
+  }
+
+  void event_loop::wake() {
+    unsigned char byte = 0;
+    if(write(wake_pipe_[1], &byte, 1) < 0) {
+      // The pipe is full, so the loop will wake up soon anyway.
+    }
+  }
+
+  void event_loop::add_fd(int fd) {
+#ifdef __linux__
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+#else
+    (void)fd;
+#endif
+  }
+
+  void event_loop::remove_fd(int fd) {
+#ifdef __linux__
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+    fds_.erase(fd);
+  }
+
+  void event_loop::read_pipe(int fd) {
+    auto &watched = fds_.at(fd);
+    char buf[BUFSIZ];
+    ssize_t size = read(fd, buf, sizeof(buf));
+    if(size > 0) {
+      watched.dest->append({buf, static_cast<std::size_t>(size)});
+      auto &c = children_.at(watched.pid);
+      if(c.stop_early && !c.result.stopped && !c.exited && c.stop_early()) {
+        killpg(c.pid, SIGKILL);
+        c.result.stopped = true;
+        c.deadline.reset();
+      }
+      return;
+    }
+    if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+
+    // The pipe was closed (or broke), so stop watching it.
+    children_.at(watched.pid).open_pipes--;
+    remove_fd(fd);
+  }
+
+  void event_loop::reap(child &c) {
+    if(c.exited)
+      return;
+
+    int status;
+    struct rusage usage;
+    if(wait4(c.pid, &status, WNOHANG, &usage) != c.pid)
+      return;
+
+    c.exited = true;
+    c.result.status = status;
+    c.result.usage = usage;
+    if(c.pidfd >= 0) {
+      remove_fd(c.pidfd);
+      close(c.pidfd);
+      c.pidfd = -1;
+    }
+  }
+
+  void event_loop::reap_all() {
+    for(auto &i : children_)
+      reap(i.second);
+  }
+
+  void event_loop::handle_signal(int signum) {
+    if(signum == SIGCHLD) {
+      reap_all();
+      return;
+    }
+
+    // We're about to exit, so make sure none of our children outlive us.
+    // Forwarding the signal itself isn't enough, since e.g. shells ignore
+    // SIGINT in background jobs.
+    for(const auto &i : children_)
+      killpg(i.first, SIGKILL);
+
+    // Re-raise the signal and let it through to whatever action was set up
+    // before we started.
+    sigset_t unblock;
+    sigemptyset(&unblock);
+    sigaddset(&unblock, signum);
+    raise(signum);
+    pthread_sigmask(SIG_UNBLOCK, &unblock, nullptr);
+    pthread_sigmask(SIG_BLOCK, &unblock, nullptr);
+  }
+
+  void event_loop::expire_deadlines() {
+    auto now = clock::now();
+    for(auto &i : children_) {
+      auto &c = i.second;
+      if(c.deadline && *c.deadline <= now) {
+        killpg(c.pid, SIGKILL);
+        c.result.timed_out = true;
+        c.deadline.reset();
+      }
+    }
+  }
+
+  void event_loop::finish_children() {
+    for(auto i = children_.begin(); i != children_.end();) {
+      auto &c = i->second;
+      // Wait for the child's pipes to close too, since its own children may
+      // still be writing to them. If we killed it, though, don't wait for any
+      // stragglers that escaped its process group.
+      bool killed = c.result.timed_out || c.result.stopped ||
+                    c.result.cancelled;
+      if(!c.exited || (c.open_pipes && !killed)) {
+        ++i;
+        continue;
+      }
+
+      for(auto j = fds_.begin(); j != fds_.end();) {
+        auto next = std::next(j);
+        if(j->second.pid == c.pid)
+          remove_fd(j->first);
+        j = next;
+      }
+
+      // Make sure everything in the child's process group is dead. Don't
+      // worry about reaping.
+      killpg(c.pid, SIGKILL);
+      c.promise.set_value(c.result);
+      i = children_.erase(i);
+    }
+  }
+
+} // namespace caliber::posix
@@ -0,0 +1,130 @@
+#ifndef INC_CALIBER_SRC_POSIX_EVENT_LOOP_HPP
+#define INC_CALIBER_SRC_POSIX_EVENT_LOOP_HPP
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "../output_capture.hpp"
+
+namespace caliber::posix {
+
+  // How a child watched by an `event_loop` finished.
+  struct child_exit {
+    // The child's status, as returned by `waitpid`.
+    int status = 0;
+    // True if the child was killed because it passed its deadline.
+    bool timed_out = false;
+    // True if the child was killed because its `stop_early` callback said we
+    // had seen enough.
+    bool stopped = false;
+    // True if the child was killed by `cancel_all`.
+    bool cancelled = false;
+    // The resources used by the child and any of its children that it waited
+    // for.
+    struct rusage usage = {};
+  };
+
+  // A single thread that watches every running child process at once: it
+  // collects their output, reaps them when they exit, and kills them if they
+  // run past their deadline. Children are detected exiting via pidfds where
+  // available (Linux 5.3+), and via SIGCHLD otherwise.
+  //
+  // While the loop is alive, SIGINT and SIGQUIT (and SIGCHLD, if needed) are
+  // blocked in every thread, so it should be created before any other threads
+  // are started. When SIGINT or SIGQUIT arrives, the loop kills the process
+  // groups of all the children it's watching and then lets the signal through
+  // to whatever action was set up before we started.
+  class event_loop {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    event_loop();
+    event_loop(const event_loop &) = delete;
+    event_loop & operator =(const event_loop &) = delete;
+    ~event_loop();
+
+    // Watch the child `pid`, which must lead its own process group, passing
+    // whatever it writes to `stdout_fd` and `stderr_fd` on to `stdout_log`
+    // and `stderr_log`. The result is ready once the child has exited and both
+    // pipes have been closed; if that hasn't happened by `deadline`, the
+    // child's process group is killed. If set, `stop_early` is called on the
+    // loop's thread whenever more output arrives; if it returns true, the
+    // child's process group is killed too. The caller still owns the pipes and
+    // the captures, and mustn't touch the captures (or the strings they write
+    // to) until the result is ready.
+    std::future<child_exit>
+    watch(pid_t pid, int stdout_fd, int stderr_fd, output_capture &stdout_log,
+          output_capture &stderr_log,
+          std::optional<clock::time_point> deadline = std::nullopt,
+          std::function<bool()> stop_early = nullptr);
+
+    // Kill the process groups of all the children we're watching. Their
+    // results are ready once they've been reaped, as usual.
+    void cancel_all();
+
+    // The signal mask from before we started, which children should use.
+    const sigset_t & old_mask() const {
+      return old_mask_;
+    }
+  private:
+    struct child {
+      pid_t pid;
+      int pidfd;
+      int open_pipes;
+      std::optional<clock::time_point> deadline;
+      std::function<bool()> stop_early;
+      bool exited = false;
+      child_exit result = {};
+      std::promise<child_exit> promise = {};
+    };
+
+    struct watched_fd {
+      pid_t pid;
+      output_capture *dest;
+    };
+
+    void run();
+    int wait_timeout() const;
+    void wake();
+    void add_fd(int fd);
+    void remove_fd(int fd);
+
+    void read_pipe(int fd);
+    void reap(child &c);
+    void reap_all();
+    void handle_signal(int signum);
+    void expire_deadlines();
+    void finish_children();
+
+    sigset_t signals_, old_mask_;
+    bool use_pidfd_ = false;
+    int wake_pipe_[2] = {-1, -1};
+
+#ifdef __linux__
+    int epoll_fd_ = -1;
+    int signal_fd_ = -1;
+#else
+    std::thread signal_thread_;
+#endif
+
+    std::mutex mutex_;
+    bool done_ = false;
+    std::map<pid_t, child> children_;
+    // All the pipes and pidfds we're watching. Pidfds have a null `dest`.
+    std::map<int, watched_fd> fds_;
+    std::thread thread_;
+  };
+
+} // namespace caliber::posix
+
+#endif
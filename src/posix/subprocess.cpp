@@ -1,60 +1,166 @@
 #include "subprocess.hpp"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
+#include <atomic>
 #include <stdexcept>
 #include <system_error>
 
-#include <mettle/driver/exit_code.hpp>
 #include <mettle/driver/posix/scoped_pipe.hpp>
 
+extern char **environ;
+
 namespace caliber::posix {
 
   namespace {
-    [[noreturn]] inline void child_failed() {
-      _exit(mettle::exit_code::fatal);
+    std::atomic<const sigset_t *> saved_child_sigmask = nullptr;
+  }
+
+  const sigset_t * child_sigmask() {
+    return saved_child_sigmask;
+  }
+
+  void set_child_sigmask(const sigset_t *mask) {
+    saved_child_sigmask = mask;
+  }
+
+  pid_t spawn(const char *const argv[], const spawn_options &options) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    if(int err = posix_spawn_file_actions_init(&actions)) {
+      errno = err;
+      return -1;
+    }
+    if(int err = posix_spawnattr_init(&attr)) {
+      posix_spawn_file_actions_destroy(&actions);
+      errno = err;
+      return -1;
+    }
+
+    // Remember the first error, but keep going so that we always clean up.
+    int err = 0;
+    auto check = [&err](int result) {
+      if(!err)
+        err = result;
+    };
+
+    // Our pipes are opened with O_CLOEXEC, so there's no need to close the
+    // originals in the child; dup2 clears the flag on the new descriptors.
+    if(options.stdin_fd >= 0) {
+      check(posix_spawn_file_actions_adddup2(&actions, options.stdin_fd,
+                                             STDIN_FILENO));
+    }
+    if(options.stdout_fd >= 0) {
+      check(posix_spawn_file_actions_adddup2(&actions, options.stdout_fd,
+                                             STDOUT_FILENO));
+    }
+    if(options.stderr_fd >= 0) {
+      check(posix_spawn_file_actions_adddup2(&actions, options.stderr_fd,
+                                             STDERR_FILENO));
+    }
+
+    short flags = 0;
+    if(options.new_process_group) {
+      flags |= POSIX_SPAWN_SETPGROUP;
+      check(posix_spawnattr_setpgroup(&attr, 0));
+    }
+    if(options.sigmask) {
+      flags |= POSIX_SPAWN_SETSIGMASK;
+      check(posix_spawnattr_setsigmask(&attr, options.sigmask));
     }
+    check(posix_spawnattr_setflags(&attr, flags));
+
+    pid_t pid = -1;
+    if(!err) {
+      err = posix_spawnp(&pid, argv[0], &actions, &attr,
+                         const_cast<char *const *>(argv), environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if(err) {
+      errno = err;
+      return -1;
+    }
+
+    // Some implementations of posix_spawn return before the child has set
+    // its process group, so set it from here too, like shells do. If the
+    // child has already exec'ed, this fails harmlessly.
+    if(options.new_process_group)
+      setpgid(pid, pid);
+    return pid;
+  }
+
+  int write_all(int fd, std::string_view data) {
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    if(int err = pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask)) {
+      errno = err;
+      return -1;
+    }
+
+    int result = 0;
+    while(!data.empty()) {
+      ssize_t size = write(fd, data.data(), data.size());
+      if(size < 0) {
+        if(errno == EINTR)
+          continue;
+        result = -1;
+        break;
+      }
+      data.remove_prefix(size);
+    }
+
+    // Throw away the SIGPIPE we just got (if any) before unblocking it.
+    int errnum = errno;
+    sigset_t pending;
+    int signum;
+    if(sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE))
+      sigwait(&sigpipe, &signum);
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    errno = errnum;
+    return result;
   }
 
   std::string slurp(const char *argv[]) {
     mettle::posix::scoped_pipe stdout_pipe;
-    if(stdout_pipe.open() < 0)
+    if(stdout_pipe.open(O_CLOEXEC) < 0)
       throw std::system_error(errno, std::system_category());
 
-    pid_t pid;
-    if((pid = fork()) < 0)
+    spawn_options options;
+    options.stdout_fd = options.stderr_fd = stdout_pipe.write_fd;
+    // If an event loop has blocked SIGINT and friends, don't pass that on;
+    // we should still be able to interrupt a program that hangs.
+    options.sigmask = child_sigmask();
+    pid_t pid = spawn(argv, options);
+    if(pid < 0)
       throw std::system_error(errno, std::system_category());
-    if(pid == 0) {
-      if(stdout_pipe.close_read() < 0 ||
-         stdout_pipe.move_write(STDOUT_FILENO) < 0 ||
-         dup2(STDOUT_FILENO, STDERR_FILENO) < 0)
-        child_failed();
-
-      execvp(argv[0], const_cast<char**>(argv));
-      child_failed();
-    } else {
-      if(stdout_pipe.close_write() < 0)
-        throw std::system_error(errno, std::system_category());
 
-      std::string output;
-      ssize_t size;
-      char buf[BUFSIZ];
+    if(stdout_pipe.close_write() < 0)
+      throw std::system_error(errno, std::system_category());
 
-      do {
-        if((size = read(stdout_pipe.read_fd, buf, sizeof(buf))) < 0)
-          throw std::system_error(errno, std::system_category());
-        output.append(buf, size);
-      } while(size != 0);
+    std::string output;
+    ssize_t size;
+    char buf[BUFSIZ];
 
-      int status;
-      if(waitpid(pid, &status, 0) < 0)
+    do {
+      if((size = read(stdout_pipe.read_fd, buf, sizeof(buf))) < 0)
         throw std::system_error(errno, std::system_category());
-      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-        throw std::runtime_error("subprocess failed");
+      output.append(buf, size);
+    } while(size != 0);
 
-      return output;
-    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0)
+      throw std::system_error(errno, std::system_category());
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      throw std::runtime_error("subprocess failed");
+
+    return output;
   }
 
 } // namespace caliber::posix
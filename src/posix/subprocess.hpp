@@ -1,10 +1,44 @@
 #ifndef INC_CALIBER_SRC_POSIX_SUBPROCESS_HPP
 #define INC_CALIBER_SRC_POSIX_SUBPROCESS_HPP
 
+#include <signal.h>
+#include <sys/types.h>
+
 #include <string>
+#include <string_view>
 
 namespace caliber::posix {
 
+  struct spawn_options {
+    // File descriptors to use as the child's stdin, stdout, and stderr, or -1
+    // to inherit ours.
+    int stdin_fd = -1;
+    int stdout_fd = -1;
+    int stderr_fd = -1;
+    // If true, put the child in a new process group whose ID is the child's
+    // PID, so that it (and any children it spawns) can be killed together.
+    bool new_process_group = false;
+    // If set, the child's signal mask.
+    const sigset_t *sigmask = nullptr;
+  };
+
+  // The signal mask that children should start with: the one from before an
+  // `event_loop` blocked SIGINT and friends, or null if no loop is running
+  // (so children can just inherit ours). The loop sets this while it's alive.
+  const sigset_t * child_sigmask();
+  void set_child_sigmask(const sigset_t *mask);
+
+  // Run `argv`, searching the PATH for the program, and return the child's
+  // PID. This uses `posix_spawn` rather than `fork` so that we don't have to
+  // copy our (potentially large) address space for every child. Returns -1
+  // and sets `errno` on failure.
+  pid_t spawn(const char *const argv[], const spawn_options &options = {});
+
+  // Write all of `data` to the pipe `fd`, blocking until it's done. If the
+  // reader goes away, this fails with EPIPE, rather than dying from SIGPIPE.
+  // Returns -1 and sets `errno` on failure.
+  int write_all(int fd, std::string_view data);
+
   std::string slurp(const char *argv[]);
 
 } // namespace caliber::posix
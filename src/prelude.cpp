@@ -0,0 +1,169 @@
+#include "prelude.hpp"
+
+#include <stdexcept>
+
+#include "files.hpp"
+#include "filesystem.hpp"
+#include "hash.hpp"
+
+namespace caliber {
+
+  namespace {
+    std::string include_line(const std::string &path) {
+      return "#include \"" + FILESYSTEM_NS::path(path).generic_string() +
+             "\"\n";
+    }
+
+    // Write `contents` to `path`, unless it already holds exactly that. This
+    // keeps the file's timestamp stable so that cached results depending on
+    // it stay valid.
+    bool update_file(const std::string &path, const std::string &contents) {
+      auto existing = read_file(path);
+      if(existing && *existing == contents)
+        return true;
+      return write_file_atomically(path, contents);
+    }
+  }
+
+  precompiled_prelude::precompiled_prelude(std::string header,
+                                           const result_cache *cache)
+    : cache_(cache), temporary_root_(!cache) {
+    namespace fs = FILESYSTEM_NS;
+    if(!fs::exists(header))
+      throw std::runtime_error("unable to find prelude \"" + header + "\"");
+    header_ = fs::absolute(header).string();
+
+    if(cache_) {
+      root_ = (fs::path(cache_->directory()) / "pch").string();
+    } else {
+      root_ = (fs::temp_directory_path() /
+               ("caliber-pch-" + random_suffix())).string();
+    }
+  }
+
+  precompiled_prelude::~precompiled_prelude() {
+    if(temporary_root_) {
+      namespace fs = FILESYSTEM_NS;
+      try {
+        fs::remove_all(root_);
+      } catch(const fs::filesystem_error &) {}
+    }
+  }
+
+  std::optional<precompiled_header>
+  precompiled_prelude::get(const compilation_test_runner &runner,
+                           const std::string &src,
+                           const compiler_options &args,
+                           const raw_options &raw_args) const {
+    // Tests can share a precompiled header when they'd be compiled with
+    // exactly the same command line (aside from the source file itself,
+    // which always comes last).
+    auto flags = runner.compiler().translate_args(src, args, raw_args);
+    flags.pop_back();
+
+    hasher h;
+    h.field(header_);
+    for(const auto &i : flags)
+      h.field(i);
+    auto key = h.hex_digest();
+
+    std::promise<std::optional<precompiled_header>> promise;
+    {
+      std::unique_lock lock(mutex_);
+      auto i = headers_.find(key);
+      if(i != headers_.end()) {
+        auto pending = i->second;
+        lock.unlock();
+        return pending.get();
+      }
+      headers_.emplace(key, promise.get_future().share());
+    }
+
+    try {
+      auto dir = (FILESYSTEM_NS::path(root_) / key).string();
+      auto result = build(runner, src, args, raw_args, dir);
+      promise.set_value(result);
+      return result;
+    } catch(...) {
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+  std::optional<precompiled_header>
+  precompiled_prelude::build(const compilation_test_runner &runner,
+                             const std::string &src,
+                             const compiler_options &args,
+                             const raw_options &raw_args,
+                             const std::string &dir) const {
+    namespace fs = FILESYSTEM_NS;
+    const auto &compiler = runner.compiler();
+
+    // Tests include a forwarding header of our own rather than the real
+    // one, so that the compiler finds the precompiled header next to it.
+    precompiled_header result;
+    result.header = (fs::path(dir) / fs::path(header_).filename()).string();
+    result.source = result.header + ".cpp";
+    result.pch = compiler.pch_path(result.header);
+    if(!update_file(result.header, include_line(header_)) ||
+       !update_file(result.source, include_line(result.header)))
+      return std::nullopt;
+
+    std::optional<std::string> key;
+    if(cache_) {
+      key = cache_->key(compiler, result.header, compiler.translate_pch_args(
+        src, result, args, raw_args
+      ), false);
+      if(key) {
+        auto cached = cache_->load(*key);
+        if(cached && !cached->result)
+          return result;
+      }
+    }
+
+    // Build the header in a scratch directory (along with any other files
+    // the compiler produces) and then move it into place, so that we never
+    // clobber a header that another caliber process is using.
+    auto scratch = fs::path(dir) / ("tmp." + random_suffix());
+    precompiled_header building = result;
+    building.pch = (scratch / fs::path(result.pch).filename()).string();
+    translate_options options;
+    if(cache_)
+      options.depfile = (scratch / "prelude.d").string();
+
+    bool ok = false;
+    mettle::log::test_output output;
+    std::optional<std::vector<std::string>> deps;
+    try {
+      fs::create_directories(scratch);
+      auto compiled = runner(compiler.translate_pch_args(
+        src, building, args, raw_args, options
+      ), false, output);
+      if(compiled.completed && !compiled.result) {
+        if(cache_)
+          deps = compiler.read_dependencies(options, output.stdout_log);
+        fs::rename(building.pch, result.pch);
+        ok = true;
+      }
+    } catch(const fs::filesystem_error &) {}
+
+    try {
+      fs::remove_all(scratch);
+    } catch(const fs::filesystem_error &) {}
+
+    if(!ok)
+      return std::nullopt;
+
+    if(cache_) {
+      cache_->forget(result.pch);
+      if(key && deps) {
+        // Cached test results depend on the precompiled header itself, so
+        // the header only needs to be rebuilt when its inputs change.
+        deps->push_back(result.pch);
+        cache_->store(*key, {std::nullopt, output}, *deps);
+      }
+    }
+    return result;
+  }
+
+} // namespace caliber
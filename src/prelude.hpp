@@ -0,0 +1,57 @@
+#ifndef INC_CALIBER_SRC_PRELUDE_HPP
+#define INC_CALIBER_SRC_PRELUDE_HPP
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "compilation_test_runner.hpp"
+#include "compiler.hpp"
+#include "result_cache.hpp"
+
+namespace caliber {
+
+  // A header that's implicitly included first by every test in a suite. The
+  // header is precompiled once for each distinct set of compiler options the
+  // tests use, so that tests don't each have to parse it from scratch.
+  //
+  // If a cache is provided, the precompiled headers live there and are reused
+  // across runs until any of the files they include change; otherwise, they
+  // live in a temporary directory for the duration of the run.
+  class precompiled_prelude {
+  public:
+    precompiled_prelude(std::string header, const result_cache *cache);
+    precompiled_prelude(const precompiled_prelude &) = delete;
+    precompiled_prelude & operator =(const precompiled_prelude &) = delete;
+    ~precompiled_prelude();
+
+    // Get the precompiled header to use for the test in `src` with the
+    // given options, building it if necessary. If the header can't be built,
+    // return nothing; the test should then be compiled as usual. This is
+    // safe to call from multiple threads; if several tests need the same
+    // precompiled header, only one of them builds it.
+    std::optional<precompiled_header>
+    get(const compilation_test_runner &runner, const std::string &src,
+        const compiler_options &args, const raw_options &raw_args) const;
+  private:
+    std::optional<precompiled_header>
+    build(const compilation_test_runner &runner, const std::string &src,
+          const compiler_options &args, const raw_options &raw_args,
+          const std::string &dir) const;
+
+    std::string header_;
+    const result_cache *cache_;
+    std::string root_;
+    bool temporary_root_;
+
+    mutable std::mutex mutex_;
+    mutable std::map<std::string,
+                     std::shared_future<std::optional<precompiled_header>>>
+    headers_;
+  };
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,275 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "files.hpp"
+
+namespace caliber {
+
+  namespace {
+    using kind = profile_entry::kind;
+    const kind all_kinds[] = {kind::header, kind::instantiation, kind::phase};
+
+    const char * kind_name(kind k) {
+      switch(k) {
+      case kind::header:
+        return "headers";
+      case kind::instantiation:
+        return "template instantiations";
+      case kind::phase:
+        return "compiler phases";
+      }
+      return "";
+    }
+
+    std::string trim(const std::string &s) {
+      auto start = s.find_first_not_of(" \t\r");
+      if(start == std::string::npos)
+        return "";
+      auto end = s.find_last_not_of(" \t\r");
+      return s.substr(start, end - start + 1);
+    }
+
+    bool starts_with(const std::string &s, const std::string &prefix) {
+      return s.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    std::vector<std::string> split_lines(const std::string &s) {
+      std::vector<std::string> lines;
+      std::istringstream is(s);
+      for(std::string line; std::getline(is, line);)
+        lines.push_back(std::move(line));
+      return lines;
+    }
+
+    std::string join_lines(const std::vector<std::string> &lines,
+                           bool trailing_newline) {
+      std::string result;
+      for(std::size_t i = 0; i != lines.size(); i++) {
+        result += lines[i];
+        if(i + 1 != lines.size() || trailing_newline)
+          result += '\n';
+      }
+      return result;
+    }
+
+    // Add together all the entries for the same thing, e.g. a function
+    // template that was instantiated in several different places.
+    std::map<std::pair<kind, std::string>, double>
+    merge(const compile_profile &profile) {
+      std::map<std::pair<kind, std::string>, double> merged;
+      for(const auto &i : profile)
+        merged[{i.type, i.name}] += i.seconds;
+      return merged;
+    }
+
+    template<typename T, typename Seconds>
+    std::vector<std::pair<std::string, T>>
+    slowest(const std::map<std::pair<kind, std::string>, T> &entries,
+            kind k, std::size_t limit, Seconds &&seconds) {
+      std::vector<std::pair<std::string, T>> result;
+      for(const auto &i : entries) {
+        if(i.first.first == k)
+          result.emplace_back(i.first.second, i.second);
+      }
+      std::sort(result.begin(), result.end(), [&](const auto &a,
+                                                  const auto &b) {
+        return seconds(a.second) > seconds(b.second);
+      });
+      if(result.size() > limit)
+        result.resize(limit);
+      return result;
+    }
+  }
+
+  std::optional<compile_profile> parse_time_trace(const std::string &trace) {
+    namespace pt = boost::property_tree;
+    pt::ptree tree;
+    try {
+      std::istringstream is(trace);
+      pt::read_json(is, tree);
+    } catch(const pt::json_parser_error &) {
+      return std::nullopt;
+    }
+
+    auto events = tree.get_child_optional("traceEvents");
+    if(!events)
+      return std::nullopt;
+
+    compile_profile profile;
+    for(const auto &i : *events) {
+      const auto &event = i.second;
+      auto name = event.get<std::string>("name", "");
+      // Durations are in microseconds.
+      auto seconds = event.get<double>("dur", 0) / 1000000;
+      auto detail = event.get<std::string>("args.detail", "");
+      if(name == "Source")
+        profile.push_back({kind::header, detail, seconds});
+      else if(name == "InstantiateClass" || name == "InstantiateFunction")
+        profile.push_back({kind::instantiation, detail, seconds});
+      else if(starts_with(name, "Total "))
+        profile.push_back({kind::phase, name.substr(6), seconds});
+    }
+    return profile;
+  }
+
+  std::optional<compile_profile> extract_time_report(std::string &log) {
+    auto lines = split_lines(log);
+    auto begin = std::find_if(lines.begin(), lines.end(), [](const auto &s) {
+      return starts_with(s, "Time variable");
+    });
+    if(begin == lines.end())
+      return std::nullopt;
+
+    compile_profile profile;
+    auto end = std::next(begin);
+    for(; end != lines.end(); ++end) {
+      if(starts_with(trim(*end), "TOTAL")) {
+        ++end;
+        break;
+      }
+
+      // Each line looks like `name : usr (pct%) sys (pct%) wall (pct%) ...`.
+      auto colon = end->rfind(':');
+      if(colon == std::string::npos)
+        continue;
+      std::istringstream is(end->substr(colon + 1));
+      auto skip_percent = [&is]() {
+        if((is >> std::ws).peek() == '(')
+          is.ignore(std::numeric_limits<std::streamsize>::max(), ')');
+      };
+      double usr, sys, wall;
+      is >> usr;
+      skip_percent();
+      is >> sys;
+      skip_percent();
+      if(is >> wall && wall > 0)
+        profile.push_back({kind::phase, trim(end->substr(0, colon)), wall});
+    }
+
+    // GCC puts a blank line before the report, and (in checking builds) a
+    // warning about it after.
+    if(begin != lines.begin() && trim(*std::prev(begin)).empty())
+      --begin;
+    while(end != lines.end() && (
+      starts_with(*end, "Extra diagnostic checks enabled") ||
+      starts_with(*end, "Configure with --enable-checking")
+    ))
+      ++end;
+
+    bool trailing_newline = !log.empty() && log.back() == '\n';
+    lines.erase(begin, end);
+    log = join_lines(lines, trailing_newline && !lines.empty());
+    return profile;
+  }
+
+  std::optional<compile_profile> extract_report_time(std::string &log) {
+    static const std::pair<std::string, kind> sections[] = {
+      {"Include Headers:", kind::header},
+      // MSVC doesn't distinguish template instantiations from any other
+      // definitions.
+      {"Class Definitions:", kind::instantiation},
+      {"Function Definitions:", kind::instantiation},
+    };
+
+    compile_profile profile;
+    std::vector<std::string> remaining;
+    std::optional<kind> section;
+    bool found = false;
+    for(auto &line : split_lines(log)) {
+      auto trimmed = trim(line);
+      auto header = std::find_if(
+        std::begin(sections), std::end(sections),
+        [&trimmed](const auto &s) { return s.first == trimmed; }
+      );
+      if(header != std::end(sections)) {
+        section = header->second;
+        found = true;
+        continue;
+      }
+      if(!section || line.empty() || line[0] != '\t') {
+        section.reset();
+        remaining.push_back(std::move(line));
+        continue;
+      }
+
+      // Each entry looks like `name: 0.12345s`.
+      auto colon = trimmed.rfind(": ");
+      if(colon == std::string::npos || trimmed.back() != 's')
+        continue;
+      auto name = trimmed.substr(0, colon);
+      if(name == "Count" || name == "Total")
+        continue;
+      try {
+        profile.push_back({*section, name, std::stod(trimmed.substr(
+          colon + 2, trimmed.size() - colon - 3
+        ))});
+      } catch(const std::logic_error &) {}
+    }
+
+    if(!found)
+      return std::nullopt;
+    bool trailing_newline = !log.empty() && log.back() == '\n';
+    log = join_lines(remaining, trailing_newline && !remaining.empty());
+    return profile;
+  }
+
+  std::string describe_profile(const compile_profile &profile,
+                               std::size_t limit) {
+    auto merged = merge(profile);
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    for(auto k : all_kinds) {
+      auto entries = slowest(merged, k, limit, [](double s) { return s; });
+      if(entries.empty())
+        continue;
+      ss << "slowest " << kind_name(k) << ":\n";
+      for(const auto &i : entries)
+        ss << "  " << std::setw(8) << i.second << " s  " << i.first << "\n";
+    }
+    return ss.str();
+  }
+
+  void profile_summary::add(const compile_profile &profile) {
+    auto merged = merge(profile);
+    std::lock_guard lock(mutex_);
+    for(const auto &i : merged) {
+      auto &t = totals_[i.first];
+      t.seconds += i.second;
+      t.tests++;
+    }
+  }
+
+  void profile_summary::write(const std::string &path,
+                              std::size_t limit) const {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    {
+      std::lock_guard lock(mutex_);
+      for(auto k : all_kinds) {
+        auto entries = slowest(totals_, k, limit, [](const total &t) {
+          return t.seconds;
+        });
+        if(entries.empty())
+          continue;
+        ss << "Slowest " << kind_name(k) << " (total time, tests):\n";
+        for(const auto &i : entries) {
+          ss << "  " << std::setw(10) << i.second.seconds << " s  "
+             << std::setw(6) << i.second.tests << "  " << i.first << "\n";
+        }
+        ss << "\n";
+      }
+    }
+
+    if(!write_file_atomically(path, ss.str()))
+      throw std::runtime_error("unable to write profile \"" + path + "\"");
+  }
+
+} // namespace caliber
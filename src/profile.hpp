@@ -0,0 +1,69 @@
+#ifndef INC_CALIBER_SRC_PROFILE_HPP
+#define INC_CALIBER_SRC_PROFILE_HPP
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace caliber {
+
+  // Something that took up time while compiling a test, as reported by the
+  // compiler's own profiler.
+  struct profile_entry {
+    enum class kind {
+      header,
+      instantiation,
+      phase
+    };
+
+    kind type;
+    std::string name;
+    double seconds;
+  };
+
+  using compile_profile = std::vector<profile_entry>;
+
+  // Parse a clang `-ftime-trace` file, or return nothing if it's invalid.
+  std::optional<compile_profile> parse_time_trace(const std::string &trace);
+
+  // Remove GCC's `-ftime-report` from `log`, returning what it reported.
+  std::optional<compile_profile> extract_time_report(std::string &log);
+
+  // Remove MSVC's `/d1reportTime` report from `log`, returning what it
+  // reported.
+  std::optional<compile_profile> extract_report_time(std::string &log);
+
+  // Describe the `limit` most expensive entries of each kind in `profile`.
+  std::string describe_profile(const compile_profile &profile,
+                               std::size_t limit);
+
+  // The profiles of many tests added together, to find the headers and
+  // templates that are the most expensive across a whole suite. This is safe
+  // to share between threads.
+  class profile_summary {
+  public:
+    profile_summary() = default;
+    profile_summary(const profile_summary &) = delete;
+    profile_summary & operator =(const profile_summary &) = delete;
+
+    void add(const compile_profile &profile);
+
+    // Write the `limit` most expensive entries of each kind to `path`,
+    // throwing on error.
+    void write(const std::string &path, std::size_t limit = 25) const;
+  private:
+    struct total {
+      double seconds = 0;
+      std::size_t tests = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::pair<profile_entry::kind, std::string>, total> totals_;
+  };
+
+} // namespace caliber
+
+#endif
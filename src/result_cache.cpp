@@ -0,0 +1,191 @@
+#include "result_cache.hpp"
+
+#include <sstream>
+
+#include "filesystem.hpp"
+#include "hash.hpp"
+
+namespace caliber {
+
+  namespace {
+    const char header[] = "caliber-result 3";
+
+    void write_usage(std::ostream &os,
+                     const std::optional<resource_usage> &usage) {
+      if(!usage) {
+        os << "-\n";
+        return;
+      }
+      os << usage->user_time.count() << " " << usage->system_time.count()
+         << " " << usage->max_rss << " " << usage->minor_faults << " "
+         << usage->major_faults << "\n";
+    }
+
+    bool read_usage(std::istream &is, std::optional<resource_usage> &usage) {
+      if(is.peek() == '-') {
+        is.get();
+        usage.reset();
+        return is.get() == '\n';
+      }
+
+      std::chrono::microseconds::rep user, system;
+      resource_usage result;
+      if(!(is >> user >> system >> result.max_rss >> result.minor_faults >>
+           result.major_faults) || is.get() != '\n')
+        return false;
+      result.user_time = std::chrono::microseconds(user);
+      result.system_time = std::chrono::microseconds(system);
+      usage = result;
+      return true;
+    }
+
+    std::string hash_contents(const std::string &contents) {
+      return hasher().update(contents).hex_digest();
+    }
+  }
+
+  std::optional<std::string>
+  result_cache::key(const compiler &c, const std::string &file,
+                    const std::vector<std::string> &args, bool expect_fail,
+                    std::optional<std::string_view> source) const {
+    std::optional<std::string> contents;
+    if(!source) {
+      if(!(contents = read_file(file)))
+        return std::nullopt;
+      source = *contents;
+    }
+
+    hasher h;
+    h.field(header);
+    h.field(c.brand).field(c.flavor).field(c.identity);
+    h.field(std::to_string(args.size()));
+    for(const auto &i : args)
+      h.field(i);
+    h.field(expect_fail ? "fail" : "pass");
+    h.field(*source);
+    return h.hex_digest();
+  }
+
+  std::optional<result_cache::file_info>
+  result_cache::inspect(const std::string &path, bool need_hash) const {
+    {
+      std::lock_guard lock(files_mutex_);
+      auto i = files_.find(path);
+      if(i != files_.end() && (i->second.hash || !need_hash))
+        return i->second;
+    }
+
+    auto stamp = stamp_file(path);
+    if(!stamp)
+      return std::nullopt;
+    file_info info{*stamp, std::nullopt};
+    if(need_hash) {
+      auto contents = read_file(path);
+      if(!contents)
+        return std::nullopt;
+      info.hash = hash_contents(*contents);
+    }
+
+    std::lock_guard lock(files_mutex_);
+    return files_.insert_or_assign(path, std::move(info)).first->second;
+  }
+
+  bool result_cache::unchanged(const std::string &path,
+                               const file_info &expected) const {
+    auto actual = inspect(path, false);
+    if(!actual)
+      return false;
+    if(actual->stamp == expected.stamp)
+      return true;
+
+    // The file was touched, but its contents might still be the same (e.g.
+    // after switching git branches back and forth).
+    actual = inspect(path, true);
+    return actual && actual->hash == expected.hash;
+  }
+
+  std::optional<cached_result>
+  result_cache::load(const std::string &key) const {
+    auto path = (FILESYSTEM_NS::path(dir_) / "results" / key).string();
+    auto data = read_file(path);
+    if(!data)
+      return std::nullopt;
+
+    std::istringstream is(*data);
+    std::string line, verdict, message;
+    std::size_t dep_count;
+    cached_result result;
+    if(!std::getline(is, line) || line != header ||
+       !std::getline(is, verdict) ||
+       !read_field(is, message) ||
+       !read_field(is, result.output.stdout_log) ||
+       !read_field(is, result.output.stderr_log) ||
+       !read_usage(is, result.usage) ||
+       !(is >> dep_count) || is.get() != '\n')
+      return std::nullopt;
+
+    for(std::size_t i = 0; i != dep_count; i++) {
+      std::string dep;
+      file_info expected;
+      expected.hash.emplace();
+      if(!read_field(is, dep) ||
+         !(is >> expected.stamp.mtime >> expected.stamp.size >>
+           *expected.hash) || is.get() != '\n')
+        return std::nullopt;
+      if(!unchanged(dep, expected))
+        return std::nullopt;
+    }
+
+    if(verdict == "failed")
+      result.result = mettle::test_failure{ .message = std::move(message) };
+    else if(verdict != "passed")
+      return std::nullopt;
+    return result;
+  }
+
+  void result_cache::store(const std::string &key,
+                           const cached_result &result,
+                           const std::vector<std::string> &dependencies) const {
+    std::ostringstream os;
+    os << header << "\n" << (result.result ? "failed" : "passed") << "\n";
+    write_field(os, result.result ? result.result->message : "");
+    write_field(os, result.output.stdout_log);
+    write_field(os, result.output.stderr_log);
+    write_usage(os, result.usage);
+
+    os << dependencies.size() << "\n";
+    for(const auto &dep : dependencies) {
+      auto info = inspect(dep, true);
+      // If we can't read a dependency, we can't tell when it changes, so don't
+      // cache this result at all.
+      if(!info)
+        return;
+      write_field(os, dep);
+      os << info->stamp.mtime << " " << info->stamp.size << " " << *info->hash
+         << "\n";
+    }
+
+    // Failing to write to the cache shouldn't fail the test, so just ignore
+    // any errors here.
+    auto path = (FILESYSTEM_NS::path(dir_) / "results" / key).string();
+    write_file_atomically(path, os.str());
+  }
+
+  void result_cache::forget(const std::string &path) const {
+    std::lock_guard lock(files_mutex_);
+    files_.erase(path);
+  }
+
+  std::string result_cache::depfile_path(const std::string &key) const {
+    namespace fs = FILESYSTEM_NS;
+    auto tmp_dir = fs::path(dir_) / "tmp";
+    try {
+      fs::create_directories(tmp_dir);
+    } catch(const fs::filesystem_error &) {
+      // The compiler will fail to write the dependency file, so we just won't
+      // cache the result.
+    }
+    return (tmp_dir / (key + "." + random_suffix() + ".d")).string();
+  }
+
+} // namespace caliber
@@ -0,0 +1,80 @@
+#ifndef INC_CALIBER_SRC_RESULT_CACHE_HPP
+#define INC_CALIBER_SRC_RESULT_CACHE_HPP
+
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <mettle/driver/log/core.hpp>
+#include <mettle/suite/compiled_suite.hpp>
+
+#include "compilation_test_runner.hpp"
+#include "compiler.hpp"
+#include "files.hpp"
+
+namespace caliber {
+
+  struct cached_result {
+    mettle::test_result result;
+    mettle::log::test_output output;
+    std::optional<resource_usage> usage = std::nullopt;
+  };
+
+  // An on-disk cache of test results. Entries are keyed on everything that
+  // can affect the outcome of a compilation test, so a hit can be replayed
+  // without running the compiler at all. Each entry also records the files
+  // the test included; if any of those have changed, the entry is ignored.
+  // The cache is safe to share between threads and between concurrent caliber
+  // processes.
+  class result_cache {
+  public:
+    explicit result_cache(std::string dir) : dir_(std::move(dir)) {}
+
+    // Compute the cache key for a test, or return nothing if the source file
+    // couldn't be read. If the test's source isn't on disk (e.g. because it's
+    // fed to the compiler through stdin), pass it as `source` instead.
+    std::optional<std::string>
+    key(const compiler &c, const std::string &file,
+        const std::vector<std::string> &args, bool expect_fail,
+        std::optional<std::string_view> source = std::nullopt) const;
+
+    // Load the entry for `key`, provided all of its dependencies are
+    // unchanged.
+    std::optional<cached_result> load(const std::string &key) const;
+    void store(const std::string &key, const cached_result &result,
+               const std::vector<std::string> &dependencies) const;
+
+    // Forget anything we've learned about the file at `path`, e.g. because we
+    // just rewrote it.
+    void forget(const std::string &path) const;
+
+    // Get a path to hold a dependency file for the test with `key`.
+    std::string depfile_path(const std::string &key) const;
+
+    const std::string & directory() const {
+      return dir_;
+    }
+  private:
+    struct file_info {
+      file_stamp stamp;
+      std::optional<std::string> hash;
+    };
+
+    std::optional<file_info>
+    inspect(const std::string &path, bool need_hash) const;
+    bool unchanged(const std::string &path, const file_info &expected) const;
+
+    std::string dir_;
+
+    // Files are assumed not to change during a run, so remember what we've
+    // learned about them to avoid re-reading common headers for every test.
+    mutable std::mutex files_mutex_;
+    mutable std::unordered_map<std::string, file_info> files_;
+  };
+
+} // namespace caliber
+
+#endif
@@ -0,0 +1,110 @@
+#include "run_history.hpp"
+
+#include <sstream>
+
+#include "files.hpp"
+#include "filesystem.hpp"
+
+namespace caliber {
+
+  namespace {
+    const char header[] = "caliber-history 2";
+  }
+
+  run_history::run_history(std::string path) : path_(std::move(path)) {
+    load(path_, entries_);
+  }
+
+  void run_history::load(const std::string &path, entry_map &entries) {
+    auto data = read_file(path);
+    if(!data)
+      return;
+
+    std::istringstream is(*data);
+    std::string line;
+    if(!std::getline(is, line) || line != header)
+      return;
+
+    // As with the test index, keep whatever we could read from a corrupt
+    // history; the rest of the tests will just be treated as new.
+    while(is.peek() != std::char_traits<char>::eof()) {
+      std::string key, ms;
+      entry e;
+      if(!read_field(is, key) || !(is >> ms >> e.failed) || is.get() != '\n')
+        break;
+      if(ms != "-") {
+        try {
+          e.last_duration = duration(std::stoll(ms));
+        } catch(const std::exception &) {
+          break;
+        }
+      }
+      entries.insert_or_assign(std::move(key), std::move(e));
+    }
+  }
+
+  std::string run_history::key(const std::string &compiler,
+                               const std::string &file,
+                               const std::string &name) {
+    namespace fs = FILESYSTEM_NS;
+    std::string path;
+    try {
+      path = fs::absolute(file).lexically_normal().string();
+    } catch(const fs::filesystem_error &) {
+      path = file;
+    }
+
+    std::ostringstream os;
+    write_field(os, compiler);
+    write_field(os, path);
+    write_field(os, name);
+    return os.str();
+  }
+
+  std::optional<run_history::duration>
+  run_history::last_duration(const std::string &key) const {
+    std::lock_guard lock(mutex_);
+    auto i = entries_.find(key);
+    if(i == entries_.end())
+      return std::nullopt;
+    return i->second.last_duration;
+  }
+
+  bool run_history::failed(const std::string &key) const {
+    std::lock_guard lock(mutex_);
+    auto i = entries_.find(key);
+    return i != entries_.end() && i->second.failed;
+  }
+
+  void run_history::record(const std::string &key, bool failed,
+                           std::optional<duration> d) {
+    std::lock_guard lock(mutex_);
+    auto &e = entries_[key];
+    e.failed = failed;
+    if(d)
+      e.last_duration = d;
+    e.updated = true;
+    dirty_ = true;
+  }
+
+  void run_history::save() const {
+    std::lock_guard lock(mutex_);
+    if(!dirty_)
+      return;
+
+    save_merged(path_, entries_, load, [](const entry_map &merged) {
+      std::ostringstream os;
+      os << header << "\n";
+      for(const auto &i : merged) {
+        write_field(os, i.first);
+        if(i.second.last_duration)
+          os << i.second.last_duration->count();
+        else
+          os << "-";
+        os << " " << i.second.failed << "\n";
+      }
+      return os.str();
+    });
+  }
+
+} // namespace caliber
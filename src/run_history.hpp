@@ -0,0 +1,63 @@
+#ifndef INC_CALIBER_SRC_RUN_HISTORY_HPP
+#define INC_CALIBER_SRC_RUN_HISTORY_HPP
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace caliber {
+
+  // An on-disk record of how each test went the last time it ran, so that
+  // later runs can start the slowest (or the failing) tests first. Tests are
+  // identified by the keys from `run_history::key`. Like `test_index`, the
+  // history is safe to share between threads and between caliber processes.
+  class run_history {
+  public:
+    using duration = std::chrono::milliseconds;
+
+    // Load the history at `path`, if there is one.
+    explicit run_history(std::string path);
+    run_history(const run_history &) = delete;
+    run_history & operator =(const run_history &) = delete;
+
+    // Get the key for the test named `name` in `file`, when compiled with
+    // `compiler` (the name of the compiler's sub-suite).
+    static std::string key(const std::string &compiler,
+                           const std::string &file, const std::string &name);
+
+    // Get how long the test with `key` took to compile the last time it was
+    // compiled, if we know.
+    std::optional<duration> last_duration(const std::string &key) const;
+    // Get whether the test with `key` failed the last time it ran.
+    bool failed(const std::string &key) const;
+
+    // Record how the test with `key` went. If it wasn't compiled (e.g.
+    // because its result was cached), pass no duration to keep the last one.
+    void record(const std::string &key, bool failed,
+                std::optional<duration> d = std::nullopt);
+
+    // Write the history back out if it's changed, ignoring any errors.
+    void save() const;
+  private:
+    struct entry {
+      std::optional<duration> last_duration;
+      bool failed = false;
+      // True if this entry was updated since the history was loaded.
+      bool updated = false;
+    };
+    using entry_map = std::map<std::string, entry>;
+
+    static void load(const std::string &path, entry_map &entries);
+
+    std::string path_;
+
+    mutable std::mutex mutex_;
+    entry_map entries_;
+    bool dirty_ = false;
+  };
+
+} // namespace caliber
+
+#endif
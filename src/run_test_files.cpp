@@ -1,11 +1,28 @@
 #include "run_test_files.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <deque>
 #include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
 
 #include <boost/program_options.hpp>
 
 #include "cmd_line.hpp"
+#include "diagnostics.hpp"
+#include "discover.hpp"
+#include "files.hpp"
+#include "filesystem.hpp"
+#include "hash.hpp"
+#include "job_pool.hpp"
 
 namespace caliber {
 
@@ -28,6 +45,16 @@ namespace caliber {
       return filtered;
     }
 
+    std::string command_name(const std::vector<std::string> &command) {
+      std::string result;
+      for(const auto &i : command) {
+        if(!result.empty())
+          result += " ";
+        result += i;
+      }
+      return result;
+    }
+
     bool
     match_flavors(const compiler &c, const std::vector<std::string> &names) {
       return names.empty() || std::any_of(
@@ -37,86 +64,1214 @@ namespace caliber {
       );
     }
 
-    void run_test_file(
-      const std::vector<mettle::suite_name> &test_suite,
-      const std::string &file, mettle::log::test_logger &logger,
-      const compilation_test_runner &runner, const mettle::filter_set &filter
+    // The final result of a single test, held until it's this test's turn to
+    // be reported to the logger.
+    struct test_outcome {
+      enum class status {
+        passed,
+        failed,
+        skipped
+      };
+
+      status state;
+      mettle::test_failure failure = {};
+      std::string skip_message = {};
+      mettle::log::test_output output = {};
+      mettle::log::test_duration duration = mettle::log::test_duration(0);
+      // True if the compiler actually ran (e.g. the result wasn't cached), so
+      // that `duration` says how long the test takes to compile.
+      bool compiled = false;
+    };
+
+    struct pending_test {
+      mettle::test_name name;
+      std::future<test_outcome> outcome;
+    };
+
+    inline std::future<test_outcome> ready_outcome(test_outcome outcome) {
+      std::promise<test_outcome> p;
+      p.set_value(std::move(outcome));
+      return p.get_future();
+    }
+
+    inline test_outcome
+    make_outcome(mettle::test_result result, mettle::log::test_output output,
+                 mettle::log::test_duration duration) {
+      if(result) {
+        return {test_outcome::status::failed, std::move(*result), "",
+                std::move(output), duration};
+      }
+      return {test_outcome::status::passed, {}, "", std::move(output),
+              duration};
+    }
+
+    // The outcome of a test that wasn't compiled (or was killed partway
+    // through) because `--fail-fast` or `--max-failures` cut the run short.
+    test_outcome cancelled_outcome(const run_options &options) {
+      test_outcome outcome{test_outcome::status::skipped};
+      auto count = options.max_failures;
+      outcome.skip_message = "run stopped after " + std::to_string(count) +
+                             " failure" + (count == 1 ? "" : "s");
+      return outcome;
+    }
+
+    // If `usage` exceeds any of the budgets in `options`, explain why.
+    std::optional<std::string>
+    over_budget(const run_options &options,
+                const std::optional<resource_usage> &usage) {
+      using namespace std::chrono;
+      if(!usage)
+        return std::nullopt;
+
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(3);
+      auto cpu = usage->user_time + usage->system_time;
+      if(options.max_cpu && cpu > *options.max_cpu) {
+        ss << "Used " << duration<double>(cpu).count() << " s of CPU time "
+           << "(limit " << duration<double>(*options.max_cpu).count()
+           << " s)";
+        return ss.str();
+      }
+      if(options.max_rss && usage->max_rss > *options.max_rss) {
+        ss << std::setprecision(1) << "Used " << usage->max_rss / 1048576.0
+           << " MiB of memory (limit " << *options.max_rss / 1048576.0
+           << " MiB)";
+        return ss.str();
+      }
+      return std::nullopt;
+    }
+
+    std::string describe_usage(const resource_usage &usage) {
+      using namespace std::chrono;
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(3)
+         << "CPU time: " << duration<double>(usage.user_time).count()
+         << " s user, " << duration<double>(usage.system_time).count()
+         << " s system; peak memory: " << std::setprecision(1)
+         << usage.max_rss / 1048576.0 << " MiB; page faults: "
+         << usage.minor_faults << " minor, " << usage.major_faults
+         << " major";
+      return ss.str();
+    }
+
+    // Apply the resource budgets in `options` to a test's result, and report
+    // its resource usage in its output if requested. If the test was compiled
+    // in a batch, `batch_size` is the number of tests in it.
+    void check_usage(const run_options &options,
+                     const std::optional<resource_usage> &usage,
+                     mettle::test_result &result,
+                     mettle::log::test_output &output,
+                     std::size_t batch_size = 1) {
+      if(!usage)
+        return;
+
+      if(!result) {
+        if(auto why = over_budget(options, usage))
+          result = mettle::test_failure{ .message = std::move(*why) };
+      }
+
+      if(options.show_usage) {
+        auto &log = output.stdout_log;
+        if(!log.empty() && log.back() != '\n')
+          log += "\n";
+        log += "caliber: " + describe_usage(*usage);
+        if(batch_size > 1)
+          log += " (for a batch of " + std::to_string(batch_size) + " tests)";
+        log += "\n";
+      }
+    }
+
+    void log_outcome(mettle::log::test_logger &logger,
+                     const mettle::test_name &name,
+                     const test_outcome &outcome) {
+      logger.started_test(name);
+      switch(outcome.state) {
+      case test_outcome::status::passed:
+        logger.passed_test(name, outcome.output, outcome.duration);
+        break;
+      case test_outcome::status::failed:
+        logger.failed_test(name, outcome.failure, outcome.output,
+                           outcome.duration);
+        break;
+      case test_outcome::status::skipped:
+        logger.skipped_test(name, outcome.skip_message);
+        break;
+      }
+    }
+
+    // Report every finished test at the front of `pending` to the logger. If
+    // `wait` is true, block until all the pending tests have finished.
+    void log_pending(std::deque<pending_test> &pending,
+                     mettle::log::test_logger &logger, bool wait) {
+      using namespace std::chrono;
+      while(!pending.empty()) {
+        auto &front = pending.front();
+        if(!wait && front.outcome.wait_for(seconds(0)) !=
+           std::future_status::ready)
+          return;
+        log_outcome(logger, front.name, front.outcome.get());
+        pending.pop_front();
+      }
+    }
+
+    // A test whose options have been parsed and that needs to be compiled.
+    // This is shared by every compiler the test is run with.
+    struct compilation_test {
+      std::string file;
+      compiler_options comp_args;
+      per_file_options args;
+      // If set, the test's source, which is fed to the compiler through stdin
+      // when possible. Otherwise, it's compiled from `file` as usual.
+      std::optional<std::string> source = std::nullopt;
+      // If set, the error the compiler should fail with.
+      std::shared_ptr<const expected_error> expected = nullptr;
+      // What identifies the test from run to run (e.g. in benchmark
+      // baselines): the test file, plus the line of its case and the label
+      // of its matrix instance, if any. Unlike `file`, this doesn't depend on
+      // where a case was written out to.
+      std::string id = "";
+    };
+
+    using test_ptr = std::shared_ptr<const compilation_test>;
+
+    bool from_stdin(const compiler &c, const compilation_test &test) {
+      return test.source && c.reads_stdin();
+    }
+
+    // Get what to feed to the compiler's stdin when compiling `test`, if
+    // anything.
+    std::optional<std::string_view>
+    test_input(const compiler &c, const compilation_test &test) {
+      if(from_stdin(c, test))
+        return *test.source;
+      return std::nullopt;
+    }
+
+    // Get the options for compiling a test that come from caliber itself,
+    // building its precompiled prelude if need be.
+    translate_options
+    base_options(const compilation_test_runner &runner,
+                 const run_options &options, const compilation_test &test) {
+      translate_options topts;
+      topts.from_stdin = from_stdin(runner.compiler(), test);
+      // A test that just needs to fail doesn't care about anything past the
+      // first error. If it's looking for a particular error, though, that
+      // might not be the first one.
+      topts.fatal_errors = test.args.expect_fail && !test.expected;
+      if(options.prelude) {
+        topts.prelude = options.prelude->get(runner, test.file, test.comp_args,
+                                             test.args.raw_args);
+      }
+      return topts;
+    }
+
+    std::optional<std::string>
+    cache_key(const compilation_test_runner &runner,
+              const run_options &options, const compilation_test &test,
+              const translate_options &topts) {
+      const auto &compiler = runner.compiler();
+      return options.cache->key(
+        compiler, test.file, compiler.translate_args(
+          test.file, test.comp_args, test.args.raw_args, topts
+        ), test.args.expect_fail, test_input(compiler, test)
+      );
+    }
+
+    // If `test` expects a particular error and the compiler failed like it was
+    // supposed to, make sure it failed with the right error. If we were already
+    // watching for the error while the compiler ran, pass that `matcher`.
+    void check_expected_error(const compilation_test &test,
+                              const mettle::log::test_output &output,
+                              mettle::test_result &result,
+                              diagnostic_matcher *matcher = nullptr) {
+      if(result || !test.expected)
+        return;
+
+      std::optional<diagnostic_matcher> fresh;
+      if(!matcher)
+        matcher = &fresh.emplace(*test.expected);
+      if(!matcher->scan(output.stdout_log, output.stderr_log, true)) {
+        result = mettle::test_failure{
+          .message = "Expected " + describe(*test.expected)
+        };
+      }
+    }
+
+    // Decide how much of the output to keep when compiling `test` with
+    // `args`. We read profiles (and for MSVC, dependencies) from the
+    // compiler's output, so those streams are left alone. So is the output of
+    // a test that expects a particular error, since that error could be
+    // anywhere in it (and cached results are checked again later).
+    capture_options
+    capture_output(const run_options &options, const compilation_test &test,
+                   const std::vector<std::string> &args,
+                   const translate_options &topts) {
+      capture_options capture;
+      if(!options.output_limit || topts.profile || test.expected)
+        return capture;
+
+      capture.stderr_limit = options.output_limit;
+      if(!topts.depfile)
+        capture.stdout_limit = options.output_limit;
+      if(options.full_output_dir) {
+        // Name the full output after the test and how it was compiled, so
+        // that each test (and each compiler) gets its own file.
+        namespace fs = FILESYSTEM_NS;
+        hasher h;
+        h.field(test.file);
+        for(const auto &i : args)
+          h.field(i);
+        auto name = fs::path(test.file).stem().string() + "-" +
+                    h.hex_digest();
+        capture.spill = (fs::path(*options.full_output_dir) / name).string();
+      }
+      return capture;
+    }
+
+    // Check `test` with `runner`'s compile server instead of running the
+    // compiler, if it has one. Servers don't report the resources they used,
+    // so they're no help if we need to know that.
+    std::optional<compilation_result>
+    serve(const compilation_test_runner &runner, const run_options &options,
+          const compilation_test &test, translate_options topts,
+          mettle::log::test_output &output) {
+      if(!runner.has_server() || topts.profile || options.max_rss ||
+         options.max_cpu || options.show_usage)
+        return std::nullopt;
+
+      // Servers tell us what they read directly.
+      topts.depfile.reset();
+      const auto &compiler = runner.compiler();
+      auto args = compiler.translate_args(test.file, test.comp_args,
+                                          test.args.raw_args, topts);
+      return runner.serve(args, test.args.expect_fail, output,
+                          test_input(compiler, test),
+                          capture_output(options, test, args, topts));
+    }
+
+    bool profiling(const run_options &options, const compilation_test &test) {
+      return options.profile_all || test.args.profile;
+    }
+
+    void report_profile(const run_options &options,
+                        const compile_profile &profile,
+                        mettle::log::test_output &output) {
+      if(options.profile)
+        options.profile->add(profile);
+
+      std::istringstream is(describe_profile(profile, 5));
+      auto &log = output.stdout_log;
+      for(std::string line; std::getline(is, line);) {
+        if(!log.empty() && log.back() != '\n')
+          log += "\n";
+        log += "caliber: " + line + "\n";
+      }
+    }
+
+    // Compile a test repeatedly, recording how long it takes in
+    // `options.bench`. If the test fails (or regressed relative to the
+    // baseline), stop.
+    test_outcome run_benchmark(
+      const compilation_test_runner &runner, const run_options &options,
+      const compilation_test &test
     ) {
-      mettle::test_name name = {generate_id(), test_suite, file, file};
+      using namespace std::chrono;
+      const auto &compiler = runner.compiler();
+      auto topts = base_options(runner, options, test);
+      auto args = compiler.translate_args(
+        test.file, test.comp_args, test.args.raw_args, topts
+      );
+      auto capture = capture_output(options, test, args, topts);
+
+      std::vector<double> wall, cpu;
+      compilation_result compiled;
       mettle::log::test_output output;
+      for(std::size_t i = 0; i != options.bench_runs; i++) {
+        output = {};
+        auto then = steady_clock::now();
+        compiled = runner(args, test.args.expect_fail, output,
+                          test_input(compiler, test), nullptr, capture);
+        auto now = steady_clock::now();
+        if(compiled.cancelled)
+          return cancelled_outcome(options);
+        if(!compiled.completed || compiled.result)
+          break;
 
-      per_file_options args;
-      compiler_options comp_args;
+        wall.push_back(duration<double>(now - then).count());
+        if(compiled.usage) {
+          cpu.push_back(duration<double>(
+            compiled.usage->user_time + compiled.usage->system_time
+          ).count());
+        }
+      }
+
+      auto result = std::move(compiled.result);
+      check_expected_error(test, output, result);
+      check_usage(options, compiled.usage, result, output);
+      if(result) {
+        return make_outcome(std::move(result), std::move(output),
+                            mettle::log::test_duration(0));
+      }
+
+      bench_result stats = {wall.size(), summarize(wall), summarize(cpu)};
+      auto [summary, regressed] = options.bench->record(
+        command_name(compiler.command), test.id, stats
+      );
+      if(regressed)
+        result = mettle::test_failure{
+          .message = "Compile time regressed: " + summary
+        };
+
+      auto &log = output.stdout_log;
+      if(!log.empty() && log.back() != '\n')
+        log += "\n";
+      log += "caliber: " + summary + "\n";
+
+      auto median = duration_cast<mettle::log::test_duration>(
+        duration<double>(stats.wall.median)
+      );
+      return make_outcome(std::move(result), std::move(output), median);
+    }
+
+    test_outcome run_compilation(
+      const compilation_test_runner &runner, const run_options &options,
+      const compilation_test &test
+    ) {
+      using namespace std::chrono;
+      if(options.bench)
+        return run_benchmark(runner, options, test);
+
+      const auto &compiler = runner.compiler();
+      auto then = steady_clock::now();
+
+      mettle::test_result result;
+      mettle::log::test_output output;
+      std::optional<resource_usage> usage;
+      auto topts = base_options(runner, options, test);
+      std::optional<std::string> key;
+      std::optional<cached_result> cached;
+      // Profiling is only useful if we actually run the compiler.
+      bool unprofiled = profiling(options, test) && !compiler.can_profile();
+      if(profiling(options, test) && !unprofiled) {
+        topts.profile = (FILESYSTEM_NS::temp_directory_path() /
+                         ("caliber-profile-" + random_suffix() +
+                          ".json")).string();
+      } else if(options.cache) {
+        key = cache_key(runner, options, test, topts);
+        if(key) {
+          cached = options.cache->load(*key);
+          if(!cached)
+            topts.depfile = options.cache->depfile_path(*key);
+        }
+      }
+
+      std::optional<diagnostic_matcher> matcher;
+      if(test.expected)
+        matcher.emplace(*test.expected);
+
+      if(cached) {
+        result = std::move(cached->result);
+        output = std::move(cached->output);
+        usage = cached->usage;
+      } else {
+        compilation_result compiled;
+        std::optional<std::vector<std::string>> deps;
+        if(auto served = serve(runner, options, test, topts, output)) {
+          compiled = std::move(*served);
+          deps = std::move(compiled.dependencies);
+        } else {
+          // Once the compiler reports the error we expected, there's no need
+          // to let it keep going, unless it needs to finish so that we can
+          // cache or profile the result.
+          compilation_test_runner::output_watcher watcher;
+          if(matcher && !topts.depfile && !topts.profile) {
+            watcher = [&matcher](const mettle::log::test_output &output) {
+              return matcher->scan(output.stdout_log, output.stderr_log);
+            };
+          }
+
+          auto args = compiler.translate_args(test.file, test.comp_args,
+                                              test.args.raw_args, topts);
+          compiled = runner(
+            args, test.args.expect_fail, output, test_input(compiler, test),
+            watcher, capture_output(options, test, args, topts)
+          );
+          if(topts.depfile) {
+            deps = compiler.read_dependencies(topts, output.stdout_log);
+            remove_file(*topts.depfile);
+          }
+          if(topts.profile) {
+            auto profile = compiler.read_profile(topts, output.stdout_log,
+                                                 output.stderr_log);
+            remove_file(*topts.profile);
+            if(profile)
+              report_profile(options, *profile, output);
+          }
+        }
+
+        if(topts.depfile) {
+          // Compilers don't always report the headers that came from a
+          // precompiled header, so depend on the precompiled header itself.
+          if(deps && topts.prelude)
+            deps->push_back(topts.prelude->pch);
+          // Only cache results that depend solely on the test's inputs, and
+          // only if we know which files those inputs are.
+          if(compiled.completed && deps) {
+            options.cache->store(*key, {compiled.result, output,
+                                        compiled.usage}, *deps);
+          }
+        }
+        if(compiled.cancelled)
+          return cancelled_outcome(options);
+        result = std::move(compiled.result);
+        usage = compiled.usage;
+      }
+
+      check_expected_error(test, output, result,
+                           matcher ? &*matcher : nullptr);
+      check_usage(options, usage, result, output);
+      if(unprofiled) {
+        auto &log = output.stdout_log;
+        if(!log.empty() && log.back() != '\n')
+          log += "\n";
+        log += "caliber: " + command_name(compiler.command) +
+               " can't profile itself\n";
+      }
+
+      auto now = steady_clock::now();
+      auto duration = duration_cast<mettle::log::test_duration>(now - then);
+      auto outcome = make_outcome(std::move(result), std::move(output),
+                                  duration);
+      outcome.compiled = !cached;
+      return outcome;
+    }
+
+    // Keeps track of tests as they finish: records how each one went in the
+    // run history, and if asked, cuts the run short once enough of them have
+    // failed.
+    class run_tracker {
+    public:
+      explicit run_tracker(const run_options &options) : options_(options) {}
+
+      // Note that the test with the history key `history` (if any) finished
+      // with `outcome` after being compiled by `runner`. If `counted` is
+      // false, a failure is recorded but doesn't count toward the limit.
+      void finished(const compilation_test_runner &runner,
+                    const std::optional<std::string> &history,
+                    const test_outcome &outcome, bool counted = true) {
+        using status = test_outcome::status;
+        bool failed = outcome.state == status::failed;
+        if(history && outcome.state != status::skipped) {
+          std::optional<run_history::duration> duration;
+          if(outcome.compiled) {
+            duration = std::chrono::duration_cast<run_history::duration>(
+              outcome.duration
+            );
+          }
+          options_.history->record(*history, failed, duration);
+        }
+
+        if(failed && counted && options_.max_failures &&
+           ++failures_ >= options_.max_failures && !stopped_.exchange(true))
+          runner.cancel_all();
+      }
+
+      // True once the run has been cut short, after which no more tests
+      // should be compiled.
+      bool stopped() const {
+        return stopped_;
+      }
+    private:
+      const run_options &options_;
+      std::atomic<std::size_t> failures_ = 0;
+      std::atomic<bool> stopped_ = false;
+    };
+
+    struct batched_test {
+      test_ptr test;
+      std::promise<test_outcome> outcome;
+      std::optional<std::string> history = std::nullopt;
+      std::optional<std::string> cache_key = std::nullopt;
+    };
+
+    using test_batch = std::vector<batched_test>;
+
+    // Cache the results of the tests in [first, last), which all passed in a
+    // single batch with `output`. The batch can't tell us which files each
+    // test included, so ask the compiler separately; that only needs the
+    // preprocessor, so it's much cheaper than checking the tests again.
+    void store_batch(const compilation_test_runner &runner,
+                     const run_options &options, test_batch::iterator first,
+                     test_batch::iterator last,
+                     const std::vector<std::string> &srcs,
+                     const translate_options &topts,
+                     const mettle::log::test_output &output) {
+      const auto &compiler = runner.compiler();
+      auto args = compiler.translate_deps_args(
+        srcs, first->test->comp_args, first->test->args.raw_args, topts
+      );
+      if(!args)
+        return;
+
+      mettle::log::test_output listing;
+      auto listed = runner(*args, false, listing);
+      if(!listed.completed || listed.result)
+        return;
+      auto deps = compiler.read_deps_list(srcs, listing.stdout_log);
+      if(!deps)
+        return;
+
+      auto dep = deps->begin();
+      for(auto i = first; i != last; ++i, ++dep) {
+        if(!i->cache_key)
+          continue;
+        if(topts.prelude)
+          dep->push_back(topts.prelude->pch);
+        // We don't know what each test used on its own, so leave out the
+        // usage; the batch was within budget anyway.
+        options.cache->store(*i->cache_key, {std::nullopt, output}, *dep);
+      }
+    }
+
+    // Compile all the tests in [first, last) with a single compiler
+    // invocation. If that fails, split the batch in half and try again, so
+    // that the failing tests eventually get compiled (and reported) on their
+    // own.
+    void bisect_batch(const compilation_test_runner &runner,
+                      const run_options &options, run_tracker &tracker,
+                      test_batch::iterator first, test_batch::iterator last) {
+      using namespace std::chrono;
+      auto count = last - first;
+      if(count == 0)
+        return;
+      if(tracker.stopped()) {
+        for(auto i = first; i != last; ++i)
+          i->outcome.set_value(cancelled_outcome(options));
+        return;
+      }
+      if(count == 1) {
+        auto outcome = run_compilation(runner, options, *first->test);
+        tracker.finished(runner, first->history, outcome);
+        first->outcome.set_value(std::move(outcome));
+        return;
+      }
+
+      std::vector<std::string> srcs;
+      for(auto i = first; i != last; ++i)
+        srcs.push_back(i->test->file);
+
+      auto topts = base_options(runner, options, *first->test);
+      auto args = runner.compiler().translate_args(
+        srcs, first->test->comp_args, first->test->args.raw_args, topts
+      );
+
+      mettle::log::test_output output;
+      auto then = steady_clock::now();
+      auto compiled = runner(
+        args, false, output, std::nullopt, nullptr,
+        capture_output(options, *first->test, args, topts)
+      );
+      auto now = steady_clock::now();
+
+      // A batch that's over budget might just be too big, so split it up like
+      // a failure to see if its tests are within budget on their own.
+      if(compiled.completed && !compiled.result &&
+         !over_budget(options, compiled.usage)) {
+        if(options.cache)
+          store_batch(runner, options, first, last, srcs, topts, output);
+
+        // We can't tell which test produced which output, so give all of it to
+        // each test, and split the time evenly between them.
+        check_usage(options, compiled.usage, compiled.result, output,
+                    static_cast<std::size_t>(count));
+        auto duration = duration_cast<mettle::log::test_duration>(now - then);
+        for(auto i = first; i != last; ++i) {
+          auto outcome = make_outcome(std::nullopt, output, duration / count);
+          outcome.compiled = true;
+          tracker.finished(runner, i->history, outcome);
+          i->outcome.set_value(std::move(outcome));
+        }
+        return;
+      }
+
+      auto middle = first + count / 2;
+      bisect_batch(runner, options, tracker, first, middle);
+      bisect_batch(runner, options, tracker, middle, last);
+    }
+
+    void run_batch(const compilation_test_runner &runner,
+                   const run_options &options, run_tracker &tracker,
+                   test_batch batch) {
+      // Don't bother compiling any tests we already have results for.
+      if(options.cache) {
+        test_batch uncached;
+        for(auto &i : batch) {
+          auto key = cache_key(runner, options, *i.test,
+                               base_options(runner, options, *i.test));
+          std::optional<cached_result> cached;
+          if(key && (cached = options.cache->load(*key))) {
+            check_usage(options, cached->usage, cached->result,
+                        cached->output);
+            auto outcome = make_outcome(
+              std::move(cached->result), std::move(cached->output),
+              mettle::log::test_duration(0)
+            );
+            tracker.finished(runner, i.history, outcome);
+            i.outcome.set_value(std::move(outcome));
+          } else {
+            i.cache_key = std::move(key);
+            uncached.push_back(std::move(i));
+          }
+        }
+        batch = std::move(uncached);
+      }
+
+      bisect_batch(runner, options, tracker, batch.begin(), batch.end());
+    }
+
+    // Hands compilation tests off to the job pool, grouping tests that can be
+    // compiled together into batches if requested.
+    class test_scheduler {
+    public:
+      // With a history to order the tests by, hold them all until `flush`;
+      // otherwise, the first few tests would start in the order they were
+      // found, before we'd seen the ones that should go first.
+      test_scheduler(const run_options &options)
+        : options_(options), tracker_(options),
+          pool_(options.jobs, options.history != nullptr) {}
+
+      // Schedule `test`, which is named `name` in `file`, to be compiled by
+      // `runner`.
+      std::future<test_outcome>
+      schedule(const compilation_test_runner &runner, test_ptr test,
+               const std::string &file, const std::string &name) {
+        auto history = history_key(runner, file, name);
+
+        // Only tests that are expected to compile can be batched; if an
+        // expected failure were batched with other tests, we couldn't tell
+        // which test was responsible. Benchmarks and profiles need to look
+        // at each test on its own, too, and there's only one stdin to feed a
+        // test through.
+        if(options_.batch_size > 1 && !options_.bench &&
+           !profiling(options_, *test) && !test->args.expect_fail &&
+           !from_stdin(runner.compiler(), *test))
+          return schedule_batched(runner, std::move(test), std::move(history));
+
+        auto p = priority(history);
+        return pool_.submit([this, &runner, test = std::move(test),
+                             history = std::move(history)]() {
+          if(tracker_.stopped())
+            return cancelled_outcome(options_);
+          auto outcome = run_compilation(runner, options_, *test);
+          tracker_.finished(runner, history, outcome);
+          return outcome;
+        }, p);
+      }
+
+      // Note that the test named `name` in `file` failed with `outcome`
+      // before it could be compiled by `runner` (e.g. because its options
+      // were invalid), so that it counts like any other failure. It fails the
+      // same way for every compiler, though, so it only counts once.
+      std::future<test_outcome>
+      fail(const compilation_test_runner &runner, test_outcome outcome,
+           const std::string &file, const std::string &name) {
+        bool counted = failed_early_.emplace(file, name).second;
+        tracker_.finished(runner, history_key(runner, file, name), outcome,
+                          counted);
+        return ready_outcome(std::move(outcome));
+      }
+
+      // Submit all the partially-filled batches and start any tests we've
+      // been holding.
+      void flush() {
+        for(auto &i : batches_)
+          submit(*i.first.first, std::move(i.second));
+        batches_.clear();
+        pool_.release();
+      }
+    private:
+      using batch_key = std::pair<const compilation_test_runner *,
+                                  std::vector<std::string>>;
+
+      std::optional<std::string>
+      history_key(const compilation_test_runner &runner,
+                  const std::string &file, const std::string &name) const {
+        if(!options_.history)
+          return std::nullopt;
+        return run_history::key(command_name(runner.compiler().command), file,
+                                name);
+      }
+
+      // Start the tests that took longest last time first, so that a slow
+      // test doesn't start last and hold up the end of the run. We don't know
+      // how long new tests take, so they go before all of those, and if
+      // requested, the tests that failed last time go before everything.
+      job_pool::priority_type
+      priority(const std::optional<std::string> &history) const {
+        using limits = std::numeric_limits<job_pool::priority_type>;
+        if(!history)
+          return 0;
+        if(options_.failed_first && options_.history->failed(*history))
+          return limits::max();
+        auto duration = options_.history->last_duration(*history);
+        if(!duration)
+          return limits::max() - 1;
+        return std::min(static_cast<job_pool::priority_type>(duration->count()),
+                        limits::max() - 2);
+      }
+
+      std::future<test_outcome>
+      schedule_batched(const compilation_test_runner &runner, test_ptr test,
+                       std::optional<std::string> history) {
+        // Tests can share a batch when they'd be compiled with exactly the
+        // same command line (aside from the source file itself, which always
+        // comes last).
+        batch_key key = {&runner, runner.compiler().translate_args(
+          test->file, test->comp_args, test->args.raw_args
+        )};
+        key.second.pop_back();
+
+        auto &batch = batches_[key];
+        batch.push_back({std::move(test), {}, std::move(history)});
+        auto result = batch.back().outcome.get_future();
+        if(batch.size() >= options_.batch_size) {
+          submit(runner, std::move(batch));
+          batches_.erase(key);
+        }
+        return result;
+      }
+
+      void submit(const compilation_test_runner &runner, test_batch batch) {
+        // A batch takes about as long as all of its tests put together.
+        job_pool::priority_type p = 0;
+        for(const auto &i : batch) {
+          auto next = p + priority(i.history);
+          p = next < p ? std::numeric_limits<job_pool::priority_type>::max() :
+                         next;
+        }
+
+        pool_.submit([this, &runner, batch = std::move(batch)]() mutable {
+          run_batch(runner, options_, tracker_, std::move(batch));
+        }, p);
+      }
+
+      const run_options &options_;
+      run_tracker tracker_;
+      std::map<batch_key, test_batch> batches_;
+      // The (file, name) of each test that's failed before being compiled.
+      std::set<std::pair<std::string, std::string>> failed_early_;
+      job_pool pool_;
+    };
+
+    // A test file after reading its options. If the options were invalid,
+    // `test` is null and `error` says why.
+    struct parsed_test_file {
+      std::string file;
+      std::string name;
+      mettle::attributes attrs;
+      test_ptr test;
+      std::string error;
+    };
+
+    // Parse a test's (or test case's) options from `args` into `header`, on
+    // top of whatever's already there.
+    void parse_test_header(const std::vector<std::string> &args,
+                           test_header &header) {
       try {
         namespace opts = boost::program_options;
-        auto options = make_per_file_options(args);
+        auto options = make_per_file_options(header.args);
         auto compiler_opts = make_compiler_options();
         options.add(compiler_opts);
 
         opts::positional_options_description pos;
-        auto parsed = comment_parser(std::ifstream(file), "caliber")
+        auto parsed = opts::command_line_parser(args)
           .options(options).positional(pos).run();
 
         opts::variables_map vm;
         opts::store(parsed, vm);
         opts::notify(vm);
-        comp_args = filter_options(parsed, compiler_opts);
+        // Expecting a particular error implies expecting a failure.
+        if(!header.args.expect_error.empty() || header.args.expect_error_line)
+          header.args.expect_fail = true;
+        auto comp_args = filter_options(parsed, compiler_opts);
+        header.comp_args.insert(header.comp_args.end(), comp_args.begin(),
+                                comp_args.end());
       } catch(const std::exception &e) {
-        logger.started_test(name);
-        return logger.failed_test(
-          name, { .message = std::string("Invalid command: ") + e.what() },
-          output, mettle::log::test_duration(0)
-        );
+        header.error = std::string("Invalid command: ") + e.what();
+      }
+    }
+
+    test_header read_test_header(const std::string &file) {
+      test_header header;
+      std::ifstream is(file);
+      parse_test_header(extract_comment(is, "caliber"), header);
+      return header;
+    }
+
+    // Add the tests for a test file (or test case) to `result`. If the test is
+    // parameterized, add one test for each instance of its matrix, all sharing
+    // the options we've already parsed. `id` identifies the file (or case)
+    // from run to run; see `compilation_test::id`.
+    void add_tests(std::vector<parsed_test_file> &result,
+                   const std::string &file, const std::string &src,
+                   const std::string &id, std::string default_name,
+                   const test_header &header,
+                   const std::optional<std::string> &source = std::nullopt) {
+      if(!header.error.empty()) {
+        result.push_back({file, std::move(default_name), {}, nullptr,
+                          header.error});
+        return;
       }
 
-      if(!args.name.empty())
-        name.name = std::move(args.name);
+      const auto &args = header.args;
+      std::shared_ptr<const expected_error> expected;
+      if(!args.expect_error.empty() || args.expect_error_line) {
+        try {
+          std::optional<std::regex> message;
+          if(!args.expect_error.empty())
+            message.emplace(args.expect_error, std::regex::optimize);
+          expected = std::make_shared<const expected_error>(expected_error{
+            std::move(message), args.expect_error, args.expect_error_line,
+            file
+          });
+        } catch(const std::regex_error &e) {
+          result.push_back({file, std::move(default_name), {}, nullptr,
+                            std::string("Invalid --expect-error: ") +
+                            e.what()});
+          return;
+        }
+      }
 
+      auto name = args.name.empty() ? std::move(default_name) : args.name;
       auto attrs = make_attributes(args.attrs);
-      auto action = filter(name, attrs);
-      if(action.action == mettle::test_action::indeterminate)
-        action = filter_by_attr(attrs);
+      for(auto &instance : expand_matrix(args.matrix)) {
+        auto comp_args = header.comp_args;
+        comp_args.insert(comp_args.end(), instance.args.begin(),
+                         instance.args.end());
+        result.push_back({
+          file, instance.label.empty() ? name :
+                name + " [" + instance.label + "]",
+          attrs, std::make_shared<const compilation_test>(compilation_test{
+            src, std::move(comp_args), args, source, expected,
+            instance.label.empty() ? id : id + " [" + instance.label + "]"
+          }), ""
+        });
+      }
+    }
 
-      if(action.action == mettle::test_action::hide)
-        return;
+    std::vector<parsed_test_file>
+    test_file_error(const std::string &file, std::string error) {
+      return {{file, file, {}, nullptr, std::move(error)}};
+    }
 
-      logger.started_test(name);
+    // Where to write the cases of multi-case test files for this run; see
+    // `run_options::case_dir`. A temporary directory is removed once we're
+    // done with it.
+    class case_directory {
+    public:
+      explicit case_directory(const run_options &options) {
+        namespace fs = FILESYSTEM_NS;
+        if(options.case_dir) {
+          path_ = *options.case_dir;
+        } else {
+          path_ = (fs::temp_directory_path() /
+                   ("caliber-cases-" + random_suffix())).string();
+          temporary_ = true;
+        }
+      }
+      case_directory(const case_directory &) = delete;
+      case_directory & operator =(const case_directory &) = delete;
 
-      if(action.action == mettle::test_action::skip)
-        return logger.skipped_test(name, action.message);
-      if(!match_flavors(runner.compiler(), args.compilers)) {
-        return logger.skipped_test(
-          name, "test skipped for " + runner.compiler().brand
-        );
+      ~case_directory() {
+        namespace fs = FILESYSTEM_NS;
+        if(temporary_) {
+          try {
+            fs::remove_all(path_);
+          } catch(const fs::filesystem_error &) {}
+        }
       }
 
-      using namespace std::chrono;
-      auto then = steady_clock::now();
-      auto failed = runner(file, comp_args, args.raw_args, args.expect_fail,
-                           output);
-      auto now = steady_clock::now();
-      auto duration = duration_cast<mettle::log::test_duration>(now - then);
+      const std::string & path() const {
+        return path_;
+      }
+    private:
+      std::string path_;
+      bool temporary_ = false;
+    };
+
+    // Get the directory in `case_dir` to write the cases of `file` to. This
+    // stays the same from run to run, so that the result cache can recognize
+    // the cases.
+    FILESYSTEM_NS::path
+    case_file_dir(const std::string &case_dir, const std::string &file) {
+      namespace fs = FILESYSTEM_NS;
+      std::string absolute = file;
+      try {
+        absolute = fs::absolute(file).string();
+      } catch(const fs::filesystem_error &) {}
+
+      hasher h;
+      h.field(absolute);
+      return fs::path(case_dir) / h.hex_digest();
+    }
+
+    // Remove the cases in `dir` left over from when its test file had more
+    // than `count` of them.
+    void remove_stale_cases(const FILESYSTEM_NS::path &dir, std::size_t count) {
+      namespace fs = FILESYSTEM_NS;
+      try {
+        for(const auto &entry : fs::directory_iterator(dir)) {
+          // Leave anything that isn't one of our cases alone, like a case
+          // that another process is in the middle of writing.
+          auto stem = entry.path().stem().string();
+          if(stem.empty() || stem.size() > 9 ||
+             stem.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+          if(std::stoul(stem) >= count)
+            remove_file(entry.path().string());
+        }
+      } catch(const fs::filesystem_error &) {}
+    }
+
+    std::string line_directive(std::size_t line, const std::string &file) {
+      std::string result = "#line " + std::to_string(line) + " \"";
+      for(char c : file) {
+        if(c == '\\' || c == '"')
+          result += '\\';
+        result += c;
+      }
+      return result + "\"\n";
+    }
 
-      if(failed)
-        logger.failed_test(name, *failed, output, duration);
-      else
-        logger.passed_test(name, output, duration);
+    // Get the source for a single case of a multi-case test file: the file's
+    // preamble followed by the case itself, with `#line` directives so that
+    // diagnostics point into the original file.
+    std::string case_source(const std::string &file, const test_cases &split,
+                            const test_case &c) {
+      std::string result = line_directive(1, file);
+      result += split.preamble;
+      if(!result.empty() && result.back() != '\n')
+        result += '\n';
+      result += line_directive(c.line + 1, file);
+      result += c.body;
+      return result;
     }
+
+    // Split a multi-case test file into its cases. If `case_dir` is set,
+    // write each case under it for compilers that can't read it from stdin.
+    std::vector<parsed_test_file>
+    parse_test_cases(const std::string &file, const test_header &header,
+                     const std::optional<std::string> &case_dir) {
+      auto text = read_file(file);
+      if(!text)
+        return test_file_error(file, "Unable to read file");
+      auto split = split_test_cases(*text);
+      if(split.cases.empty())
+        return test_file_error(file, "No `caliber-case` comments found");
+
+      // The case isn't compiled from the original file, so make sure it can
+      // still find headers next to it. (Include paths are relative to the
+      // file being compiled, so make those absolute too.)
+      namespace fs = FILESYSTEM_NS;
+      fs::path dir;
+      try {
+        dir = fs::absolute(file).parent_path();
+      } catch(const fs::filesystem_error &) {
+        dir = fs::path(file).parent_path();
+      }
+      boost::program_options::option include("-I", {dir.string()});
+
+      auto base_name = header.args.name.empty() ? file : header.args.name;
+      std::optional<fs::path> cases_dir;
+      if(case_dir)
+        cases_dir = case_file_dir(*case_dir, file);
+      std::vector<parsed_test_file> result;
+      for(std::size_t i = 0; i != split.cases.size(); i++) {
+        const auto &c = split.cases[i];
+
+        // Each case starts with the options for the whole file, with the
+        // case's own options added on.
+        test_header case_header = header;
+        case_header.args.cases = false;
+        case_header.args.name.clear();
+        case_header.comp_args.insert(case_header.comp_args.begin(), include);
+        parse_test_header(c.args, case_header);
+        for(auto &arg : case_header.comp_args) {
+          if(arg.string_key == "-I")
+            arg.value.front() = (dir / arg.value.front()).string();
+        }
+        for(auto &axis : case_header.args.matrix) {
+          if(axis.key == "I") {
+            for(auto &i : axis.values)
+              i = (dir / i).string();
+          }
+        }
+
+        // Only rewrite the case when it's changed, so that it looks the same
+        // to the result cache.
+        auto source = case_source(file, split, c);
+        std::string path = file;
+        if(cases_dir) {
+          path = (*cases_dir / (std::to_string(i) +
+                                fs::path(file).extension().string())).string();
+          if(case_header.error.empty() && read_file(path) != source &&
+             !write_file_atomically(path, source))
+            case_header.error = "Unable to write test case to \"" + path +
+                                "\"";
+        }
+
+        auto line = ":" + std::to_string(c.line);
+        add_tests(result, file, path, file + line, base_name + line,
+                  case_header, source);
+      }
+      if(cases_dir)
+        remove_stale_cases(*cases_dir, split.cases.size());
+      return result;
+    }
+
+    std::vector<parsed_test_file>
+    parse_test_file(const std::string &file, const run_options &options,
+                    const std::optional<std::string> &case_dir) {
+      std::optional<test_header> header;
+      std::optional<file_stamp> stamp;
+      if(options.index && (stamp = stamp_file(file)))
+        header = options.index->lookup(file, *stamp);
+      if(!header) {
+        header = read_test_header(file);
+        if(stamp)
+          options.index->update(file, *stamp, *header);
+      }
+
+      if(header->error.empty() && header->args.cases)
+        return parse_test_cases(file, *header, case_dir);
+
+      std::vector<parsed_test_file> result;
+      add_tests(result, file, file, file, file, *header);
+      return result;
+    }
+
+    std::optional<pending_test> start_test(
+      const std::vector<mettle::suite_name> &test_suite,
+      const parsed_test_file &parsed, test_scheduler &scheduler,
+      const compilation_test_runner &runner, const mettle::filter_set &filter
+    ) {
+      mettle::test_name name = {generate_id(), test_suite, parsed.name,
+                                parsed.file};
+
+      if(!parsed.test) {
+        test_outcome outcome{test_outcome::status::failed};
+        outcome.failure.message = parsed.error;
+        return pending_test{std::move(name), scheduler.fail(
+          runner, std::move(outcome), parsed.file, parsed.name
+        )};
+      }
+
+      auto action = filter(name, parsed.attrs);
+      if(action.action == mettle::test_action::indeterminate)
+        action = filter_by_attr(parsed.attrs);
+
+      if(action.action == mettle::test_action::hide)
+        return std::nullopt;
+
+      if(action.action == mettle::test_action::skip) {
+        test_outcome outcome{test_outcome::status::skipped};
+        outcome.skip_message = action.message;
+        return pending_test{std::move(name), ready_outcome(std::move(outcome))};
+      }
+      if(!match_flavors(runner.compiler(), parsed.test->args.compilers)) {
+        test_outcome outcome{test_outcome::status::skipped};
+        outcome.skip_message = "test skipped for " + runner.compiler().brand;
+        return pending_test{std::move(name), ready_outcome(std::move(outcome))};
+      }
+
+      return pending_test{std::move(name),
+                          scheduler.schedule(runner, parsed.test, parsed.file,
+                                             parsed.name)};
+    }
+
+    // The tests being run with a particular compiler.
+    struct compiler_run {
+      const compilation_test_runner *runner;
+      std::vector<mettle::suite_name> test_suite;
+      std::deque<pending_test> pending = {};
+    };
   }
 
   void run_test_files(
     const mettle::suite_name &suite_name, const std::vector<std::string> &files,
-    mettle::log::test_logger &logger, const compilation_test_runner &runner,
-    const mettle::filter_set &filter
+    mettle::log::test_logger &logger,
+    const std::vector<const compilation_test_runner *> &runners,
+    const mettle::filter_set &filter, const run_options &options
   ) {
+    assert(!runners.empty() && "no compilers");
     const std::vector<mettle::suite_name> test_suite = {suite_name};
 
+    // When there are several compilers, each one's tests go in a sub-suite
+    // named after the compiler.
+    bool nested = runners.size() > 1;
+    std::deque<compiler_run> runs;
+    for(const auto *runner : runners) {
+      auto runner_suite = test_suite;
+      if(nested)
+        runner_suite.push_back({command_name(runner->compiler().command), ""});
+      runs.push_back({runner, std::move(runner_suite)});
+    }
+
     logger.started_run();
     logger.started_suite(test_suite);
+    if(nested)
+      logger.started_suite(runs.front().test_suite);
 
-    for(const auto &file : files)
-      run_test_file(test_suite, file, logger, runner, filter);
+    // Tests are reported in the order they were submitted, regardless of the
+    // order in which they finish, one compiler at a time.
+    std::size_t current = 0;
+    auto report = [&](bool finished) {
+      while(true) {
+        auto &run = runs[current];
+        log_pending(run.pending, logger, finished);
+        if(!finished || current + 1 == runs.size())
+          return;
+        logger.ended_suite(run.test_suite);
+        logger.started_suite(runs[++current].test_suite);
+      }
+    };
+
+    // Test cases split out of a file are fed to the compiler through stdin,
+    // but if any compilers can't read from stdin, we need them on disk too.
+    std::optional<case_directory> cases;
+    std::optional<std::string> case_dir;
+    if(std::any_of(runners.begin(), runners.end(), [](const auto *runner) {
+      return !runner->compiler().reads_stdin();
+    })) {
+      case_dir = cases.emplace(options).path();
+    }
+
+    {
+      test_scheduler scheduler(options);
+      // Start compiling each test as soon as it's found, rather than waiting
+      // to find them all (unless the scheduler is ordering them by history).
+      find_test_files(files, options.jobs, [&](const std::string &file) {
+        if(options.shard && !options.shard->contains(file))
+          return;
+
+        // Read each file's options just once, no matter how many compilers
+        // we're testing with.
+        for(const auto &parsed : parse_test_file(file, options, case_dir)) {
+          for(auto &run : runs) {
+            auto test = start_test(run.test_suite, parsed, scheduler,
+                                   *run.runner, filter);
+            if(test)
+              run.pending.push_back(std::move(*test));
+          }
+        }
+        report(false);
+      });
+      scheduler.flush();
+      report(true);
+    }
 
+    if(nested)
+      logger.ended_suite(runs.back().test_suite);
     logger.ended_suite(test_suite);
     logger.ended_run();
   }
@@ -1,19 +1,94 @@
 #ifndef INC_CALIBER_SRC_RUN_TEST_FILES_HPP
 #define INC_CALIBER_SRC_RUN_TEST_FILES_HPP
 
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+
 #include <mettle/driver/filters.hpp>
 #include <mettle/driver/log/core.hpp>
 
+#include "benchmark.hpp"
+#include "cmd_line.hpp"
 #include "compilation_test_runner.hpp"
+#include "prelude.hpp"
+#include "profile.hpp"
+#include "result_cache.hpp"
+#include "run_history.hpp"
+#include "test_index.hpp"
 
 namespace caliber {
 
+  struct run_options {
+    // The number of tests to compile in parallel.
+    std::size_t jobs = 1;
+    // If set, only run the test files in this shard.
+    std::optional<caliber::shard> shard = std::nullopt;
+    // If set, reuse the results of unchanged tests from this cache.
+    const result_cache *cache = nullptr;
+    // If set, reuse the parsed options of unchanged test files from this
+    // index.
+    test_index *index = nullptr;
+    // If set, write the cases of multi-case test files here for compilers
+    // that can't read them from stdin, so that their paths (and so their
+    // cached results) stay the same from run to run. Otherwise, they're
+    // written to a temporary directory that's removed after the run.
+    std::optional<std::string> case_dir = std::nullopt;
+    // If set, start the tests that took longest to compile last time first,
+    // and record how each test goes this time.
+    run_history *history = nullptr;
+    // If true (and `history` is set), start the tests that failed last time
+    // before any others.
+    bool failed_first = false;
+    // If nonzero, stop the run once this many tests have failed, killing any
+    // compilers that are still running; the remaining tests are skipped.
+    std::size_t max_failures = 0;
+    // The maximum number of tests that are expected to compile successfully to
+    // pass to a single compiler invocation; 0 or 1 disables batching.
+    std::size_t batch_size = 0;
+    // If set, implicitly include this precompiled header in every test.
+    const precompiled_prelude *prelude = nullptr;
+    // If set, fail tests whose compiler uses more than this much memory (in
+    // bytes) or CPU time, even if they'd otherwise pass.
+    std::optional<std::uint64_t> max_rss = std::nullopt;
+    std::optional<std::chrono::milliseconds> max_cpu = std::nullopt;
+    // If true, append the resources each test used to its output.
+    bool show_usage = false;
+    // If set, keep only this many bytes of the start and end of each test's
+    // stdout and stderr. Tests that go over are written in full to files in
+    // `full_output_dir`, if set.
+    std::optional<std::size_t> output_limit = std::nullopt;
+    std::optional<std::string> full_output_dir = std::nullopt;
+    // If set, compile each test `bench_runs` times (without using the cache
+    // or batching) and record its compile times there.
+    benchmark *bench = nullptr;
+    std::size_t bench_runs = 1;
+    // If true, profile every test, not just the ones that ask for it.
+    bool profile_all = false;
+    // If set, add the profiles of all profiled tests here.
+    profile_summary *profile = nullptr;
+  };
+
+  // Run every test file in `files` (which can also name directories or glob
+  // patterns; see `find_test_files`) with each of `runners`. If there's more
+  // than one, each runner's tests are reported in a sub-suite named after its
+  // compiler.
   void run_test_files(
     const mettle::suite_name &suite_name, const std::vector<std::string> &files,
-    mettle::log::test_logger &logger, const compilation_test_runner &runner,
-    const mettle::filter_set &filter
+    mettle::log::test_logger &logger,
+    const std::vector<const compilation_test_runner *> &runners,
+    const mettle::filter_set &filter, const run_options &options = {}
   );
 
+  inline void run_test_files(
+    const mettle::suite_name &suite_name, const std::vector<std::string> &files,
+    mettle::log::test_logger &logger, const compilation_test_runner &runner,
+    const mettle::filter_set &filter, const run_options &options = {}
+  ) {
+    run_test_files(suite_name, files, logger, {&runner}, filter, options);
+  }
+
 } // namespace caliber
 
 #endif
@@ -0,0 +1,203 @@
+#ifndef INC_CALIBER_SRC_SERVER_PROTOCOL_HPP
+#define INC_CALIBER_SRC_SERVER_PROTOCOL_HPP
+
+#include <charconv>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The protocol that caliber uses to talk to compile servers (see
+// `compile_server_pool`) over their stdin and stdout. Every message is a
+// sequence of netstrings (`<length>:<data>,`). When a server starts, it sends
+// a hello (the protocol version and the version of its compiler); after that,
+// caliber sends requests and the server answers each one in turn. A server
+// exits once its stdin is closed.
+
+namespace caliber::server {
+
+  inline constexpr char protocol_version[] = "caliber-server 1";
+
+  struct hello {
+    std::string protocol;
+    // The version of the compiler the server is built on, in the same form as
+    // the first line of the compiler's `--version` output.
+    std::string version;
+  };
+
+  struct request {
+    // The full command line, as produced by `translate_args`.
+    std::vector<std::string> args;
+    // If set, the source to compile in place of `-` in `args`.
+    std::optional<std::string> input;
+  };
+
+  enum class verdict {
+    pass,
+    fail,
+    // The server can't handle this request the way the compiler would (e.g.
+    // it asks for a dependency file), so caliber should run the compiler.
+    unsupported
+  };
+
+  struct reply {
+    verdict status = verdict::unsupported;
+    // The diagnostics, formatted like the compiler would write them to stderr.
+    std::string output;
+    // Every file the compiler read, including the source itself.
+    std::vector<std::string> includes;
+  };
+
+  class message_writer {
+  public:
+    message_writer & add(std::string_view data) {
+      message_ += std::to_string(data.size());
+      message_ += ':';
+      message_ += data;
+      message_ += ',';
+      return *this;
+    }
+
+    message_writer & add(const std::vector<std::string> &data) {
+      add(std::to_string(data.size()));
+      for(const auto &i : data)
+        add(i);
+      return *this;
+    }
+
+    const std::string & str() const {
+      return message_;
+    }
+  private:
+    std::string message_;
+  };
+
+  // Reads the fields of a message as it arrives. Each `read` returns false if
+  // the message isn't all there yet, and throws if it's malformed. Fields
+  // refer to the original data rather than being copied, so checking an
+  // incomplete message only costs as much as reading the fields' lengths.
+  class message_reader {
+  public:
+    explicit message_reader(std::string_view data) : data_(data) {}
+
+    bool read(std::string_view &result) {
+      auto colon = data_.find(':', pos_);
+      if(colon == std::string_view::npos) {
+        if(data_.size() - pos_ > 20)
+          throw std::runtime_error("invalid message length");
+        return false;
+      }
+
+      std::size_t size;
+      auto [end, err] = std::from_chars(data_.data() + pos_,
+                                        data_.data() + colon, size);
+      if(err != std::errc() || end != data_.data() + colon ||
+         colon == pos_)
+        throw std::runtime_error("invalid message length");
+      if(data_.size() - colon - 1 < size + 1)
+        return false;
+      if(data_[colon + 1 + size] != ',')
+        throw std::runtime_error("unterminated message field");
+
+      result = data_.substr(colon + 1, size);
+      pos_ = colon + size + 2;
+      return true;
+    }
+
+    bool read(std::vector<std::string_view> &result) {
+      std::string_view count;
+      if(!read(count))
+        return false;
+      std::size_t size;
+      auto [end, err] = std::from_chars(count.data(),
+                                        count.data() + count.size(), size);
+      if(err != std::errc() || end != count.data() + count.size())
+        throw std::runtime_error("invalid message list");
+
+      // Don't trust the count enough to make room for it all up front; only
+      // grow the list as its fields actually arrive.
+      result.clear();
+      for(std::size_t i = 0; i != size; i++) {
+        if(!read(result.emplace_back()))
+          return false;
+      }
+      return true;
+    }
+
+    // How much of the data the message took up, once it's been read.
+    std::size_t consumed() const {
+      return pos_;
+    }
+  private:
+    std::string_view data_;
+    std::size_t pos_ = 0;
+  };
+
+  inline std::string encode(const hello &h) {
+    return message_writer().add(h.protocol).add(h.version).str();
+  }
+
+  inline std::string encode(const request &r) {
+    message_writer w;
+    w.add(r.args).add(r.input ? "1" : "0");
+    if(r.input)
+      w.add(*r.input);
+    return w.str();
+  }
+
+  inline std::string encode(const reply &r) {
+    const char *status = r.status == verdict::pass ? "pass" :
+                         r.status == verdict::fail ? "fail" : "unsupported";
+    return message_writer().add(status).add(r.output).add(r.includes).str();
+  }
+
+  // Decode a message from the start of `data`, returning how much of `data`
+  // it took up, or 0 if it isn't all there yet (in which case the message is
+  // left alone).
+  inline std::size_t decode(std::string_view data, hello &h) {
+    message_reader r(data);
+    std::string_view protocol, version;
+    if(!r.read(protocol) || !r.read(version))
+      return 0;
+    h.protocol = protocol;
+    h.version = version;
+    return r.consumed();
+  }
+
+  inline std::size_t decode(std::string_view data, request &req) {
+    message_reader r(data);
+    std::vector<std::string_view> args;
+    std::string_view has_input, input;
+    if(!r.read(args) || !r.read(has_input) ||
+       (has_input == "1" && !r.read(input)))
+      return 0;
+    req.args.assign(args.begin(), args.end());
+    if(has_input == "1")
+      req.input.emplace(input);
+    else
+      req.input.reset();
+    return r.consumed();
+  }
+
+  inline std::size_t decode(std::string_view data, reply &rep) {
+    message_reader r(data);
+    std::string_view status, output;
+    std::vector<std::string_view> includes;
+    if(!r.read(status) || !r.read(output) || !r.read(includes))
+      return 0;
+    rep.output = output;
+    rep.includes.assign(includes.begin(), includes.end());
+    if(status == "pass")
+      rep.status = verdict::pass;
+    else if(status == "fail")
+      rep.status = verdict::fail;
+    else
+      rep.status = verdict::unsupported;
+    return r.consumed();
+  }
+
+} // namespace caliber::server
+
+#endif
@@ -0,0 +1,168 @@
+#include "test_index.hpp"
+
+#include <sstream>
+
+#include "filesystem.hpp"
+
+namespace caliber {
+
+  namespace {
+    const char header[] = "caliber-index 4";
+
+    std::string absolute_path(const std::string &file) {
+      namespace fs = FILESYSTEM_NS;
+      try {
+        return fs::absolute(file).string();
+      } catch(const fs::filesystem_error &) {
+        return file;
+      }
+    }
+
+    void write_list(std::ostream &os, const std::vector<std::string> &list) {
+      os << list.size() << "\n";
+      for(const auto &i : list)
+        write_field(os, i);
+    }
+
+    bool read_list(std::istream &is, std::vector<std::string> &list) {
+      std::size_t size;
+      if(!(is >> size) || is.get() != '\n')
+        return false;
+      list.resize(size);
+      for(auto &i : list) {
+        if(!read_field(is, i))
+          return false;
+      }
+      return true;
+    }
+
+    void write_header(std::ostream &os, const test_header &h) {
+      write_field(os, h.error);
+      os << h.args.expect_fail << " " << h.args.profile << " "
+         << h.args.cases << "\n";
+      write_field(os, h.args.name);
+      write_field(os, h.args.expect_error);
+      os << h.args.expect_error_line << "\n";
+      write_list(os, h.args.attrs);
+      write_list(os, h.args.compilers);
+
+      os << h.args.raw_args.size() << "\n";
+      for(const auto &i : h.args.raw_args) {
+        write_field(os, i.flavor);
+        write_field(os, i.value);
+      }
+
+      os << h.comp_args.size() << "\n";
+      for(const auto &i : h.comp_args) {
+        write_field(os, i.string_key);
+        write_list(os, i.value);
+      }
+
+      os << h.args.matrix.size() << "\n";
+      for(const auto &i : h.args.matrix) {
+        write_field(os, i.key);
+        write_list(os, i.values);
+      }
+    }
+
+    bool read_header(std::istream &is, test_header &h) {
+      std::size_t raw_count, comp_count, matrix_count;
+      if(!read_field(is, h.error) ||
+         !(is >> h.args.expect_fail >> h.args.profile >> h.args.cases) ||
+         is.get() != '\n' ||
+         !read_field(is, h.args.name) ||
+         !read_field(is, h.args.expect_error) ||
+         !(is >> h.args.expect_error_line) || is.get() != '\n' ||
+         !read_list(is, h.args.attrs) ||
+         !read_list(is, h.args.compilers) ||
+         !(is >> raw_count) || is.get() != '\n')
+        return false;
+
+      h.args.raw_args.resize(raw_count);
+      for(auto &i : h.args.raw_args) {
+        if(!read_field(is, i.flavor) || !read_field(is, i.value))
+          return false;
+      }
+
+      if(!(is >> comp_count) || is.get() != '\n')
+        return false;
+      h.comp_args.resize(comp_count);
+      for(auto &i : h.comp_args) {
+        if(!read_field(is, i.string_key) || !read_list(is, i.value))
+          return false;
+      }
+
+      if(!(is >> matrix_count) || is.get() != '\n')
+        return false;
+      h.args.matrix.resize(matrix_count);
+      for(auto &i : h.args.matrix) {
+        if(!read_field(is, i.key) || !read_list(is, i.values))
+          return false;
+      }
+      return true;
+    }
+  }
+
+  test_index::test_index(std::string path) : path_(std::move(path)) {
+    load(path_, entries_);
+  }
+
+  void test_index::load(const std::string &path, entry_map &entries) {
+    auto data = read_file(path);
+    if(!data)
+      return;
+
+    std::istringstream is(*data);
+    std::string line;
+    if(!std::getline(is, line) || line != header)
+      return;
+
+    // If the index is corrupt, keep whatever we managed to read before the
+    // problem; the rest will just be re-read from the test files.
+    while(is.peek() != std::char_traits<char>::eof()) {
+      std::string file;
+      entry e;
+      if(!read_field(is, file) ||
+         !(is >> e.stamp.mtime >> e.stamp.size) || is.get() != '\n' ||
+         !read_header(is, e.header))
+        break;
+      entries.insert_or_assign(std::move(file), std::move(e));
+    }
+  }
+
+  std::optional<test_header>
+  test_index::lookup(const std::string &file, const file_stamp &stamp) const {
+    auto path = absolute_path(file);
+    std::lock_guard lock(mutex_);
+    auto i = entries_.find(path);
+    if(i == entries_.end() || i->second.stamp != stamp)
+      return std::nullopt;
+    return i->second.header;
+  }
+
+  void test_index::update(const std::string &file, const file_stamp &stamp,
+                          const test_header &header) {
+    auto path = absolute_path(file);
+    std::lock_guard lock(mutex_);
+    entries_.insert_or_assign(std::move(path), entry{stamp, header, true});
+    dirty_ = true;
+  }
+
+  void test_index::save() const {
+    std::lock_guard lock(mutex_);
+    if(!dirty_)
+      return;
+
+    save_merged(path_, entries_, load, [](const entry_map &merged) {
+      std::ostringstream os;
+      os << header << "\n";
+      for(const auto &i : merged) {
+        write_field(os, i.first);
+        os << i.second.stamp.mtime << " " << i.second.stamp.size << "\n";
+        write_header(os, i.second.header);
+      }
+      return os.str();
+    });
+  }
+
+} // namespace caliber
@@ -0,0 +1,63 @@
+#ifndef INC_CALIBER_SRC_TEST_INDEX_HPP
+#define INC_CALIBER_SRC_TEST_INDEX_HPP
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "cmd_line.hpp"
+#include "compiler.hpp"
+#include "files.hpp"
+
+namespace caliber {
+
+  // The options from a test file's header comment, after parsing.
+  struct test_header {
+    per_file_options args;
+    compiler_options comp_args;
+    // If the options were invalid, why.
+    std::string error;
+  };
+
+  // An on-disk index of test files' parsed options, keyed on each file's path
+  // and stamp, so that we can select which tests to run without opening every
+  // test file. The index is safe to share between threads and between caliber
+  // processes (e.g. the shards of a suite): saving merges what we've learned
+  // into whatever's on disk by then. If two processes updated the same file,
+  // the last one to save wins.
+  class test_index {
+  public:
+    // Load the index at `path`, if there is one.
+    explicit test_index(std::string path);
+    test_index(const test_index &) = delete;
+    test_index & operator =(const test_index &) = delete;
+
+    std::optional<test_header>
+    lookup(const std::string &file, const file_stamp &stamp) const;
+    void update(const std::string &file, const file_stamp &stamp,
+                const test_header &header);
+
+    // Write the index back out if it's changed, ignoring any errors.
+    void save() const;
+  private:
+    struct entry {
+      file_stamp stamp;
+      test_header header;
+      // True if this entry was updated since the index was loaded.
+      bool updated = false;
+    };
+    using entry_map = std::map<std::string, entry>;
+
+    static void load(const std::string &path, entry_map &entries);
+
+    std::string path_;
+
+    mutable std::mutex mutex_;
+    entry_map entries_;
+    bool dirty_ = false;
+  };
+
+} // namespace caliber
+
+#endif
@@ -2,8 +2,10 @@
 
 #include <windows.h>
 
+#include <algorithm>
 #include <cassert>
 #include <sstream>
+#include <thread>
 
 #include <mettle/driver/exit_code.hpp>
 #include <mettle/driver/windows/scoped_handle.hpp>
@@ -11,6 +13,8 @@
 #include <mettle/driver/windows/subprocess.hpp>
 #include <mettle/output.hpp>
 
+#include "../output_capture.hpp"
+
 // XXX: Use std::source_location instead when we're able.
 #define CALIBER_FAILED() failed(__FILE__, __LINE__)
 
@@ -31,11 +35,66 @@ namespace caliber {
       return msg;
     }
 
-    mettle::test_result failed(const char *file, std::uint_least32_t line) {
-      return {{ .message = "Fatal error: " + err_string(GetLastError()),
-                .file_name = file, .line = line }};
+    compilation_result failed(const char *file, std::uint_least32_t line) {
+      return {{{ .message = "Fatal error: " + err_string(GetLastError()),
+                 .file_name = file, .line = line }}};
+    }
+
+    std::optional<resource_usage> job_usage(HANDLE job) {
+      JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting;
+      JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+      if(!QueryInformationJobObject(
+           job, JobObjectBasicAndIoAccountingInformation, &accounting,
+           sizeof(accounting), nullptr
+         ) ||
+         !QueryInformationJobObject(
+           job, JobObjectExtendedLimitInformation, &limits, sizeof(limits),
+           nullptr
+         ))
+        return std::nullopt;
+
+      // Job times are in units of 100 ns.
+      using namespace std::chrono;
+      resource_usage result;
+      result.user_time = microseconds(
+        accounting.BasicInfo.TotalUserTime.QuadPart / 10
+      );
+      result.system_time = microseconds(
+        accounting.BasicInfo.TotalKernelTime.QuadPart / 10
+      );
+      result.max_rss = limits.PeakJobMemoryUsed;
+      // Windows doesn't distinguish between minor and major page faults.
+      result.minor_faults = accounting.BasicInfo.TotalPageFaultCount;
+      return result;
     }
 
+    // Writes a compiler's input on another thread, since reading its output
+    // blocks the thread that started it.
+    class input_writer {
+    public:
+      input_writer(mettle::windows::scoped_pipe &pipe, std::string_view input)
+        : thread_([&pipe, input]() mutable {
+            // If the compiler stops reading, the write fails and we stop.
+            DWORD written;
+            while(!input.empty() && WriteFile(
+                    pipe.write_handle, input.data(),
+                    static_cast<DWORD>(std::min<std::size_t>(input.size(),
+                                                             65536)),
+                    &written, nullptr
+                  ))
+              input.remove_prefix(written);
+            pipe.close_write();
+          }) {}
+
+      ~input_writer() {
+        // If we're giving up on the compiler, don't wait for it to read.
+        CancelSynchronousIo(thread_.native_handle());
+        thread_.join();
+      }
+    private:
+      std::thread thread_;
+    };
+
     std::string make_cmd_line(const std::vector<std::string> &argv) {
       assert(argv.size() > 0);
       std::ostringstream cmd_line;
@@ -46,30 +105,49 @@ namespace caliber {
     }
   }
 
-  mettle::test_result
+  // Each test runs in its own job object, so there's nothing to share between
+  // concurrently-running tests on Windows.
+  struct compilation_test_runner::running_tests {};
+
+  compilation_test_runner::compilation_test_runner(
+    std::unique_ptr<const caliber::compiler> compiler, timeout_t timeout,
+    std::shared_ptr<compile_server_pool> server
+  ) : compiler_(std::move(compiler)), timeout_(timeout),
+      server_(server && server->supports(*compiler_) ? std::move(server)
+                                                     : nullptr) {}
+
+  compilation_test_runner::~compilation_test_runner() = default;
+
+  void compilation_test_runner::cancel_all() const {
+    // Each compiler is only watched by the thread that started it, so there's
+    // no way to reach them from here. They'll finish on their own.
+  }
+
+  compilation_result
   compilation_test_runner::operator ()(
-    const std::string &file, const compiler_options &args,
-    const raw_options &raw_args, bool expect_fail,
-    mettle::log::test_output &output
+    const std::vector<std::string> &args, bool expect_fail,
+    mettle::log::test_output &output, std::optional<std::string_view> input,
+    const output_watcher &, const capture_options &capture
   ) const {
     using namespace mettle::windows;
 
-    scoped_pipe stdout_pipe, stderr_pipe;
-    if(!stdout_pipe.open(true, false) ||
+    scoped_pipe stdin_pipe, stdout_pipe, stderr_pipe;
+    if((input && !stdin_pipe.open()) ||
+       !stdout_pipe.open(true, false) ||
        !stderr_pipe.open(true, false))
       return CALIBER_FAILED();
 
-    if(!stdout_pipe.set_write_inherit(true) ||
+    if((input && !stdin_pipe.set_read_inherit(true)) ||
+       !stdout_pipe.set_write_inherit(true) ||
        !stderr_pipe.set_write_inherit(true))
       return CALIBER_FAILED();
 
-    auto cmd_line = make_cmd_line(
-      compiler_->translate_args(file, args, raw_args)
-    );
+    auto cmd_line = make_cmd_line(args);
 
     STARTUPINFOA startup_info = { sizeof(STARTUPINFOA) };
     startup_info.dwFlags = STARTF_USESTDHANDLES;
-    startup_info.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup_info.hStdInput = input ? stdin_pipe.read_handle
+                                   : GetStdHandle(STD_INPUT_HANDLE);
     startup_info.hStdOutput = stdout_pipe.write_handle;
     startup_info.hStdError = stderr_pipe.write_handle;
 
@@ -105,47 +183,78 @@ namespace caliber {
     if(!ResumeThread(proc_info.hThread))
       return CALIBER_FAILED();
 
-    if(!stdout_pipe.close_write() ||
+    if((input && !stdin_pipe.close_read()) ||
+       !stdout_pipe.close_write() ||
        !stderr_pipe.close_write())
       return CALIBER_FAILED();
 
+    std::optional<input_writer> writer;
+    if(input)
+      writer.emplace(stdin_pipe, *input);
+
+    // `read_into` has no way to limit how much it reads, so collect the
+    // output on the side and trim it once the compiler is done.
+    std::string stdout_log, stderr_log;
     std::string message;
     std::vector<readhandle> dests = {
-      {stdout_pipe.read_handle, &output.stdout_log},
-      {stderr_pipe.read_handle, &output.stderr_log}
+      {stdout_pipe.read_handle, &stdout_log},
+      {stderr_pipe.read_handle, &stderr_log}
     };
     std::vector<HANDLE> interrupts = {proc_info.hProcess};
     if(timeout_)
       interrupts.push_back(timeout_event);
 
+    // `read_into` doesn't return until the compiler finishes, so there's no
+    // chance to watch its output and stop it early.
     HANDLE finished = read_into(dests, INFINITE, interrupts);
     if(!finished)
       return CALIBER_FAILED();
     // Do one last non-blocking read to get any data we might have missed.
     read_into(dests, 0, interrupts);
 
+    auto spill_path = [&capture](const char *ext) {
+      return capture.spill ? std::optional(*capture.spill + ext)
+                           : std::nullopt;
+    };
+    output_capture stdout_capture(output.stdout_log, capture.stdout_limit,
+                                  spill_path(".stdout"));
+    stdout_capture.append(stdout_log);
+    stdout_capture.finish();
+    output_capture stderr_capture(output.stderr_log, capture.stderr_limit,
+                                  spill_path(".stderr"));
+    stderr_capture.append(stderr_log);
+    stderr_capture.finish();
+
+    // Collect the resources used by everything in the job before we kill it.
+    auto usage = job_usage(job);
+
     // By now, the child process's main thread has returned, so kill any stray
     // processes in the job.
     TerminateJobObject(job, 1);
+    writer.reset();
 
+    compilation_result result;
     if(finished == timeout_event) {
       std::ostringstream ss;
       ss << "Timed out after " << timeout_->count() << " ms";
-      return {{ .message = ss.str() }};
+      result = {{{ .message = ss.str() }}};
     } else {
       DWORD exit_status;
       if(!GetExitCodeProcess(proc_info.hProcess, &exit_status))
         return CALIBER_FAILED();
 
       bool success = exit_status == mettle::exit_code::success;
-      if(success != expect_fail)
-        return std::nullopt;
-
-      std::ostringstream ss;
-      ss << cmd_line << " ";
-      ss << (success ? "\nCompilation successful" : "\nCompilation failed");
-      return {{ .message = ss.str() }};
+      result.completed = true;
+      if(success == expect_fail) {
+        std::ostringstream ss;
+        ss << cmd_line << " ";
+        ss << (success ? "\nCompilation successful" : "\nCompilation failed");
+        result.result = mettle::test_failure{ .message = ss.str() };
+      }
     }
+
+    result.usage = usage;
+    return result;
   }
 
 } // namespace caliber
@@ -0,0 +1,27 @@
+#include "../compile_server.hpp"
+
+namespace caliber {
+
+  // Compile servers aren't supported on Windows yet, so there are never any
+  // servers in the pool, and every test is compiled the usual way.
+  struct compile_server_pool::worker {};
+
+  compile_server_pool::compile_server_pool(std::vector<std::string> command)
+    : command_(std::move(command)) {}
+
+  compile_server_pool::~compile_server_pool() = default;
+
+  const std::string & compile_server_pool::version() {
+    std::lock_guard lock(mutex_);
+    if(!version_)
+      version_.emplace();
+    return *version_;
+  }
+
+  std::optional<compile_reply>
+  compile_server_pool::compile(const std::vector<std::string> &,
+                               std::optional<std::string_view>, timeout_t) {
+    return std::nullopt;
+  }
+
+} // namespace caliber
@@ -0,0 +1,18 @@
+// caliber --cases --name "test cases" -DSHARED
+#ifndef SHARED
+#error "SHARED not defined"
+#endif
+
+// caliber-case --name "passing case"
+int main() {
+}
+
+// caliber-case -F --name "failing case"
+int main() {
+  undefined_type t;
+}
+
+// caliber-case --name "case with its own options" -DCASE
+#ifndef CASE
+#error "CASE not defined"
+#endif
@@ -0,0 +1,4 @@
+// caliber --name "expected error" --expect-error "string" --expect-error-line 3
+int main() {
+  std::string s;
+}
@@ -0,0 +1,17 @@
+// caliber -n "long error output" --expect-error "string" --expect-error-line 14
+// Surround the error we're looking for with more errors than fit in the output
+// limit the test suite runs with (1 MiB), so that it would be dropped from the
+// middle of the output if we kept to the limit.
+#define S1 "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+#define S2 S1 S1 S1 S1 S1 S1 S1 S1
+#define S3 S2 S2 S2 S2 S2 S2 S2 S2
+#define S4 S3 S3 S3 S3 S3 S3 S3 S3
+#define FAIL static_assert(false, S4 S4 S4 S4 S4 S4 S4 S4)
+
+FAIL; FAIL; FAIL;
+
+int main() {
+  std::string s;
+}
+
+FAIL; FAIL; FAIL;
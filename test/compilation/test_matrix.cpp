@@ -0,0 +1,7 @@
+// caliber --name "matrix" --matrix std=c++17,c++20 --matrix D=A,B
+#if !defined(A) && !defined(B)
+#error "neither A nor B defined"
+#endif
+
+int main() {
+}
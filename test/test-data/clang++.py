@@ -5,6 +5,7 @@ import argparse
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument('--version', action='store_true')
+    parser.add_argument('--fake-version', default='16.0.0')
     args = parser.parse_args()
     if args.version:
-        print('clang version 1.0')
+        print('clang version {}'.format(args.fake_version))
@@ -0,0 +1,110 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include "../src/benchmark.hpp"
+
+struct benchmark_fixture {
+  benchmark_fixture() {
+    std::random_device rd;
+    dir = std::filesystem::temp_directory_path() /
+      ("caliber-test-" + std::to_string(rd()));
+    std::filesystem::create_directories(dir);
+  }
+
+  ~benchmark_fixture() {
+    std::filesystem::remove_all(dir);
+  }
+
+  std::filesystem::path dir;
+};
+
+suite<> test_summarize("summarize()", [](auto &_) {
+  _.test("empty", []() {
+    auto stats = caliber::summarize({});
+    expect(stats.median, equal_to(0.0));
+    expect(stats.mad, equal_to(0.0));
+  });
+
+  _.test("odd", []() {
+    auto stats = caliber::summarize({3, 1, 100, 2, 4});
+    expect(stats.median, equal_to(3.0));
+    expect(stats.mad, equal_to(1.0));
+  });
+
+  _.test("even", []() {
+    auto stats = caliber::summarize({4, 1, 3, 2});
+    expect(stats.median, equal_to(2.5));
+    expect(stats.mad, equal_to(1.0));
+  });
+});
+
+suite<benchmark_fixture> test_benchmark("benchmark", [](auto &_) {
+  _.test("no baseline", [](benchmark_fixture &) {
+    caliber::benchmark bench;
+    auto [summary, regressed] = bench.record("c++", "test.cpp", {
+      5, {1.0, 0.01}, {0.9, 0.01}
+    });
+    expect(summary, equal_to("wall time 1.000 s (+/- 0.010 s), CPU time "
+                             "0.900 s (+/- 0.010 s) over 5 runs"));
+    expect(regressed, equal_to(false));
+  });
+
+  _.test("compare to baseline", [](benchmark_fixture &f) {
+    auto path = (f.dir / "baseline.json").string();
+    {
+      caliber::benchmark bench;
+      bench.record("c++", "fast.cpp", {5, {1.0, 0.01}, {0.9, 0.01}});
+      bench.record("c++", "slow.cpp", {5, {1.0, 0.01}, {0.9, 0.01}});
+      bench.record("c++", "noisy.cpp", {5, {1.0, 0.5}, {0.9, 0.5}});
+      bench.save(path);
+    }
+
+    caliber::benchmark bench(0.1);
+    bench.load_baseline(path);
+    expect(bench.record("c++", "fast.cpp", {5, {1.05, 0.01}, {0.95, 0.01}})
+             .second, equal_to(false));
+    expect(bench.record("c++", "slow.cpp", {5, {1.5, 0.01}, {1.4, 0.01}})
+             .second, equal_to(true));
+    expect(bench.record("c++", "noisy.cpp", {5, {1.5, 0.5}, {1.4, 0.5}})
+             .second, equal_to(false));
+    expect(bench.record("g++", "slow.cpp", {5, {1.5, 0.01}, {1.4, 0.01}})
+             .second, equal_to(false));
+  });
+
+  _.test("save keeps unrun tests", [](benchmark_fixture &f) {
+    auto path = (f.dir / "baseline.json").string();
+    {
+      caliber::benchmark bench;
+      bench.record("c++", "first.cpp", {3, {2.0, 0.01}, {2.0, 0.01}});
+      bench.save(path);
+    }
+    {
+      caliber::benchmark bench;
+      bench.load_baseline(path);
+      bench.record("c++", "second.cpp", {3, {1.0, 0.01}, {1.0, 0.01}});
+      bench.save(path);
+    }
+
+    caliber::benchmark bench;
+    bench.load_baseline(path);
+    expect(bench.record("c++", "first.cpp", {3, {3.0, 0.01}, {3.0, 0.01}})
+             .second, equal_to(true));
+    expect(bench.record("c++", "second.cpp", {3, {2.0, 0.01}, {2.0, 0.01}})
+             .second, equal_to(true));
+  });
+
+  _.test("invalid baseline", [](benchmark_fixture &f) {
+    auto path = (f.dir / "baseline.json").string();
+    std::ofstream(path) << "{\"version\": 99}";
+
+    caliber::benchmark bench;
+    expect([&]() { bench.load_baseline(path); },
+           thrown<std::runtime_error>());
+    expect([&]() { bench.load_baseline((f.dir / "nonexist").string()); },
+           thrown<std::runtime_error>());
+  });
+});
@@ -0,0 +1,211 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <sstream>
+
+#include "../src/cmd_line.hpp"
+
+suite<> test_cmd_line("extract_comment()", [](auto &_) {
+  using caliber::extract_comment;
+  static const std::vector<std::string> no_args;
+
+  _.test("line comment", []() {
+    expect(extract_comment("// caliber -Dfoo --std=c++17\nint x;", "caliber"),
+           array("-Dfoo", "--std=c++17"));
+    expect(extract_comment("//caliber\t-Dfoo\r\n", "caliber"),
+           array("-Dfoo"));
+    expect(extract_comment("// caliber", "caliber"), equal_to(no_args));
+  });
+
+  _.test("block comment", []() {
+    expect(extract_comment("/* caliber\n  -Dfoo\n  -Ubar\n*/\nint x;",
+                           "caliber"),
+           array("-Dfoo", "-Ubar"));
+    expect(extract_comment("/*\ncaliber -Dfoo */", "caliber"),
+           array("-Dfoo"));
+    expect(extract_comment("/* caliber -Dfoo", "caliber"), equal_to(no_args));
+  });
+
+  _.test("quoting", []() {
+    expect(extract_comment("// caliber -n 'my test' \"a b\"c d\\ e\n",
+                           "caliber"),
+           array("-n", "my test", "a bc", "d e"));
+    expect(extract_comment("// caliber ''\n", "caliber"), array(""));
+  });
+
+  _.test("no comment", []() {
+    expect(extract_comment("", "caliber"), equal_to(no_args));
+    expect(extract_comment("int x;", "caliber"), equal_to(no_args));
+    expect(extract_comment("// other -Dfoo\n", "caliber"),
+           equal_to(no_args));
+    expect(extract_comment("// caliberx -Dfoo\n", "caliber"),
+           equal_to(no_args));
+    expect(extract_comment("\n// caliber -Dfoo\n", "caliber"),
+           equal_to(no_args));
+  });
+
+  _.test("stream", []() {
+    std::istringstream short_ss("// caliber -Dfoo\n");
+    expect(extract_comment(short_ss, "caliber"), array("-Dfoo"));
+
+    // Make the comment span several chunks.
+    std::string long_comment = "/* caliber";
+    for(int i = 0; i != 1000; i++)
+      long_comment += " -Dfoo" + std::to_string(i);
+    long_comment += " */\nint x;\n";
+    std::istringstream long_ss(long_comment);
+    auto args = extract_comment(long_ss, "caliber");
+    expect(args.size(), equal_to(1000u));
+    expect(args.back(), equal_to("-Dfoo999"));
+  });
+});
+
+suite<> test_split_cases("split_test_cases()", [](auto &_) {
+  using caliber::split_test_cases;
+
+  _.test("no cases", []() {
+    auto split = split_test_cases("// caliber --cases\nint x;\n");
+    expect(split.preamble, equal_to("// caliber --cases\nint x;\n"));
+    expect(split.cases.size(), equal_to(0u));
+  });
+
+  _.test("several cases", []() {
+    auto split = split_test_cases(
+      "// caliber --cases\n#include <vector>\n"
+      "// caliber-case -n first\nint x;\n"
+      "//caliber-case -F\r\nint y = z;\n\n"
+      "// caliber-case"
+    );
+    expect(split.preamble, equal_to("// caliber --cases\n#include <vector>\n"));
+    expect(split.cases.size(), equal_to(3u));
+
+    expect(split.cases[0].args, array("-n", "first"));
+    expect(split.cases[0].line, equal_to(3u));
+    expect(split.cases[0].body, equal_to("int x;\n"));
+
+    expect(split.cases[1].args, array("-F"));
+    expect(split.cases[1].line, equal_to(5u));
+    expect(split.cases[1].body, equal_to("int y = z;\n\n"));
+
+    expect(split.cases[2].args.size(), equal_to(0u));
+    expect(split.cases[2].line, equal_to(8u));
+    expect(split.cases[2].body, equal_to(""));
+  });
+
+  _.test("not markers", []() {
+    auto split = split_test_cases(
+      "  // caliber-case -F\n// caliber-cases\n/* caliber-case */\n"
+    );
+    expect(split.cases.size(), equal_to(0u));
+  });
+});
+
+suite<> test_matrix("--matrix", [](auto &_) {
+  auto parse = [](std::vector<std::string> args) {
+    namespace opts = boost::program_options;
+    caliber::per_file_options options;
+    opts::variables_map vm;
+    opts::store(opts::command_line_parser(args).options(
+      caliber::make_per_file_options(options)
+    ).run(), vm);
+    opts::notify(vm);
+    return options.matrix;
+  };
+
+  _.test("parse", [parse]() {
+    auto matrix = parse({"--matrix", "std=c++17,c++20", "--matrix=-D=FOO=1"});
+    expect(matrix.size(), equal_to(2u));
+    expect(matrix[0].key, equal_to("std"));
+    expect(matrix[0].values, array("c++17", "c++20"));
+    expect(matrix[1].key, equal_to("D"));
+    expect(matrix[1].values, array("FOO=1"));
+
+    using bad_value = boost::program_options::invalid_option_value;
+    expect([parse]() { parse({"--matrix", "std"}); }, thrown<bad_value>());
+    expect([parse]() { parse({"--matrix", "std="}); }, thrown<bad_value>());
+    expect([parse]() { parse({"--matrix", "std=a,,b"}); },
+           thrown<bad_value>());
+    expect([parse]() { parse({"--matrix", "foo=a"}); }, thrown<bad_value>());
+  });
+
+  _.test("expand", []() {
+    auto none = caliber::expand_matrix({});
+    expect(none.size(), equal_to(1u));
+    expect(none[0].label, equal_to(""));
+    expect(none[0].args.size(), equal_to(0u));
+
+    auto instances = caliber::expand_matrix({
+      {"std", {"c++17", "c++20"}}, {"D", {"A", "B=1"}}
+    });
+    expect(instances.size(), equal_to(4u));
+    expect(instances[0].label, equal_to("std=c++17, D=A"));
+    expect(instances[1].label, equal_to("std=c++17, D=B=1"));
+    expect(instances[2].label, equal_to("std=c++20, D=A"));
+    expect(instances[3].label, equal_to("std=c++20, D=B=1"));
+
+    expect(instances[1].args.size(), equal_to(2u));
+    expect(instances[1].args[0].string_key, equal_to("std"));
+    expect(instances[1].args[0].value, array("c++17"));
+    expect(instances[1].args[1].string_key, equal_to("-D"));
+    expect(instances[1].args[1].value, array("B=1"));
+  });
+});
+
+suite<> test_shard("--shard", [](auto &_) {
+  auto parse = [](std::string value) {
+    namespace opts = boost::program_options;
+    caliber::shard shard;
+    opts::options_description desc;
+    desc.add_options()("shard", opts::value(&shard));
+    opts::variables_map vm;
+    opts::store(opts::command_line_parser(
+      std::vector<std::string>{"--shard", value}
+    ).options(desc).run(), vm);
+    opts::notify(vm);
+    return shard;
+  };
+
+  _.test("parse", [parse]() {
+    auto shard = parse("1/8");
+    expect(shard.index, equal_to(0u));
+    expect(shard.count, equal_to(8u));
+    shard = parse("8/8");
+    expect(shard.index, equal_to(7u));
+    expect(shard.count, equal_to(8u));
+
+    using bad_value = boost::program_options::invalid_option_value;
+    expect([parse]() { parse("1"); }, thrown<bad_value>());
+    expect([parse]() { parse("0/8"); }, thrown<bad_value>());
+    expect([parse]() { parse("9/8"); }, thrown<bad_value>());
+    expect([parse]() { parse("1/8x"); }, thrown<bad_value>());
+    expect([parse]() { parse("/8"); }, thrown<bad_value>());
+  });
+
+  _.test("contains", []() {
+    std::vector<std::string> files;
+    for(int i = 0; i != 100; i++)
+      files.push_back("test/test_" + std::to_string(i) + ".cpp");
+
+    // Every file is in exactly one shard.
+    std::vector<std::size_t> sizes(8);
+    for(const auto &file : files) {
+      std::size_t found = 0;
+      for(std::size_t i = 0; i != sizes.size(); i++) {
+        if(caliber::shard{i, sizes.size()}.contains(file)) {
+          found++;
+          sizes[i]++;
+        }
+      }
+      expect(found, equal_to(1u));
+    }
+    for(auto i : sizes)
+      expect(i, is_not(0u));
+
+    // Equivalent paths are in the same shard.
+    for(std::size_t i = 0; i != sizes.size(); i++) {
+      caliber::shard shard{i, sizes.size()};
+      expect(shard.contains("./test/test_1.cpp"),
+             equal_to(shard.contains("test/test_1.cpp")));
+    }
+  });
+});
@@ -1,6 +1,9 @@
 #include <mettle.hpp>
 using namespace mettle;
 
+#include <filesystem>
+#include <fstream>
+
 #include "env_helper.hpp"
 #include "../src/compiler.hpp"
 
@@ -86,6 +89,76 @@ suite<test_env> test_compiler("compilers", [](auto &_) {
         caliber::make_compiler({"python", e.test_data + "/program.py"});
       }, thrown<std::runtime_error>("unable to determine compiler flavor"));
     });
+
+    _.test("explicit flavor", [](test_env &) {
+      auto c = caliber::make_compiler({"nonexist"}, {.flavor = "gcc"});
+      expect(c->brand, equal_to("gcc"));
+      expect(c->flavor, equal_to("cc"));
+
+      c = caliber::make_compiler({"nonexist"}, {.flavor = "cc"});
+      expect(c->brand, equal_to("unknown"));
+      expect(c->flavor, equal_to("cc"));
+
+      c = caliber::make_compiler({"nonexist"}, {.flavor = "clang-cl"});
+      expect(c->brand, equal_to("clang-cl"));
+      expect(c->flavor, equal_to("msvc"));
+
+      expect([]() {
+        caliber::make_compiler({"nonexist"}, {.flavor = "unknown"});
+      }, thrown<std::invalid_argument>("unknown compiler flavor \"unknown\""));
+      expect(caliber::known_flavor("clang-cl"), equal_to(true));
+      expect(caliber::known_flavor("unknown"), equal_to(false));
+    });
+
+    _.test("cached flavor", [](test_env &e) {
+      namespace fs = std::filesystem;
+      auto dir = fs::temp_directory_path() / "caliber-test-flavor-cache";
+      fs::remove_all(dir);
+
+      std::vector<std::string> cmd = {"python", e.test_data + "/g++.py"};
+      auto c = caliber::make_compiler(cmd, {.cache_dir = dir.string()});
+      expect(c->brand, equal_to("gcc"));
+      expect(c->flavor, equal_to("cc"));
+
+      // Replace the cached entry to make sure it's what we get next time.
+      std::vector<fs::path> entries(fs::directory_iterator(dir / "compilers"),
+                                    fs::directory_iterator());
+      expect(entries.size(), equal_to(1u));
+      std::ofstream(entries.front()) << "caliber-compiler 1\nclang\ncc\n"
+                                     << "clang 1.0\n";
+
+      c = caliber::make_compiler(cmd, {.cache_dir = dir.string()});
+      fs::remove_all(dir);
+      expect(c->brand, equal_to("clang"));
+      expect(c->flavor, equal_to("cc"));
+      expect(c->identity, equal_to("clang 1.0"));
+    });
+
+    _.test("cached flavor behind a wrapper", [](test_env &e) {
+      namespace fs = std::filesystem;
+      auto dir = fs::temp_directory_path() / "caliber-test-flavor-wrapper";
+      fs::remove_all(dir);
+      fs::create_directories(dir);
+      auto script = dir / "g++.py";
+      fs::copy_file(e.test_data + "/g++.py", script);
+
+      std::vector<std::string> cmd = {"python", script.string()};
+      auto c = caliber::make_compiler(cmd, {.cache_dir = dir.string()});
+      expect(c->brand, equal_to("gcc"));
+
+      std::vector<fs::path> entries(fs::directory_iterator(dir / "compilers"),
+                                    fs::directory_iterator());
+      expect(entries.size(), equal_to(1u));
+      std::ofstream(entries.front()) << "caliber-compiler 1\nclang\ncc\n"
+                                     << "clang 1.0\n";
+
+      // Changing the wrapped compiler should invalidate the cached entry,
+      // even though the wrapper (`python`) is the same.
+      std::ofstream(script, std::ios::app) << "# upgraded\n";
+      c = caliber::make_compiler(cmd, {.cache_dir = dir.string()});
+      fs::remove_all(dir);
+      expect(c->brand, equal_to("gcc"));
+    });
   });
 
   subsuite<compiler_ptr>(_, "translate args (cc)", [](auto &_) {
@@ -121,6 +194,194 @@ suite<test_env> test_compiler("compilers", [](auto &_) {
         equal_cmd(c, {"-Wall", "-fsyntax-only", "src.cpp"})
       );
     });
+
+    _.test("depfile", [](test_env &, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.depfile = "src.d"}),
+             equal_cmd(c, {"-MD", "-MF", "src.d", "-fsyntax-only", "src.cpp"}));
+    });
+
+    _.test("multiple sources", [](test_env &, compiler_ptr &c) {
+      std::vector<std::string> srcs = {"a.cpp", "b.cpp"};
+      expect(c->translate_args(srcs, {{"-D", {"foo"}}}, {}),
+             equal_cmd(c, {"-Dfoo", "-fsyntax-only", "a.cpp", "b.cpp"}));
+    });
+
+    _.test("list dependencies", [](test_env &, compiler_ptr &c) {
+      std::vector<std::string> srcs = {"a.cpp", "b.cpp"};
+      auto args = c->translate_deps_args(srcs, {{"-D", {"foo"}}}, {});
+      expect(args, is_not(std::nullopt));
+      expect(*args, equal_cmd(c, {"-Dfoo", "-M", "a.cpp", "b.cpp"}));
+    });
+
+    _.test("stdin", [](test_env &, compiler_ptr &c) {
+      expect(c->reads_stdin(), equal_to(true));
+      expect(c->translate_args("dir/src.cpp", {{"-I", {"include"}}}, {},
+                               {.from_stdin = true}),
+             equal_cmd(c, {"-Idir/include", "-fsyntax-only", "-x", "c++",
+                           "-"}));
+      expect(c->translate_args("src.c", {}, {}, {.from_stdin = true}),
+             equal_cmd(c, {"-fsyntax-only", "-x", "c", "-"}));
+    });
+
+    _.test("fatal errors", [](test_env &, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.fatal_errors = true}),
+             equal_cmd(c, {"-fsyntax-only", "-Wfatal-errors", "src.cpp"}));
+    });
+
+    _.test("profile", [](test_env &e, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.profile = "src.json"}),
+             equal_cmd(c, {"-ftime-report", "-fsyntax-only", "src.cpp"}));
+
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang++.py"});
+      expect(clang->translate_args("src.cpp", {}, {},
+                                   {.profile = "src.json"}),
+             equal_cmd(clang, {"-ftime-trace=src.json", "-fsyntax-only",
+                               "src.cpp"}));
+    });
+
+    _.test("can profile", [](test_env &e, compiler_ptr &c) {
+      expect(c->can_profile(), equal_to(true));
+
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang++.py"});
+      expect(clang->can_profile(), equal_to(true));
+
+      // Older versions of clang can't say where to write the trace.
+      auto old_clang = caliber::make_compiler({
+        "python", e.test_data + "/clang++.py", "--fake-version=15.0.7"
+      });
+      expect(old_clang->can_profile(), equal_to(false));
+
+      auto cc = caliber::make_compiler({"python", e.test_data + "/c++.py"});
+      expect(cc->can_profile(), equal_to(false));
+    });
+
+    _.test("prelude", [](test_env &, compiler_ptr &c) {
+      caliber::precompiled_header pch{"pre.hpp", "pre.hpp.cpp", "pre.hpp.gch"};
+      expect(c->translate_args("src.cpp", {}, {}, {.prelude = pch}),
+             equal_cmd(c, {"-include", "pre.hpp", "-fsyntax-only",
+                           "src.cpp"}));
+    });
+
+    _.test("precompiled header", [](test_env &e, compiler_ptr &c) {
+      expect(c->pch_path("pre.hpp"), equal_to("pre.hpp.gch"));
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang++.py"});
+      expect(clang->pch_path("pre.hpp"), equal_to("pre.hpp.pch"));
+
+      caliber::precompiled_header pch{"pre.hpp", "pre.hpp.cpp", "pre.hpp.gch"};
+      expect(c->translate_pch_args("src.cpp", pch, {{"-D", {"foo"}}}, {}),
+             equal_cmd(c, {"-Dfoo", "-x", "c++-header", "pre.hpp", "-o",
+                           "pre.hpp.gch"}));
+      expect(c->translate_pch_args("src.cpp", pch, {}, {},
+                                   {.depfile = "pre.d"}),
+             equal_cmd(c, {"-MD", "-MF", "pre.d", "-x", "c++-header",
+                           "pre.hpp", "-o", "pre.hpp.gch"}));
+    });
+  });
+
+  subsuite<compiler_ptr>(_, "read dependencies (cc)", [](auto &_) {
+    _.setup([](test_env &e, compiler_ptr &c) {
+      c = caliber::make_compiler({"python", e.test_data + "/g++.py"});
+    });
+
+    _.test("no depfile", [](test_env &, compiler_ptr &c) {
+      std::string output;
+      expect(c->read_dependencies({}, output), equal_to(std::nullopt));
+    });
+
+    _.test("missing depfile", [](test_env &, compiler_ptr &c) {
+      std::string output;
+      expect(c->read_dependencies({.depfile = "nonexist.d"}, output),
+             equal_to(std::nullopt));
+    });
+
+    _.test("depfile", [](test_env &, compiler_ptr &c) {
+      auto depfile = (std::filesystem::temp_directory_path() /
+                      "caliber-test-depfile.d").string();
+      std::ofstream(depfile) << "src.o: src.cpp /usr/include/a.h \\\n"
+                             << " dir/with\\ space.h C:/win/path.h \\\n"
+                             << " dollar$$.h\n";
+      std::string output = "output";
+      auto deps = c->read_dependencies({.depfile = depfile}, output);
+      std::filesystem::remove(depfile);
+
+      expect(deps, is_not(std::nullopt));
+      expect(*deps, array("src.cpp", "/usr/include/a.h", "dir/with space.h",
+                          "C:/win/path.h", "dollar$.h"));
+      expect(output, equal_to("output"));
+    });
+
+    _.test("dependency list", [](test_env &, compiler_ptr &c) {
+      std::vector<std::string> srcs = {"a.cpp", "b.cpp"};
+      std::string output = "a.o: a.cpp /usr/include/a.h \\\n"
+                           " common.h\n"
+                           "b.o: b.cpp \\\r\n"
+                           " /usr/include/b.h common.h\n";
+      auto deps = c->read_deps_list(srcs, output);
+      expect(deps, is_not(std::nullopt));
+      expect(deps->size(), equal_to(2u));
+      expect((*deps)[0], array("a.cpp", "/usr/include/a.h", "common.h"));
+      expect((*deps)[1], array("b.cpp", "/usr/include/b.h", "common.h"));
+
+      expect(c->read_deps_list(srcs, "a.o: a.cpp common.h\n"),
+             equal_to(std::nullopt));
+    });
+  });
+
+  subsuite<compiler_ptr>(_, "read profile (cc)", [](auto &_) {
+    _.setup([](test_env &e, compiler_ptr &c) {
+      c = caliber::make_compiler({"python", e.test_data + "/g++.py"});
+    });
+
+    _.test("no profile", [](test_env &, compiler_ptr &c) {
+      std::string out, err = "Time variable\n";
+      expect(c->read_profile({}, out, err).has_value(), equal_to(false));
+      expect(err, equal_to("Time variable\n"));
+    });
+
+    _.test("time report", [](test_env &, compiler_ptr &c) {
+      std::string out,
+        err = "warning\n\n"
+              "Time variable                   usr           sys          "
+              "wall           GGC\n"
+              " phase parsing      :   0.14 ( 82%)   0.05 ( 83%)   0.19 ( 83%)"
+              "  12M ( 85%)\n"
+              " name lookup        :   0.00 (  0%)   0.00 (  0%)   0.00 (  0%)"
+              "   1k (  0%)\n"
+              " TOTAL              :   0.17          0.06          0.23      "
+              "   14M\n";
+      auto profile = c->read_profile({.profile = "src.json"}, out, err);
+      expect(profile.has_value(), equal_to(true));
+      expect(profile->size(), equal_to(1u));
+      expect((*profile)[0].name, equal_to("phase parsing"));
+      expect((*profile)[0].seconds, equal_to(0.19));
+      expect(err, equal_to("warning\n"));
+    });
+
+    _.test("time trace", [](test_env &e, compiler_ptr &) {
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang++.py"});
+      auto trace = (std::filesystem::temp_directory_path() /
+                    "caliber-test-trace.json").string();
+      std::ofstream(trace) << R"({"traceEvents": [
+        {"name": "Source", "dur": 2000, "args": {"detail": "a.hpp"}},
+        {"name": "InstantiateClass", "dur": 500, "args": {"detail": "A<int>"}},
+        {"name": "Total Frontend", "dur": 3000, "args": {"count": 1}},
+        {"name": "ParseClass", "dur": 100, "args": {"detail": "B"}}
+      ]})";
+      std::string out, err;
+      auto profile = clang->read_profile({.profile = trace}, out, err);
+      std::filesystem::remove(trace);
+
+      expect(profile.has_value(), equal_to(true));
+      expect(profile->size(), equal_to(3u));
+      expect((*profile)[0].name, equal_to("a.hpp"));
+      expect((*profile)[0].seconds, equal_to(0.002));
+      expect((*profile)[1].name, equal_to("A<int>"));
+      expect((*profile)[2].name, equal_to("Frontend"));
+    });
   });
 
   subsuite<compiler_ptr>(_, "translate args (msvc)", [](auto &_) {
@@ -156,5 +417,114 @@ suite<test_env> test_compiler("compilers", [](auto &_) {
         equal_cmd(c, {"/WX", "/Zs", "src.cpp"})
       );
     });
+
+    _.test("depfile", [](test_env &, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.depfile = "src.d"}),
+             equal_cmd(c, {"/showIncludes", "/Zs", "src.cpp"}));
+    });
+
+    _.test("multiple sources", [](test_env &, compiler_ptr &c) {
+      std::vector<std::string> srcs = {"a.cpp", "b.cpp"};
+      expect(c->translate_args(srcs, {{"-D", {"foo"}}}, {}),
+             equal_cmd(c, {"/Dfoo", "/Zs", "a.cpp", "b.cpp"}));
+    });
+
+    _.test("list dependencies", [](test_env &, compiler_ptr &c) {
+      expect(c->translate_deps_args({"a.cpp", "b.cpp"}, {}, {}),
+             equal_to(std::nullopt));
+    });
+
+    _.test("stdin", [](test_env &, compiler_ptr &c) {
+      expect(c->reads_stdin(), equal_to(false));
+    });
+
+    _.test("fatal errors", [](test_env &e, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.fatal_errors = true}),
+             equal_cmd(c, {"/Zs", "src.cpp"}));
+
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang-cl.py"});
+      expect(clang->translate_args("src.cpp", {}, {}, {.fatal_errors = true}),
+             equal_cmd(clang, {"/Zs", "/clang:-Wfatal-errors", "src.cpp"}));
+    });
+
+    _.test("profile", [](test_env &e, compiler_ptr &c) {
+      expect(c->translate_args("src.cpp", {}, {}, {.profile = "src.json"}),
+             equal_cmd(c, {"/d1reportTime", "/Zs", "src.cpp"}));
+
+      auto clang = caliber::make_compiler({"python",
+                                           e.test_data + "/clang-cl.py"});
+      expect(clang->translate_args("src.cpp", {}, {},
+                                   {.profile = "src.json"}),
+             equal_cmd(clang, {"/clang:-ftime-trace=src.json", "/Zs",
+                               "src.cpp"}));
+    });
+
+    _.test("prelude", [](test_env &, compiler_ptr &c) {
+      caliber::precompiled_header pch{"pre.hpp", "pre.hpp.cpp", "pre.hpp.pch"};
+      expect(c->translate_args("src.cpp", {}, {}, {.prelude = pch}),
+             equal_cmd(c, {"/Yupre.hpp", "/FIpre.hpp", "/Fppre.hpp.pch",
+                           "/Zs", "src.cpp"}));
+    });
+
+    _.test("precompiled header", [](test_env &, compiler_ptr &c) {
+      expect(c->pch_path("pre.hpp"), equal_to("pre.hpp.pch"));
+
+      caliber::precompiled_header pch{"pre.hpp", "pre.hpp.cpp", "pre.hpp.pch"};
+      expect(c->translate_pch_args("src.cpp", pch, {{"-D", {"foo"}}}, {}),
+             equal_cmd(c, {"/Dfoo", "/Ycpre.hpp", "/Fppre.hpp.pch",
+                           "/Fopre.hpp.pch.obj", "/c", "pre.hpp.cpp"}));
+    });
+  });
+
+  subsuite<compiler_ptr>(_, "read dependencies (msvc)", [](auto &_) {
+    _.setup([](test_env &e, compiler_ptr &c) {
+      c = caliber::make_compiler({"python", e.test_data + "/cl.py"});
+    });
+
+    _.test("no depfile", [](test_env &, compiler_ptr &c) {
+      std::string output = "Note: including file: foo.h\n";
+      expect(c->read_dependencies({}, output), equal_to(std::nullopt));
+      expect(output, equal_to("Note: including file: foo.h\n"));
+    });
+
+    _.test("show includes", [](test_env &, compiler_ptr &c) {
+      std::string output = "src.cpp\r\n"
+                           "Note: including file: C:\\inc\\a.h\r\n"
+                           "Note: including file:  C:\\inc\\b.h\r\n"
+                           "warning\r\n";
+      auto deps = c->read_dependencies({.depfile = "src.d"}, output);
+      expect(deps, is_not(std::nullopt));
+      expect(*deps, array("C:\\inc\\a.h", "C:\\inc\\b.h"));
+      expect(output, equal_to("src.cpp\r\nwarning\r\n"));
+    });
+  });
+
+  subsuite<compiler_ptr>(_, "read profile (msvc)", [](auto &_) {
+    _.setup([](test_env &e, compiler_ptr &c) {
+      c = caliber::make_compiler({"python", e.test_data + "/cl.py"});
+    });
+
+    _.test("report time", [](test_env &, compiler_ptr &c) {
+      std::string err,
+        out = "src.cpp\n"
+              "Include Headers:\n"
+              "\tCount: 2\n"
+              "\t\tC:\\inc\\a.h: 0.250000s\n"
+              "\t\t\tC:\\inc\\b.h: 0.125000s\n"
+              "\tTotal: 0.250000s\n"
+              "Class Definitions:\n"
+              "\tCount: 1\n"
+              "\t\tstd::vector<int>: 0.001000s\n"
+              "\tTotal: 0.001000s\n"
+              "warning\n";
+      auto profile = c->read_profile({.profile = "src.json"}, out, err);
+      expect(profile.has_value(), equal_to(true));
+      expect(profile->size(), equal_to(3u));
+      expect((*profile)[0].name, equal_to("C:\\inc\\a.h"));
+      expect((*profile)[0].seconds, equal_to(0.25));
+      expect((*profile)[2].name, equal_to("std::vector<int>"));
+      expect(out, equal_to("src.cpp\nwarning\n"));
+    });
   });
 });
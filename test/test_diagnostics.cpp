@@ -0,0 +1,112 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include "../src/diagnostics.hpp"
+
+auto error_at(std::string_view file, std::size_t line,
+              std::string_view message) {
+  return make_matcher(
+    [file, line, message](const std::optional<caliber::diagnostic> &d) {
+      return d && d->file == file && d->line == line && d->message == message;
+    }, "error at " + std::string(file) + ":" + std::to_string(line) + ": " +
+    std::string(message)
+  );
+}
+
+auto no_error() {
+  return make_matcher([](const std::optional<caliber::diagnostic> &d) {
+    return !d;
+  }, "no error");
+}
+
+suite<> test_parse_error("parse_error()", [](auto &_) {
+  using caliber::parse_error;
+
+  _.test("cc", []() {
+    expect(parse_error("src.cpp:3:7: error: 'string' is not a member of 'std'"),
+           error_at("src.cpp", 3, "'string' is not a member of 'std'"));
+    expect(parse_error("src.cpp:3: error: message"),
+           error_at("src.cpp", 3, "message"));
+    expect(parse_error("dir/src.cpp:10:1: fatal error: foo.h: No such file"),
+           error_at("dir/src.cpp", 10, "foo.h: No such file"));
+    expect(parse_error("C:\\dir\\src.cpp:3:7: error: message\r"),
+           error_at("C:\\dir\\src.cpp", 3, "message"));
+  });
+
+  _.test("msvc", []() {
+    expect(parse_error("src.cpp(3): error C2039: 'string': is not a member"),
+           error_at("src.cpp", 3, "'string': is not a member"));
+    expect(parse_error("C:\\src.cpp(3,7): error C2065: message"),
+           error_at("C:\\src.cpp", 3, "message"));
+    expect(parse_error("src.cpp(3): fatal error C1083: message"),
+           error_at("src.cpp", 3, "message"));
+  });
+
+  _.test("no location", []() {
+    expect(parse_error("error: unrecognized option '-foo'"),
+           error_at("", 0, "unrecognized option '-foo'"));
+    expect(parse_error("cc1plus: error: message"),
+           error_at("cc1plus", 0, "message"));
+  });
+
+  _.test("not an error", []() {
+    expect(parse_error(""), no_error());
+    expect(parse_error("src.cpp:3:7: warning: unused variable 'error'"),
+           no_error());
+    expect(parse_error("src.cpp:3:7: note: in the error handler"), no_error());
+    expect(parse_error("    3 |   error_count++;"), no_error());
+    expect(parse_error("1 error generated."), no_error());
+  });
+});
+
+suite<> test_matcher("diagnostic_matcher", [](auto &_) {
+  using caliber::diagnostic_matcher;
+  using caliber::expected_error;
+
+  _.test("any error", []() {
+    expected_error e;
+    diagnostic_matcher m(e);
+    expect(m.scan("", "src.cpp:1:1: warning: message\n"), equal_to(false));
+    expect(m.scan("", "src.cpp:1:1: warning: message\n"
+                      "src.cpp:2:1: error: message\n"), equal_to(true));
+    expect(m.matched(), equal_to(true));
+  });
+
+  _.test("partial lines", []() {
+    expected_error e{std::regex("not a member"), "not a member", 0, ""};
+    diagnostic_matcher m(e);
+    std::string err = "src.cpp:3:7: error: 'string' is not";
+    expect(m.scan("", err), equal_to(false));
+    err += " a member\n";
+    expect(m.scan("", err), equal_to(true));
+
+    diagnostic_matcher m2(e);
+    expect(m2.scan("", "src.cpp:3:7: error: 'string' is not a member"),
+           equal_to(false));
+    expect(m2.scan("", "src.cpp:3:7: error: 'string' is not a member", true),
+           equal_to(true));
+  });
+
+  _.test("message", []() {
+    expected_error e{std::regex("not a member"), "not a member", 0, ""};
+    expect(diagnostic_matcher(e).scan(
+      "", "src.cpp:3:7: error: expected ';'\n", true
+    ), equal_to(false));
+    expect(diagnostic_matcher(e).scan(
+      "src.cpp(3): error C2039: 'string': is not a member of 'std'\n", "", true
+    ), equal_to(true));
+  });
+
+  _.test("line", []() {
+    expected_error e{std::nullopt, "", 3, "dir/src.cpp"};
+    expect(diagnostic_matcher(e).scan(
+      "", "src.cpp:4:1: error: message\n", true
+    ), equal_to(false));
+    expect(diagnostic_matcher(e).scan(
+      "", "other.cpp:3:1: error: message\n", true
+    ), equal_to(false));
+    expect(diagnostic_matcher(e).scan(
+      "", "/abs/dir/src.cpp:3:1: error: message\n", true
+    ), equal_to(true));
+  });
+});
@@ -0,0 +1,130 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include "../src/discover.hpp"
+
+struct tree_fixture {
+  tree_fixture() {
+    std::random_device rd;
+    dir = std::filesystem::temp_directory_path() /
+      ("caliber-test-" + std::to_string(rd()));
+    for(const auto &i : {"b.cpp", "a.cpp", "notes.txt", "sub/c.cpp",
+                         "sub/deeper/d.cc", "other/e.cpp", ".git/f.cpp"}) {
+      auto path = dir / i;
+      std::filesystem::create_directories(path.parent_path());
+      std::ofstream(path) << "int main() {}\n";
+    }
+  }
+
+  ~tree_fixture() {
+    std::filesystem::remove_all(dir);
+  }
+
+  std::vector<std::string>
+  find(const std::vector<std::string> &inputs, std::size_t jobs = 4) {
+    std::vector<std::string> found;
+    caliber::find_test_files(inputs, jobs, [&](const std::string &file) {
+      found.push_back(std::filesystem::path(file).lexically_relative(dir)
+                      .generic_string());
+    });
+    return found;
+  }
+
+  std::filesystem::path dir;
+};
+
+suite<> test_glob("glob_match()", [](auto &_) {
+  using caliber::glob_match;
+
+  _.test("literal", []() {
+    expect(glob_match("a/b.cpp", "a/b.cpp"), equal_to(true));
+    expect(glob_match("a/b.cpp", "a/c.cpp"), equal_to(false));
+    expect(glob_match("a/b.cpp", "b.cpp"), equal_to(false));
+  });
+
+  _.test("wildcards", []() {
+    expect(glob_match("*.cpp", "test.cpp"), equal_to(true));
+    expect(glob_match("*.cpp", "test.hpp"), equal_to(false));
+    expect(glob_match("*.cpp", "dir/test.cpp"), equal_to(false));
+    expect(glob_match("t?st*.cpp", "test_one.cpp"), equal_to(true));
+    expect(glob_match("test_[ab].cpp", "test_b.cpp"), equal_to(true));
+    expect(glob_match("test_[!ab].cpp", "test_b.cpp"), equal_to(false));
+    expect(glob_match("test_[0-9].cpp", "test_5.cpp"), equal_to(true));
+  });
+
+  _.test("recursive", []() {
+    expect(glob_match("**/*.cpp", "test.cpp"), equal_to(true));
+    expect(glob_match("**/*.cpp", "a/b/test.cpp"), equal_to(true));
+    expect(glob_match("a/**/test.cpp", "a/test.cpp"), equal_to(true));
+    expect(glob_match("a/**/test.cpp", "a/b/c/test.cpp"), equal_to(true));
+    expect(glob_match("a/**/test.cpp", "b/test.cpp"), equal_to(false));
+  });
+
+  _.test("hidden", []() {
+    expect(glob_match("*.cpp", ".test.cpp"), equal_to(false));
+    expect(glob_match(".*.cpp", ".test.cpp"), equal_to(true));
+    expect(glob_match("**/*.cpp", ".git/test.cpp"), equal_to(false));
+    expect(glob_match(".git/*.cpp", ".git/test.cpp"), equal_to(true));
+  });
+});
+
+suite<tree_fixture> test_find("find_test_files()", [](auto &_) {
+  _.test("files", [](tree_fixture &f) {
+    expect(f.find({(f.dir / "b.cpp").string(),
+                   (f.dir / "notes.txt").string()}),
+           array("b.cpp", "notes.txt"));
+  });
+
+  _.test("directory", [](tree_fixture &f) {
+    expect(f.find({f.dir.string()}),
+           array("a.cpp", "b.cpp", "other/e.cpp", "sub/c.cpp",
+                 "sub/deeper/d.cc"));
+    expect(f.find({f.dir.string()}, 1),
+           array("a.cpp", "b.cpp", "other/e.cpp", "sub/c.cpp",
+                 "sub/deeper/d.cc"));
+  });
+
+  _.test("glob", [](tree_fixture &f) {
+    auto base = f.dir.generic_string();
+    expect(f.find({base + "/*.cpp"}), array("a.cpp", "b.cpp"));
+    expect(f.find({base + "/s*/*.cpp"}), array("sub/c.cpp"));
+    expect(f.find({base + "/**/*.c*"}),
+           array("a.cpp", "b.cpp", "other/e.cpp", "sub/c.cpp",
+                 "sub/deeper/d.cc"));
+  });
+
+  _.test("glob with no matches", [](tree_fixture &f) {
+    auto base = f.dir.generic_string();
+    expect(f.find({base + "/*.hpp"}), array());
+  });
+
+  _.test("empty globs", [](tree_fixture &f) {
+    using caliber::find_empty_glob;
+    auto base = f.dir.generic_string();
+    expect(find_empty_glob({base + "/*.cpp", base + "/**/*.cc",
+                            base + "/notes.txt"}),
+           equal_to(std::nullopt));
+    expect(find_empty_glob({base + "/*.cpp", base + "/*.hpp"}),
+           equal_to(base + "/*.hpp"));
+    expect(find_empty_glob({base + "/sub/*/*.cpp"}),
+           equal_to(base + "/sub/*/*.cpp"));
+    expect(find_empty_glob({base + "/**/f.cpp"}),
+           equal_to(base + "/**/f.cpp"));
+  });
+
+  _.test("errors", [](tree_fixture &f) {
+    for(std::size_t jobs : {1, 4}) {
+      expect([&]() {
+        caliber::find_test_files({f.dir.string()}, jobs,
+                                 [](const std::string &file) {
+          if(file.find("deeper") != std::string::npos)
+            throw std::logic_error("oops");
+        });
+      }, thrown<std::logic_error>("oops"));
+    }
+  });
+});
@@ -0,0 +1,73 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "../src/job_pool.hpp"
+
+suite<> test_job_pool("job_pool", [](auto &_) {
+  using caliber::job_pool;
+
+  _.test("submit", []() {
+    job_pool pool(2);
+    auto a = pool.submit([]() { return 1; });
+    auto b = pool.submit([]() { return 2; });
+    expect(a.get() + b.get(), equal_to(3));
+  });
+
+  _.test("priority", []() {
+    job_pool pool(1);
+    std::promise<void> started, resume;
+    std::mutex mutex;
+    std::vector<int> order;
+
+    // Keep the only worker busy until everything else has been submitted.
+    auto blocker = pool.submit([&]() {
+      started.set_value();
+      resume.get_future().wait();
+    });
+    started.get_future().wait();
+
+    std::vector<std::future<void>> jobs;
+    auto push = [&](int id, job_pool::priority_type priority) {
+      jobs.push_back(pool.submit([&mutex, &order, id]() {
+        std::lock_guard lock(mutex);
+        order.push_back(id);
+      }, priority));
+    };
+    push(1, 0);
+    push(2, 10);
+    push(3, 5);
+    push(4, 10);
+    push(5, 0);
+
+    resume.set_value();
+    blocker.get();
+    for(auto &i : jobs)
+      i.get();
+    expect(order, equal_to(std::vector<int>{2, 4, 3, 1, 5}));
+  });
+
+  _.test("held", []() {
+    job_pool pool(1, true);
+    std::mutex mutex;
+    std::vector<int> order;
+
+    std::vector<std::future<void>> jobs;
+    for(int i = 0; i != 3; i++) {
+      jobs.push_back(pool.submit([&mutex, &order, i]() {
+        std::lock_guard lock(mutex);
+        order.push_back(i);
+      }, i));
+    }
+    expect(jobs.front().wait_for(std::chrono::milliseconds(50)) ==
+           std::future_status::timeout, equal_to(true));
+
+    pool.release();
+    for(auto &i : jobs)
+      i.get();
+    expect(order, equal_to(std::vector<int>{2, 1, 0}));
+  });
+});
@@ -0,0 +1,75 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <random>
+
+#include "../src/files.hpp"
+#include "../src/output_capture.hpp"
+
+suite<> test_output_capture("output_capture", [](auto &_) {
+  using caliber::output_capture;
+
+  _.test("no limit", []() {
+    std::string log;
+    output_capture capture(log);
+    capture.append("hello ");
+    capture.append("world\n");
+    capture.finish();
+    expect(log, equal_to("hello world\n"));
+    expect(capture.dropped(), equal_to(0u));
+  });
+
+  _.test("under the limit", []() {
+    std::string log;
+    output_capture capture(log, 12);
+    capture.append("hello ");
+    expect(log, equal_to("hello "));
+    capture.append("world\n");
+    capture.finish();
+    expect(log, equal_to("hello world\n"));
+    expect(capture.dropped(), equal_to(0u));
+  });
+
+  _.test("over the limit", []() {
+    std::string log;
+    output_capture capture(log, 16);
+    capture.append("one\ntwo\nthree\n");
+    expect(log, equal_to("one\ntwo\n"));
+    capture.append("four\nfive\n");
+    capture.finish();
+    expect(log, equal_to("one\ntwo\ncaliber: dropped 11 bytes of output\n"
+                         "five\n"));
+    expect(capture.dropped(), equal_to(11u));
+  });
+
+  _.test("lots of output", []() {
+    std::string log;
+    output_capture capture(log, 16);
+    for(int i = 0; i != 1000; i++)
+      capture.append("line\n");
+    capture.finish();
+    expect(log, equal_to("line\ncaliber: dropped 4990 bytes of output\n"
+                         "line\n"));
+  });
+
+  _.test("spill", []() {
+    std::random_device rd;
+    auto path = (std::filesystem::temp_directory_path() /
+                 ("caliber-test-" + std::to_string(rd()))).string();
+
+    std::string log;
+    output_capture capture(log, 16, path);
+    capture.append("one\ntwo\n");
+    expect(std::filesystem::exists(path), equal_to(false));
+    capture.append("three\nfour\nfive\n");
+    capture.append("six\n");
+    capture.finish();
+
+    expect(log, equal_to("one\ntwo\ncaliber: dropped 16 bytes of output; "
+                         "see " + path + "\nsix\n"));
+    expect(caliber::read_file(path),
+           equal_to("one\ntwo\nthree\nfour\nfive\nsix\n"));
+    std::filesystem::remove(path);
+  });
+});
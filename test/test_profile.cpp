@@ -0,0 +1,54 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <random>
+
+#include "../src/files.hpp"
+#include "../src/profile.hpp"
+
+using kind = caliber::profile_entry::kind;
+
+suite<> test_profile("profiles", [](auto &_) {
+  _.test("describe_profile()", []() {
+    caliber::compile_profile profile = {
+      {kind::header, "a.hpp", 0.5},
+      {kind::header, "b.hpp", 2.0},
+      {kind::header, "c.hpp", 1.0},
+      {kind::instantiation, "f<int>", 0.25},
+      {kind::instantiation, "f<int>", 0.25},
+    };
+    expect(caliber::describe_profile(profile, 2), equal_to(
+      "slowest headers:\n"
+      "     2.000 s  b.hpp\n"
+      "     1.000 s  c.hpp\n"
+      "slowest template instantiations:\n"
+      "     0.500 s  f<int>\n"
+    ));
+    expect(caliber::describe_profile({}, 2), equal_to(""));
+  });
+
+  _.test("profile_summary", []() {
+    std::random_device rd;
+    auto path = (std::filesystem::temp_directory_path() /
+                 ("caliber-test-" + std::to_string(rd()))).string();
+
+    caliber::profile_summary summary;
+    summary.add({{kind::header, "a.hpp", 1.0}, {kind::phase, "Frontend", 2.0},
+                 {kind::header, "a.hpp", 1.0}});
+    summary.add({{kind::header, "a.hpp", 0.5}, {kind::header, "b.hpp", 3.0}});
+    summary.write(path);
+    auto contents = caliber::read_file(path);
+    std::filesystem::remove(path);
+
+    expect(contents, equal_to(
+      "Slowest headers (total time, tests):\n"
+      "       3.000 s       1  b.hpp\n"
+      "       2.500 s       2  a.hpp\n"
+      "\n"
+      "Slowest compiler phases (total time, tests):\n"
+      "       2.000 s       1  Frontend\n"
+      "\n"
+    ));
+  });
+});
@@ -0,0 +1,184 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include "../src/result_cache.hpp"
+
+struct dummy_compiler : caliber::compiler {
+  dummy_compiler(std::string identity = "dummy 1.0")
+    : compiler({"dummy"}, "dummy", "cc", std::move(identity)) {}
+
+  bool can_profile() const override {
+    return false;
+  }
+
+  std::vector<std::string>
+  translate_args(const std::vector<std::string> &srcs,
+                 const caliber::compiler_options &,
+                 const caliber::raw_options &,
+                 const caliber::translate_options & = {}) const override {
+    std::vector<std::string> result = {"dummy"};
+    result.insert(result.end(), srcs.begin(), srcs.end());
+    return result;
+  }
+
+  std::string pch_path(const std::string &header) const override {
+    return header + ".pch";
+  }
+
+  std::vector<std::string>
+  translate_pch_args(const std::string &, const caliber::precompiled_header &,
+                     const caliber::compiler_options &,
+                     const caliber::raw_options &,
+                     const caliber::translate_options & = {}) const override {
+    return {"dummy"};
+  }
+
+  std::optional<std::vector<std::string>>
+  read_dependencies(const caliber::translate_options &,
+                    std::string &) const override {
+    return std::nullopt;
+  }
+
+  std::optional<caliber::compile_profile>
+  read_profile(const caliber::translate_options &, std::string &,
+               std::string &) const override {
+    return std::nullopt;
+  }
+};
+
+struct cache_fixture {
+  cache_fixture() {
+    std::random_device rd;
+    dir = std::filesystem::temp_directory_path() /
+      ("caliber-test-" + std::to_string(rd()));
+    std::filesystem::create_directories(dir);
+    src = (dir / "src.cpp").string();
+    write_src("int main() {}\n");
+  }
+
+  ~cache_fixture() {
+    std::filesystem::remove_all(dir);
+  }
+
+  void write_src(const std::string &contents) {
+    std::ofstream(src, std::ios::binary) << contents;
+  }
+
+  std::filesystem::path dir;
+  std::string src;
+};
+
+suite<cache_fixture> test_result_cache("result cache", [](auto &_) {
+  _.test("key", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    dummy_compiler c;
+    auto key = cache.key(c, f.src, {"dummy", f.src}, false);
+    expect(key, is_not(std::nullopt));
+
+    expect(cache.key(c, f.src, {"dummy", f.src}, false), equal_to(key));
+    expect(cache.key(c, f.src, {"dummy", f.src}, true), is_not(key));
+    expect(cache.key(c, f.src, {"dummy", "-DFOO", f.src}, false),
+           is_not(key));
+    expect(cache.key(dummy_compiler("dummy 2.0"), f.src, {"dummy", f.src},
+                     false), is_not(key));
+
+    f.write_src("int main() { return 0; }\n");
+    expect(cache.key(c, f.src, {"dummy", f.src}, false), is_not(key));
+  });
+
+  _.test("missing source", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    expect(cache.key(dummy_compiler(), (f.dir / "nonexist.cpp").string(),
+                     {}, false), equal_to(std::nullopt));
+  });
+
+  _.test("in-memory source", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    dummy_compiler c;
+    auto missing = (f.dir / "nonexist.cpp").string();
+    auto key = cache.key(c, missing, {"dummy", "-"}, false,
+                         "int main() {}\n");
+    expect(key, is_not(std::nullopt));
+    expect(cache.key(c, f.src, {"dummy", "-"}, false, "int main() {}\n"),
+           equal_to(key));
+    expect(cache.key(c, missing, {"dummy", "-"}, false, "int x;\n"),
+           is_not(key));
+  });
+
+  _.test("store and load", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    expect(cache.load("0123456789abcdef").has_value(), equal_to(false));
+
+    cache.store("0123456789abcdef", {std::nullopt, {"out\n", ""}}, {});
+    auto passed = cache.load("0123456789abcdef");
+    expect(passed.has_value(), equal_to(true));
+    expect(passed->result.has_value(), equal_to(false));
+    expect(passed->output.stdout_log, equal_to("out\n"));
+    expect(passed->output.stderr_log, equal_to(""));
+
+    cache.store("fedcba9876543210", {
+      test_failure{ .message = "Compilation failed" }, {"", "error\n\n"}
+    }, {});
+    auto failed = cache.load("fedcba9876543210");
+    expect(failed.has_value(), equal_to(true));
+    expect(failed->result->message, equal_to("Compilation failed"));
+    expect(failed->output.stderr_log, equal_to("error\n\n"));
+    expect(failed->usage.has_value(), equal_to(false));
+  });
+
+  _.test("resource usage", [](cache_fixture &f) {
+    using namespace std::chrono;
+    caliber::result_cache cache((f.dir / "cache").string());
+    caliber::resource_usage usage;
+    usage.user_time = microseconds(1500000);
+    usage.system_time = microseconds(250);
+    usage.max_rss = 123456789;
+    usage.minor_faults = 42;
+    usage.major_faults = 1;
+
+    cache.store("0123456789abcdef", {std::nullopt, {}, usage}, {});
+    auto loaded = cache.load("0123456789abcdef");
+    expect(loaded.has_value(), equal_to(true));
+    expect(loaded->usage.has_value(), equal_to(true));
+    expect(loaded->usage->user_time.count(), equal_to(1500000));
+    expect(loaded->usage->system_time.count(), equal_to(250));
+    expect(loaded->usage->max_rss, equal_to(123456789u));
+    expect(loaded->usage->minor_faults, equal_to(42u));
+    expect(loaded->usage->major_faults, equal_to(1u));
+  });
+
+  _.test("dependencies", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    auto header = (f.dir / "header.hpp").string();
+    std::ofstream(header) << "#pragma once\n";
+
+    cache.store("0123456789abcdef", {std::nullopt, {}}, {f.src, header});
+    expect(cache.load("0123456789abcdef").has_value(), equal_to(true));
+
+    // The cache remembers file stamps for the rest of the run, so use a new
+    // cache object to see the change.
+    std::ofstream(header) << "#pragma once\nint x;\n";
+    caliber::result_cache cache2((f.dir / "cache").string());
+    expect(cache2.load("0123456789abcdef").has_value(), equal_to(false));
+
+    std::filesystem::remove(header);
+    caliber::result_cache cache3((f.dir / "cache").string());
+    expect(cache3.load("0123456789abcdef").has_value(), equal_to(false));
+  });
+
+  _.test("touched dependencies", [](cache_fixture &f) {
+    caliber::result_cache cache((f.dir / "cache").string());
+    cache.store("0123456789abcdef", {std::nullopt, {}}, {f.src});
+
+    // Rewrite the file with the same contents but a new mtime.
+    std::filesystem::last_write_time(
+      f.src, std::filesystem::last_write_time(f.src) + std::chrono::hours(1)
+    );
+    caliber::result_cache cache2((f.dir / "cache").string());
+    expect(cache2.load("0123456789abcdef").has_value(), equal_to(true));
+  });
+});
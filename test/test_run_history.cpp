@@ -0,0 +1,86 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <filesystem>
+#include <random>
+
+#include "../src/run_history.hpp"
+
+struct history_fixture {
+  history_fixture() {
+    std::random_device rd;
+    dir = std::filesystem::temp_directory_path() /
+      ("caliber-test-" + std::to_string(rd()));
+    std::filesystem::create_directories(dir);
+    path = (dir / "history").string();
+  }
+
+  ~history_fixture() {
+    std::filesystem::remove_all(dir);
+  }
+
+  std::filesystem::path dir;
+  std::string path;
+};
+
+suite<history_fixture> test_run_history("run history", [](auto &_) {
+  using caliber::run_history;
+  using std::chrono::milliseconds;
+
+  _.test("key", [](history_fixture &) {
+    expect(run_history::key("g++", "test.cpp", "test"),
+           equal_to(run_history::key("g++", "./test.cpp", "test")));
+    expect(run_history::key("g++", "test.cpp", "test"),
+           is_not(run_history::key("clang++", "test.cpp", "test")));
+    expect(run_history::key("g++", "test.cpp", "test"),
+           is_not(run_history::key("g++", "test.cpp", "test (case 1)")));
+  });
+
+  _.test("empty", [](history_fixture &f) {
+    run_history history(f.path);
+    expect(history.last_duration("test").has_value(), equal_to(false));
+    history.save();
+    expect(std::filesystem::exists(f.path), equal_to(false));
+  });
+
+  _.test("save and load", [](history_fixture &f) {
+    {
+      run_history history(f.path);
+      history.record("fast", false, milliseconds(10));
+      history.record("slow", false, milliseconds(1000));
+      history.record("slow", true, milliseconds(2000));
+      history.record("cached", true);
+      history.save();
+    }
+
+    run_history history(f.path);
+    expect(history.last_duration("fast").value().count(), equal_to(10));
+    expect(history.failed("fast"), equal_to(false));
+    expect(history.last_duration("slow").value().count(), equal_to(2000));
+    expect(history.failed("slow"), equal_to(true));
+    expect(history.last_duration("cached").has_value(), equal_to(false));
+    expect(history.failed("cached"), equal_to(true));
+    expect(history.last_duration("new").has_value(), equal_to(false));
+    expect(history.failed("new"), equal_to(false));
+  });
+
+  _.test("keep the last duration", [](history_fixture &f) {
+    run_history history(f.path);
+    history.record("test", true, milliseconds(10));
+    history.record("test", false);
+    expect(history.last_duration("test").value().count(), equal_to(10));
+    expect(history.failed("test"), equal_to(false));
+  });
+
+  _.test("concurrent saves", [](history_fixture &f) {
+    run_history first(f.path), second(f.path);
+    first.record("first", false, milliseconds(1));
+    second.record("second", true, milliseconds(2));
+    first.save();
+    second.save();
+
+    run_history history(f.path);
+    expect(history.last_duration("first").value().count(), equal_to(1));
+    expect(history.last_duration("second").value().count(), equal_to(2));
+  });
+});
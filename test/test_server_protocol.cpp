@@ -0,0 +1,87 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <stdexcept>
+
+#include "../src/server_protocol.hpp"
+
+suite<> test_server_protocol("server protocol", [](auto &_) {
+  using namespace caliber::server;
+
+  _.test("hello", []() {
+    auto data = encode(hello{protocol_version, "clang version 14.0.0"});
+    expect(data, equal_to("16:caliber-server 1,20:clang version 14.0.0,"));
+
+    hello h;
+    expect(decode(data, h), equal_to(data.size()));
+    expect(h.protocol, equal_to(protocol_version));
+    expect(h.version, equal_to("clang version 14.0.0"));
+  });
+
+  _.test("request", []() {
+    auto data = encode(request{{"clang++", "-fsyntax-only", "src.cpp"},
+                               std::nullopt});
+    request req;
+    expect(decode(data, req), equal_to(data.size()));
+    expect(req.args, array("clang++", "-fsyntax-only", "src.cpp"));
+    expect(req.input, equal_to(std::nullopt));
+
+    data = encode(request{{"clang++", "-"}, "int main() {}\n"});
+    expect(decode(data, req), equal_to(data.size()));
+    expect(req.args, array("clang++", "-"));
+    expect(req.input, equal_to("int main() {}\n"));
+  });
+
+  _.test("reply", []() {
+    auto data = encode(reply{verdict::fail, "src.cpp:1:1: error: oops\n",
+                             {"src.cpp", "header.hpp"}});
+    reply rep;
+    expect(decode(data, rep), equal_to(data.size()));
+    expect(rep.status, equal_to(verdict::fail));
+    expect(rep.output, equal_to("src.cpp:1:1: error: oops\n"));
+    expect(rep.includes, array("src.cpp", "header.hpp"));
+  });
+
+  _.test("multiple messages", []() {
+    auto first = encode(reply{verdict::pass, "", {"a.cpp"}});
+    auto second = encode(reply{verdict::unsupported, "", {}});
+    auto data = first + second;
+
+    reply rep;
+    expect(decode(data, rep), equal_to(first.size()));
+    expect(rep.status, equal_to(verdict::pass));
+    expect(decode(std::string_view(data).substr(first.size()), rep),
+           equal_to(second.size()));
+    expect(rep.status, equal_to(verdict::unsupported));
+  });
+
+  _.test("incomplete", []() {
+    auto data = encode(reply{verdict::pass, "output", {"a.cpp", "b.hpp"}});
+    reply rep;
+    for(std::size_t i = 0; i != data.size(); i++)
+      expect(decode(std::string_view(data).substr(0, i), rep), equal_to(0u));
+  });
+
+  _.test("malformed", []() {
+    hello h;
+    expect([&]() { decode("x:caliber,", h); },
+           thrown<std::runtime_error>("invalid message length"));
+    expect([&]() { decode("3:abcd", h); },
+           thrown<std::runtime_error>("unterminated message field"));
+    expect([&]() { decode("123456789012345678901234", h); },
+           thrown<std::runtime_error>("invalid message length"));
+
+    request req;
+    expect([&]() { decode("1:x,", req); },
+           thrown<std::runtime_error>("invalid message list"));
+  });
+
+  _.test("huge list", []() {
+    // A list claiming to be bigger than could fit in memory is just
+    // incomplete until its fields arrive.
+    request req;
+    expect(decode("20:18446744073709551615,1:a,", req), equal_to(0u));
+    expect([&]() { decode("20:18446744073709551615,1:a,x:", req); },
+           thrown<std::runtime_error>("invalid message length"));
+  });
+});
@@ -0,0 +1,129 @@
+#include <mettle.hpp>
+using namespace mettle;
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <optional>
+#include <random>
+
+#include "../src/test_index.hpp"
+
+struct index_fixture {
+  index_fixture() {
+    std::random_device rd;
+    dir = std::filesystem::temp_directory_path() /
+      ("caliber-test-" + std::to_string(rd()));
+    std::filesystem::create_directories(dir);
+    path = (dir / "index").string();
+  }
+
+  ~index_fixture() {
+    std::filesystem::remove_all(dir);
+  }
+
+  std::filesystem::path dir;
+  std::string path;
+};
+
+suite<index_fixture> test_index("test index", [](auto &_) {
+  _.test("empty", [](index_fixture &f) {
+    caliber::test_index index(f.path);
+    expect(index.lookup("test.cpp", {1, 2}).has_value(), equal_to(false));
+    index.save();
+    expect(std::filesystem::exists(f.path), equal_to(false));
+  });
+
+  _.test("save and load", [](index_fixture &f) {
+    caliber::test_header header;
+    header.args.expect_fail = true;
+    header.args.cases = true;
+    header.args.name = "my\ntest";
+    header.args.expect_error = "undeclared";
+    header.args.expect_error_line = 12;
+    header.args.attrs = {"slow", "skip"};
+    header.args.compilers = {"gcc"};
+    header.args.raw_args = {{"cc", "-Wall"}};
+    header.args.matrix = {{"std", {"c++17", "c++20"}}};
+    header.comp_args = {{"-D", {"foo=1"}}, {"std", {"c++17"}}};
+    {
+      caliber::test_index index(f.path);
+      index.update("test.cpp", {1, 2}, header);
+      index.update("bad.cpp", {3, 4}, {{}, {}, "Invalid command"});
+      index.save();
+    }
+
+    caliber::test_index index(f.path);
+    auto loaded = index.lookup("test.cpp", {1, 2});
+    expect(loaded.has_value(), equal_to(true));
+    expect(loaded->args.expect_fail, equal_to(true));
+    expect(loaded->args.profile, equal_to(false));
+    expect(loaded->args.cases, equal_to(true));
+    expect(loaded->args.name, equal_to("my\ntest"));
+    expect(loaded->args.expect_error, equal_to("undeclared"));
+    expect(loaded->args.expect_error_line, equal_to(12u));
+    expect(loaded->args.attrs, array("slow", "skip"));
+    expect(loaded->args.compilers, array("gcc"));
+    expect(loaded->args.raw_args.size(), equal_to(1u));
+    expect(loaded->args.raw_args[0].flavor, equal_to("cc"));
+    expect(loaded->args.raw_args[0].value, equal_to("-Wall"));
+    expect(loaded->args.matrix.size(), equal_to(1u));
+    expect(loaded->args.matrix[0].key, equal_to("std"));
+    expect(loaded->args.matrix[0].values, array("c++17", "c++20"));
+    expect(loaded->comp_args.size(), equal_to(2u));
+    expect(loaded->comp_args[0].string_key, equal_to("-D"));
+    expect(loaded->comp_args[0].value, array("foo=1"));
+    expect(loaded->comp_args[1].string_key, equal_to("std"));
+    expect(loaded->error, equal_to(""));
+
+    auto bad = index.lookup("bad.cpp", {3, 4});
+    expect(bad.has_value(), equal_to(true));
+    expect(bad->error, equal_to("Invalid command"));
+  });
+
+  _.test("changed file", [](index_fixture &f) {
+    caliber::test_index index(f.path);
+    index.update("test.cpp", {1, 2}, {});
+    expect(index.lookup("test.cpp", {1, 2}).has_value(), equal_to(true));
+    expect(index.lookup("test.cpp", {1, 3}).has_value(), equal_to(false));
+    expect(index.lookup("test.cpp", {5, 2}).has_value(), equal_to(false));
+    expect(index.lookup("other.cpp", {1, 2}).has_value(), equal_to(false));
+  });
+
+  _.test("concurrent saves", [](index_fixture &f) {
+    {
+      caliber::test_index index(f.path);
+      index.update("old.cpp", {1, 2}, {});
+      index.update("shared.cpp", {1, 2}, {});
+      index.save();
+    }
+
+    caliber::test_index first(f.path), second(f.path);
+    first.update("first.cpp", {1, 2}, {});
+    first.update("shared.cpp", {3, 4}, {});
+    second.update("second.cpp", {1, 2}, {});
+    first.save();
+    second.save();
+
+    caliber::test_index index(f.path);
+    expect(index.lookup("old.cpp", {1, 2}).has_value(), equal_to(true));
+    expect(index.lookup("first.cpp", {1, 2}).has_value(), equal_to(true));
+    expect(index.lookup("second.cpp", {1, 2}).has_value(), equal_to(true));
+    expect(index.lookup("shared.cpp", {3, 4}).has_value(), equal_to(true));
+  });
+
+  _.test("save waits for lock", [](index_fixture &f) {
+    caliber::test_index index(f.path);
+    index.update("test.cpp", {1, 2}, {});
+
+    std::optional<caliber::file_lock> lock(std::in_place, f.path + ".lock");
+    auto saved = std::async(std::launch::async, [&]() { index.save(); });
+    auto status = saved.wait_for(std::chrono::milliseconds(100));
+    expect(status == std::future_status::timeout, equal_to(true));
+    expect(std::filesystem::exists(f.path), equal_to(false));
+
+    lock.reset();
+    saved.get();
+    expect(std::filesystem::exists(f.path), equal_to(true));
+  });
+});